@@ -0,0 +1,94 @@
+/*
+ * allocationcounter.cpp - Counts heap allocations of the whole process
+ *
+ * Off-the-Record Messaging plugin for Psi+
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "allocationcounter.h"
+
+#include <stdlib.h>
+
+//-----------------------------------------------------------------------------
+
+#if defined(__GLIBC__)
+
+static quint64 s_allocations = 0;
+
+// The executable's definitions take precedence over those of the C
+// library for every shared library, which keeps the originals under
+// these names.
+extern "C" void* __libc_malloc(size_t size);
+extern "C" void* __libc_calloc(size_t count, size_t size);
+extern "C" void* __libc_realloc(void* pointer, size_t size);
+
+extern "C" void* malloc(size_t size)
+{
+    __sync_fetch_and_add(&s_allocations, 1);
+    return __libc_malloc(size);
+}
+
+extern "C" void* calloc(size_t count, size_t size)
+{
+    __sync_fetch_and_add(&s_allocations, 1);
+    return __libc_calloc(count, size);
+}
+
+extern "C" void* realloc(void* pointer, size_t size)
+{
+    __sync_fetch_and_add(&s_allocations, 1);
+    return __libc_realloc(pointer, size);
+}
+
+#endif
+
+//-----------------------------------------------------------------------------
+
+static quint64 allocations()
+{
+#if defined(__GLIBC__)
+    return __sync_fetch_and_add(&s_allocations, 0);
+#else
+    return 0;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+
+AllocationCounter::AllocationCounter()
+    : m_start(allocations())
+{
+}
+
+//-----------------------------------------------------------------------------
+
+bool AllocationCounter::isAvailable()
+{
+#if defined(__GLIBC__)
+    return true;
+#else
+    return false;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+
+quint64 AllocationCounter::count() const
+{
+    return allocations() - m_start;
+}
+
+//-----------------------------------------------------------------------------
@@ -0,0 +1,51 @@
+/*
+ * allocationcounter.h - Counts heap allocations of the whole process
+ *
+ * Off-the-Record Messaging plugin for Psi+
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef ALLOCATIONCOUNTER_H_
+#define ALLOCATIONCOUNTER_H_
+
+#include <QtGlobal>
+
+// ---------------------------------------------------------------------------
+
+/**
+ * Number of malloc(), calloc() and realloc() calls since construction,
+ * made by any library on any thread, operator new included.
+ *
+ * Counting replaces the allocator entry points of the C library, which
+ * is only done with glibc; elsewhere isAvailable() is false and the
+ * count stays 0.
+ */
+class AllocationCounter
+{
+public:
+    AllocationCounter();
+
+    static bool isAvailable();
+
+    quint64 count() const;
+
+private:
+    quint64 m_start;
+};
+
+// ---------------------------------------------------------------------------
+
+#endif
@@ -0,0 +1,52 @@
+include(../../plugins.inc)
+
+#Headless benchmark of the plugin core, see main.cpp
+TARGET              = otrbench
+TEMPLATE            = app
+QT                  = core xml
+CONFIG             -= plugin
+CONFIG             += console util
+CONFIG             -= app_bundle
+DESTDIR             = .
+
+LIBS += -lotr -lgcrypt -lgpg-error
+
+greaterThan(QT_MAJOR_VERSION, 4) {
+	QT += concurrent
+}
+
+INCLUDEPATH += ..
+DEPENDPATH  += ..
+
+HEADERS = ../otrmessaging.h \
+      ../otrinternal.h \
+      ../otrnametable.h \
+      ../otrkeygenerator.h \
+      ../otrfingerprintstore.h \
+      ../otrmetrics.h \
+      ../otrcapabilitycache.h \
+      ../otrlextensions.h \
+      ../otrroutingtable.h \
+      ../otrsessiontable.h \
+      ../stanza_catchers.h \
+      loopbackcallback.h \
+      allocationcounter.h \
+      benchresults.h \
+      otrbenchmark.h
+
+SOURCES = ../otrmessaging.cpp \
+      ../otrinternal.cpp \
+      ../otrnametable.cpp \
+      ../otrkeygenerator.cpp \
+      ../otrfingerprintstore.cpp \
+      ../otrmetrics.cpp \
+      ../otrcapabilitycache.cpp \
+      ../otrlextensions.c \
+      ../otrroutingtable.cpp \
+      ../otrsessiontable.cpp \
+      ../stanza_catchers.cpp \
+      loopbackcallback.cpp \
+      allocationcounter.cpp \
+      benchresults.cpp \
+      otrbenchmark.cpp \
+      main.cpp
@@ -0,0 +1,190 @@
+/*
+ * benchresults.cpp - Collected benchmark results and their JSON form
+ *
+ * Off-the-Record Messaging plugin for Psi+
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "benchresults.h"
+
+#include <algorithm>
+
+//-----------------------------------------------------------------------------
+
+JsonObject::JsonObject()
+    : m_fields()
+{
+}
+
+//-----------------------------------------------------------------------------
+
+bool JsonObject::isEmpty() const
+{
+    return m_fields.isEmpty();
+}
+
+//-----------------------------------------------------------------------------
+
+void JsonObject::insert(const QString& key, int value)
+{
+    insertRaw(key, QByteArray::number(value));
+}
+
+//-----------------------------------------------------------------------------
+
+void JsonObject::insert(const QString& key, qint64 value)
+{
+    insertRaw(key, QByteArray::number(value));
+}
+
+//-----------------------------------------------------------------------------
+
+void JsonObject::insert(const QString& key, double value)
+{
+    insertRaw(key, QByteArray::number(value, 'f', 3));
+}
+
+//-----------------------------------------------------------------------------
+
+void JsonObject::insert(const QString& key, bool value)
+{
+    insertRaw(key, value? "true" : "false");
+}
+
+//-----------------------------------------------------------------------------
+
+void JsonObject::insert(const QString& key, const char* value)
+{
+    insertRaw(key, jsonString(QString::fromUtf8(value)));
+}
+
+//-----------------------------------------------------------------------------
+
+void JsonObject::insert(const QString& key, const QString& value)
+{
+    insertRaw(key, jsonString(value));
+}
+
+//-----------------------------------------------------------------------------
+
+void JsonObject::insert(const QString& key, const JsonObject& value)
+{
+    Field field;
+    field.key    = key;
+    field.object = QSharedPointer<JsonObject>(new JsonObject(value));
+    m_fields.append(field);
+}
+
+//-----------------------------------------------------------------------------
+
+void JsonObject::insertRaw(const QString& key, const QByteArray& json)
+{
+    Field field;
+    field.key   = key;
+    field.value = json.trimmed();
+    m_fields.append(field);
+}
+
+//-----------------------------------------------------------------------------
+
+QByteArray JsonObject::toJson(int indent) const
+{
+    QByteArray pad(indent + 2, ' ');
+    QByteArray json("{");
+    for (int i = 0; i < m_fields.size(); i++)
+    {
+        const Field& field = m_fields.at(i);
+        json += i == 0? "\n" : ",\n";
+        json += pad + jsonString(field.key) + ": ";
+        json += field.object? field.object->toJson(indent + 2) : field.value;
+    }
+    json += m_fields.isEmpty()? QByteArray("}") : "\n" + QByteArray(indent, ' ') + "}";
+    return json;
+}
+
+//-----------------------------------------------------------------------------
+
+QByteArray JsonObject::jsonString(const QString& text)
+{
+    QByteArray json("\"");
+    foreach (char c, text.toUtf8())
+    {
+        if (c == '"' || c == '\\')
+        {
+            json += '\\';
+        }
+        json += c;
+    }
+    json += '"';
+    return json;
+}
+
+//-----------------------------------------------------------------------------
+
+Samples::Samples()
+    : m_nsecs()
+{
+}
+
+//-----------------------------------------------------------------------------
+
+void Samples::add(qint64 nsecs)
+{
+    m_nsecs.append(nsecs);
+}
+
+//-----------------------------------------------------------------------------
+
+int Samples::count() const
+{
+    return m_nsecs.size();
+}
+
+//-----------------------------------------------------------------------------
+
+qint64 Samples::total() const
+{
+    qint64 total = 0;
+    foreach (qint64 nsecs, m_nsecs)
+    {
+        total += nsecs;
+    }
+    return total;
+}
+
+//-----------------------------------------------------------------------------
+
+JsonObject Samples::toJson() const
+{
+    JsonObject json;
+    json.insert("count", m_nsecs.size());
+    if (m_nsecs.isEmpty())
+    {
+        return json;
+    }
+
+    QVector<qint64> sorted(m_nsecs);
+    std::sort(sorted.begin(), sorted.end());
+
+    json.insert("mean_us",   total() / 1000.0 / sorted.size());
+    json.insert("median_us", sorted.at(sorted.size() / 2) / 1000.0);
+    json.insert("p90_us",    sorted.at(sorted.size() * 9 / 10) / 1000.0);
+    json.insert("min_us",    sorted.first() / 1000.0);
+    json.insert("max_us",    sorted.last() / 1000.0);
+    return json;
+}
+
+//-----------------------------------------------------------------------------
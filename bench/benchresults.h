@@ -0,0 +1,102 @@
+/*
+ * benchresults.h - Collected benchmark results and their JSON form
+ *
+ * Off-the-Record Messaging plugin for Psi+
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef BENCHRESULTS_H_
+#define BENCHRESULTS_H_
+
+#include <QList>
+#include <QVector>
+#include <QString>
+#include <QByteArray>
+#include <QSharedPointer>
+
+// ---------------------------------------------------------------------------
+
+/**
+ * JSON object which keeps its keys in insertion order, so that the
+ * output of two runs can be compared line by line.
+ */
+class JsonObject
+{
+public:
+    JsonObject();
+
+    bool isEmpty() const;
+
+    void insert(const QString& key, int value);
+    void insert(const QString& key, qint64 value);
+    void insert(const QString& key, double value);
+    void insert(const QString& key, bool value);
+    void insert(const QString& key, const char* value);
+    void insert(const QString& key, const QString& value);
+    void insert(const QString& key, const JsonObject& value);
+
+    /**
+     * Insert a value which is JSON already, e.g. OtrMetrics::toJson().
+     */
+    void insertRaw(const QString& key, const QByteArray& json);
+
+    QByteArray toJson(int indent = 0) const;
+
+    static QByteArray jsonString(const QString& text);
+
+private:
+    struct Field
+    {
+        QString                     key;
+        QByteArray                  value;
+        QSharedPointer<JsonObject>  object;
+    };
+
+    QList<Field> m_fields;
+};
+
+// ---------------------------------------------------------------------------
+
+/**
+ * Durations of repeated runs of one operation.
+ */
+class Samples
+{
+public:
+    Samples();
+
+    void add(qint64 nsecs);
+
+    int count() const;
+
+    /**
+     * Sum of all samples in nanoseconds.
+     */
+    qint64 total() const;
+
+    /**
+     * Count, mean, median, 90th percentile, minimum and maximum,
+     * in microseconds.
+     */
+    JsonObject toJson() const;
+
+private:
+    QVector<qint64> m_nsecs;
+};
+
+// ---------------------------------------------------------------------------
+
+#endif
@@ -0,0 +1,309 @@
+/*
+ * loopbackcallback.cpp - OtrCallback connecting two in-process peers
+ *
+ * Off-the-Record Messaging plugin for Psi+
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "loopbackcallback.h"
+
+//-----------------------------------------------------------------------------
+
+LoopbackCallback::LoopbackCallback(const QString& dataDir)
+    : m_object(),
+      m_dataDir(dataDir),
+      m_outbox(),
+      m_maxMessageSize(0),
+      m_smpRequests(),
+      m_smpProgress(),
+      m_generatedFingerprint(),
+      m_keyGenerated(false)
+{
+}
+
+//-----------------------------------------------------------------------------
+
+QStringList LoopbackCallback::takeOutbox()
+{
+    QStringList outbox = m_outbox;
+    m_outbox.clear();
+    return outbox;
+}
+
+//-----------------------------------------------------------------------------
+
+bool LoopbackCallback::hasOutbox() const
+{
+    return !m_outbox.isEmpty();
+}
+
+//-----------------------------------------------------------------------------
+
+void LoopbackCallback::setMaxMessageSize(int size)
+{
+    m_maxMessageSize = size;
+}
+
+//-----------------------------------------------------------------------------
+
+QStringList LoopbackCallback::takeSmpRequests()
+{
+    QStringList requests = m_smpRequests;
+    m_smpRequests.clear();
+    return requests;
+}
+
+//-----------------------------------------------------------------------------
+
+int LoopbackCallback::smpProgress(const QString& contact) const
+{
+    return m_smpProgress.value(contact);
+}
+
+//-----------------------------------------------------------------------------
+
+void LoopbackCallback::resetSmp()
+{
+    m_smpRequests.clear();
+    m_smpProgress.clear();
+}
+
+//-----------------------------------------------------------------------------
+
+QString LoopbackCallback::generatedFingerprint() const
+{
+    return m_generatedFingerprint;
+}
+
+//-----------------------------------------------------------------------------
+
+bool LoopbackCallback::keyGenerated() const
+{
+    return m_keyGenerated;
+}
+
+//-----------------------------------------------------------------------------
+
+void LoopbackCallback::resetKeyGenerated()
+{
+    m_keyGenerated = false;
+    m_generatedFingerprint.clear();
+}
+
+//-----------------------------------------------------------------------------
+
+QObject* LoopbackCallback::instance()
+{
+    return &m_object;
+}
+
+//-----------------------------------------------------------------------------
+
+QString LoopbackCallback::dataDir()
+{
+    return m_dataDir;
+}
+
+//-----------------------------------------------------------------------------
+
+psiotr::OtrPolicy LoopbackCallback::policy() const
+{
+    return psiotr::OTR_POLICY_ENABLED;
+}
+
+//-----------------------------------------------------------------------------
+
+void LoopbackCallback::sendMessage(const QString& account, const QString& contact,
+                                   const QString& message)
+{
+    Q_UNUSED(account);
+    Q_UNUSED(contact);
+
+    m_outbox.append(message);
+}
+
+//-----------------------------------------------------------------------------
+
+void LoopbackCallback::sendMessages(const QString& account, const QString& contact,
+                                    const QStringList& messages)
+{
+    Q_UNUSED(account);
+    Q_UNUSED(contact);
+
+    m_outbox += messages;
+}
+
+//-----------------------------------------------------------------------------
+
+int LoopbackCallback::maxMessageSize(const QString& account)
+{
+    Q_UNUSED(account);
+
+    return m_maxMessageSize;
+}
+
+//-----------------------------------------------------------------------------
+
+bool LoopbackCallback::isLoggedIn(const QString& account, const QString& contact)
+{
+    Q_UNUSED(account);
+    Q_UNUSED(contact);
+
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+
+void LoopbackCallback::notifyUser(const QString& account, const QString& contact,
+                                  const QString& message,
+                                  const psiotr::OtrNotifyType& type)
+{
+    Q_UNUSED(account);
+    Q_UNUSED(contact);
+    Q_UNUSED(message);
+    Q_UNUSED(type);
+}
+
+//-----------------------------------------------------------------------------
+
+bool LoopbackCallback::displayOtrMessage(const QString& account,
+                                         const QString& contact,
+                                         const QString& message)
+{
+    Q_UNUSED(account);
+    Q_UNUSED(contact);
+    Q_UNUSED(message);
+
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+
+void LoopbackCallback::stateChange(const QString& account, const QString& contact,
+                                   psiotr::OtrStateChange change)
+{
+    Q_UNUSED(account);
+    Q_UNUSED(contact);
+    Q_UNUSED(change);
+}
+
+//-----------------------------------------------------------------------------
+
+void LoopbackCallback::receivedSMP(const QString& account, const QString& contact,
+                                   const QString& question)
+{
+    Q_UNUSED(account);
+    Q_UNUSED(question);
+
+    m_smpRequests.append(contact);
+}
+
+//-----------------------------------------------------------------------------
+
+void LoopbackCallback::updateSMP(const QString& account, const QString& contact,
+                                 int progress)
+{
+    Q_UNUSED(account);
+
+    m_smpProgress.insert(contact, progress);
+}
+
+//-----------------------------------------------------------------------------
+
+QString LoopbackCallback::humanAccount(const QString& accountId)
+{
+    return accountId;
+}
+
+//-----------------------------------------------------------------------------
+
+QString LoopbackCallback::humanAccountPublic(const QString& accountId)
+{
+    return accountId;
+}
+
+//-----------------------------------------------------------------------------
+
+QString LoopbackCallback::humanContact(const QString& accountId,
+                                       const QString& contact)
+{
+    Q_UNUSED(accountId);
+
+    return contact;
+}
+
+//-----------------------------------------------------------------------------
+
+void LoopbackCallback::authenticateContact(const QString& account,
+                                           const QString& contact)
+{
+    Q_UNUSED(account);
+    Q_UNUSED(contact);
+}
+
+//-----------------------------------------------------------------------------
+
+void LoopbackCallback::keyGenerated(const QString& account,
+                                    const QString& fingerprint)
+{
+    Q_UNUSED(account);
+
+    m_generatedFingerprint = fingerprint;
+    m_keyGenerated         = true;
+}
+
+//-----------------------------------------------------------------------------
+
+void LoopbackCallback::keyDeleted(const QString& account)
+{
+    Q_UNUSED(account);
+}
+
+//-----------------------------------------------------------------------------
+
+void LoopbackCallback::fingerprintsChanged(const QString& account,
+                                           const QString& contact)
+{
+    Q_UNUSED(account);
+    Q_UNUSED(contact);
+}
+
+//-----------------------------------------------------------------------------
+
+void LoopbackCallback::otrStateChanged(const Jid& AStreamJid,
+                                       const Jid& AContactJid) const
+{
+    Q_UNUSED(AStreamJid);
+    Q_UNUSED(AContactJid);
+}
+
+//-----------------------------------------------------------------------------
+
+void LoopbackCallback::privateKeysChanged(const QString& account) const
+{
+    Q_UNUSED(account);
+}
+
+//-----------------------------------------------------------------------------
+
+void LoopbackCallback::contactFingerprintsChanged(const QString& account,
+                                                  const QString& contact) const
+{
+    Q_UNUSED(account);
+    Q_UNUSED(contact);
+}
+
+//-----------------------------------------------------------------------------
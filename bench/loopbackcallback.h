@@ -0,0 +1,126 @@
+/*
+ * loopbackcallback.h - OtrCallback connecting two in-process peers
+ *
+ * Off-the-Record Messaging plugin for Psi+
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef LOOPBACKCALLBACK_H_
+#define LOOPBACKCALLBACK_H_
+
+#include "otrmessaging.h"
+
+#include <QObject>
+#include <QHash>
+#include <QString>
+#include <QStringList>
+
+// ---------------------------------------------------------------------------
+
+/**
+ * Callback of one benchmark peer. Everything libotr sends is kept in an
+ * outbox until the benchmark delivers it to the other peer, so libotr is
+ * never entered again from one of its own callbacks. Notices for the
+ * user are dropped, state changes and SMP requests are recorded.
+ */
+class LoopbackCallback : public psiotr::OtrCallback
+{
+public:
+    LoopbackCallback(const QString& dataDir);
+
+    /**
+     * Messages sent since the last call, in order.
+     */
+    QStringList takeOutbox();
+
+    bool hasOutbox() const;
+
+    void setMaxMessageSize(int size);
+
+    /**
+     * Contacts who asked for the SMP secret since the last call.
+     */
+    QStringList takeSmpRequests();
+
+    /**
+     * Last SMP progress reported for contact, 0 if none.
+     */
+    int smpProgress(const QString& contact) const;
+
+    void resetSmp();
+
+    /**
+     * Fingerprint of the last generated key, empty if generation failed.
+     * keyGenerated() tells whether any generation finished.
+     */
+    QString generatedFingerprint() const;
+    bool keyGenerated() const;
+    void resetKeyGenerated();
+
+    virtual QObject* instance();
+    virtual QString dataDir();
+    virtual psiotr::OtrPolicy policy() const;
+
+    virtual void sendMessage(const QString& account, const QString& contact,
+                             const QString& message);
+    virtual void sendMessages(const QString& account, const QString& contact,
+                              const QStringList& messages);
+    virtual int maxMessageSize(const QString& account);
+    virtual bool isLoggedIn(const QString& account, const QString& contact);
+
+    virtual void notifyUser(const QString& account, const QString& contact,
+                            const QString& message,
+                            const psiotr::OtrNotifyType& type);
+    virtual bool displayOtrMessage(const QString& account, const QString& contact,
+                                   const QString& message);
+    virtual void stateChange(const QString& account, const QString& contact,
+                             psiotr::OtrStateChange change);
+
+    virtual void receivedSMP(const QString& account, const QString& contact,
+                             const QString& question);
+    virtual void updateSMP(const QString& account, const QString& contact,
+                           int progress);
+
+    virtual QString humanAccount(const QString& accountId);
+    virtual QString humanAccountPublic(const QString& accountId);
+    virtual QString humanContact(const QString& accountId,
+                                 const QString& contact);
+    virtual void authenticateContact(const QString& account, const QString& contact);
+
+    virtual void keyGenerated(const QString& account, const QString& fingerprint);
+    virtual void keyDeleted(const QString& account);
+    virtual void fingerprintsChanged(const QString& account, const QString& contact);
+
+protected:
+    virtual void otrStateChanged(const Jid& AStreamJid, const Jid& AContactJid) const;
+    virtual void privateKeysChanged(const QString& account) const;
+    virtual void contactFingerprintsChanged(const QString& account,
+                                            const QString& contact) const;
+
+private:
+    QObject            m_object;
+    QString            m_dataDir;
+    QStringList        m_outbox;
+    int                m_maxMessageSize;
+    QStringList        m_smpRequests;
+    QHash<QString, int> m_smpProgress;
+    QString            m_generatedFingerprint;
+    bool               m_keyGenerated;
+};
+
+// ---------------------------------------------------------------------------
+
+#endif
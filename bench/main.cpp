@@ -0,0 +1,156 @@
+/*
+ * main.cpp - Headless benchmark of the OTR plugin core
+ *
+ * Off-the-Record Messaging plugin for Psi+
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "otrbenchmark.h"
+#include "benchresults.h"
+
+#include <QCoreApplication>
+#include <QStringList>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QElapsedTimer>
+
+#include <stdio.h>
+
+#include <libotr/version.h>
+
+//-----------------------------------------------------------------------------
+
+static void usage()
+{
+    fprintf(stderr,
+            "Usage: otrbench [-o FILE] [SCENARIO...]\n"
+            "Runs the given scenarios, or all of them, and writes the results\n"
+            "as JSON to FILE or to the standard output.\n"
+            "Scenarios: %s\n",
+            qPrintable(OtrBenchmark::scenarios().join(" ")));
+}
+
+//-----------------------------------------------------------------------------
+
+static void removeDir(const QString& path)
+{
+    QDir dir(path);
+    foreach (const QFileInfo& info,
+             dir.entryInfoList(QDir::AllEntries | QDir::Hidden | QDir::NoDotAndDotDot))
+    {
+        if (info.isDir())
+        {
+            removeDir(info.filePath());
+        }
+        else
+        {
+            QFile::remove(info.filePath());
+        }
+    }
+    dir.rmdir(path);
+}
+
+//-----------------------------------------------------------------------------
+
+int main(int argc, char* argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QString output;
+    QStringList scenarios;
+    QStringList args = app.arguments().mid(1);
+    for (int i = 0; i < args.size(); i++)
+    {
+        if ((args.at(i) == "-o" || args.at(i) == "--output") && i + 1 < args.size())
+        {
+            output = args.at(++i);
+        }
+        else if (args.at(i).startsWith("-"))
+        {
+            usage();
+            return 2;
+        }
+        else
+        {
+            scenarios.append(args.at(i));
+        }
+    }
+    if (scenarios.isEmpty())
+    {
+        scenarios = OtrBenchmark::scenarios();
+    }
+
+    // Every run starts without keys, fingerprints or instance tags
+    QString workDir = QDir(QDir::tempPath()).filePath(QString("otrbench-%1")
+                                                      .arg(QCoreApplication::applicationPid()));
+    removeDir(workDir);
+
+    JsonObject report;
+    report.insert("qt", qVersion());
+    report.insert("libotr", OTRL_VERSION);
+
+    bool ok = true;
+    {
+        OtrBenchmark benchmark(workDir);
+        if (benchmark.setUp())
+        {
+            JsonObject results;
+            foreach (const QString& scenario, scenarios)
+            {
+                fprintf(stderr, "%s...", qPrintable(scenario));
+
+                QElapsedTimer timer;
+                timer.start();
+                JsonObject result;
+                bool passed = benchmark.run(scenario, result);
+                results.insert(scenario, result);
+                ok = ok && passed;
+
+                fprintf(stderr, " %s, %lld ms\n", passed? "done" : "FAILED",
+                        static_cast<long long>(timer.elapsed()));
+            }
+            report.insert("scenarios", results);
+        }
+        else
+        {
+            report.insert("error", "generating the keys failed");
+            ok = false;
+        }
+        report.insert("metrics", benchmark.metrics());
+    }
+    removeDir(workDir);
+
+    QByteArray json = report.toJson() + "\n";
+    if (output.isEmpty())
+    {
+        fwrite(json.constData(), 1, json.size(), stdout);
+    }
+    else
+    {
+        QFile file(output);
+        if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) ||
+            file.write(json) != json.size())
+        {
+            fprintf(stderr, "Cannot write %s\n", qPrintable(output));
+            return 2;
+        }
+    }
+
+    return ok? 0 : 1;
+}
+
+//-----------------------------------------------------------------------------
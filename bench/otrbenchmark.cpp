@@ -0,0 +1,1310 @@
+/*
+ * otrbenchmark.cpp - Benchmark scenarios for OtrMessaging
+ *
+ * Off-the-Record Messaging plugin for Psi+
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "otrbenchmark.h"
+#include "loopbackcallback.h"
+#include "allocationcounter.h"
+#include "otrmessaging.h"
+#include "otrmetrics.h"
+#include "otrroutingtable.h"
+#include "otrsessiontable.h"
+#include "stanza_catchers.h"
+
+#include <utils/message.h>
+
+#include <QCoreApplication>
+#include <QEventLoop>
+#include <QElapsedTimer>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+
+#ifdef Q_OS_LINUX
+#include <unistd.h>
+#endif
+
+//-----------------------------------------------------------------------------
+
+static const int KEY_TIMEOUT_MSECS = 120 * 1000;
+
+static const int AKE_RUNS          = 20;
+static const int SMP_RUNS          = 10;
+static const int KEY_RUNS          = 3;
+static const int FINGERPRINT_RUNS  = 200;
+
+/**
+ * Message sizes of the throughput scenario, and the amount of text
+ * sent per size, within the bounds on the number of messages.
+ */
+static const int THROUGHPUT_SIZES[]   = { 16, 256, 4096, 65536 };
+static const int THROUGHPUT_BYTES     = 4 * 1024 * 1024;
+static const int THROUGHPUT_MIN_RUNS  = 20;
+static const int THROUGHPUT_MAX_RUNS  = 2000;
+static const int THROUGHPUT_WARMUP    = 10;
+
+// 0 sends messages unfragmented
+static const int LARGE_SIZE             = 1024 * 1024;
+static const int LARGE_RUNS             = 5;
+static const int LARGE_FRAGMENT_SIZES[] = { 0, 65536, 8192 };
+
+/**
+ * Contexts per account of the lookup scenario, and lookups per count.
+ */
+static const int LOOKUP_COUNTS[] = { 10, 100, 1000, 10000, 100000 };
+static const int LOOKUP_RUNS     = 10000;
+
+static const int ALLOCATION_RUNS = 1000;
+static const int ALLOCATION_SIZE = 256;
+
+// As many trust changes as journal records trigger a compaction
+static const int STORE_COUNTS[]      = { 1000, 10000, 100000 };
+static const int STORE_WRITE_RUNS    = 1000;
+static const int STORE_TIMEOUT_MSECS = 60 * 1000;
+
+static const int STARTUP_FINGERPRINTS = 50000;
+static const int STARTUP_RUNS         = 5;
+
+static const int CATCHER_RUNS = 2000;
+static const int CATCHER_SIZE = 256;
+
+static const int ROSTER_CONTACTS  = 5000;
+static const int ROSTER_RESOURCES = 3;
+static const int ROSTER_REPLAYS   = 5;
+
+// Every STORM_FLAP_EVERY-th contact goes offline and comes back
+static const int STORM_CONTACTS   = 5000;
+static const int STORM_KNOWN      = 1000;
+static const int STORM_FLAP_EVERY = 5;
+
+//-----------------------------------------------------------------------------
+
+static QString benchText(int size, int seed)
+{
+    QString text(size, QChar('a'));
+    QChar* data = text.data();
+    for (int i = 0; i < size; i++)
+    {
+        data[i] = QChar('a' + (i + seed) % 26);
+    }
+    return text;
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * Deterministic pseudo-random numbers, the same in every run.
+ */
+static quint32 nextRandom(quint32& seed)
+{
+    seed = seed * 1103515245u + 12345u;
+    return seed >> 8;
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * Resident set size of the process in KiB, or -1 where it is unknown.
+ */
+static qint64 residentKb()
+{
+#ifdef Q_OS_LINUX
+    QFile statm("/proc/self/statm");
+    if (statm.open(QIODevice::ReadOnly))
+    {
+        QList<QByteArray> fields = statm.readAll().split(' ');
+        if (fields.size() > 1)
+        {
+            return fields.at(1).toLongLong() * sysconf(_SC_PAGESIZE) / 1024;
+        }
+    }
+#endif
+    return -1;
+}
+
+//-----------------------------------------------------------------------------
+
+static JsonObject error(const QString& message)
+{
+    JsonObject json;
+    json.insert("error", message);
+    return json;
+}
+
+//-----------------------------------------------------------------------------
+
+OtrBenchmark::Peer::Peer()
+    : account(),
+      jid(),
+      dataDir(),
+      callback(NULL),
+      otr(NULL)
+{
+}
+
+//-----------------------------------------------------------------------------
+
+OtrBenchmark::OtrBenchmark(const QString& workDir)
+    : m_workDir(workDir),
+      m_alice(),
+      m_bob(),
+      m_smpSecret()
+{
+}
+
+//-----------------------------------------------------------------------------
+
+OtrBenchmark::~OtrBenchmark()
+{
+    destroyPeer(m_alice);
+    destroyPeer(m_bob);
+}
+
+//-----------------------------------------------------------------------------
+
+QStringList OtrBenchmark::scenarios()
+{
+    return QStringList() << "keys" << "ake" << "throughput" << "smp"
+                         << "fingerprints" << "context_lookup" << "allocations"
+                         << "store_writes" << "startup"
+                         << "catchers" << "roster_replay"
+                         << "presence_storm" << "large_messages";
+}
+
+//-----------------------------------------------------------------------------
+
+bool OtrBenchmark::setUp()
+{
+    QDir workDir(m_workDir);
+    return createPeer(m_alice, "alice", workDir.filePath("alice")) &&
+           createPeer(m_bob,   "bob",   workDir.filePath("bob")) &&
+           generateKey(m_alice, m_alice.account) &&
+           generateKey(m_bob,   m_bob.account);
+}
+
+//-----------------------------------------------------------------------------
+
+bool OtrBenchmark::run(const QString& scenario, JsonObject& result)
+{
+    bool ok = false;
+    if (scenario == "keys")
+    {
+        ok = runKeys(result);
+    }
+    else if (scenario == "ake")
+    {
+        ok = runAke(result);
+    }
+    else if (scenario == "throughput")
+    {
+        ok = runThroughput(result);
+    }
+    else if (scenario == "smp")
+    {
+        ok = runSmp(result);
+    }
+    else if (scenario == "fingerprints")
+    {
+        ok = runFingerprints(result);
+    }
+    else if (scenario == "context_lookup")
+    {
+        ok = runContextLookup(result);
+    }
+    else if (scenario == "allocations")
+    {
+        ok = runAllocations(result);
+    }
+    else if (scenario == "store_writes")
+    {
+        ok = runStoreWrites(result);
+    }
+    else if (scenario == "startup")
+    {
+        ok = runStartup(result);
+    }
+    else if (scenario == "catchers")
+    {
+        ok = runCatchers(result);
+    }
+    else if (scenario == "roster_replay")
+    {
+        ok = runRosterReplay(result);
+    }
+    else if (scenario == "presence_storm")
+    {
+        ok = runPresenceStorm(result);
+    }
+    else if (scenario == "large_messages")
+    {
+        ok = runLargeMessages(result);
+    }
+    else
+    {
+        result = error("unknown scenario");
+    }
+
+    // Leftovers of a failed scenario must not reach the next one
+    m_smpSecret.clear();
+    pump(m_alice, m_bob);
+    return ok;
+}
+
+//-----------------------------------------------------------------------------
+
+JsonObject OtrBenchmark::metrics() const
+{
+    JsonObject json;
+    if (m_alice.otr)
+    {
+        json.insertRaw(m_alice.account, m_alice.otr->metrics()->toJson());
+    }
+    if (m_bob.otr)
+    {
+        json.insertRaw(m_bob.account, m_bob.otr->metrics()->toJson());
+    }
+    return json;
+}
+
+//-----------------------------------------------------------------------------
+
+bool OtrBenchmark::createPeer(Peer& peer, const QString& name,
+                              const QString& dataDir)
+{
+    if (!QDir().mkpath(dataDir))
+    {
+        return false;
+    }
+
+    peer.account  = name;
+    peer.jid      = name + "@bench.local/bench";
+    peer.dataDir  = dataDir;
+    peer.callback = new LoopbackCallback(dataDir);
+    peer.otr      = new psiotr::OtrMessaging(peer.callback,
+                                             peer.callback->policy());
+    peer.otr->metrics()->setEnabled(true);
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrBenchmark::destroyPeer(Peer& peer)
+{
+    delete peer.otr;
+    delete peer.callback;
+    peer.otr      = NULL;
+    peer.callback = NULL;
+}
+
+//-----------------------------------------------------------------------------
+
+bool OtrBenchmark::writeFingerprints(const QString& dataDir,
+                                     const QString& account, int count)
+{
+    if (!QDir().mkpath(dataDir))
+    {
+        return false;
+    }
+
+    QFile file(QDir(dataDir).filePath("otr.fingerprints"));
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        return false;
+    }
+
+    // username, accountname, protocol, fingerprint, trust
+    QByteArray accountName = account.toUtf8();
+    quint32 seed = 1;
+    for (int i = 0; i < count; i++)
+    {
+        QByteArray fingerprint(20, 0);
+        for (int j = 0; j < fingerprint.size(); j++)
+        {
+            fingerprint[j] = static_cast<char>(nextRandom(seed));
+        }
+
+        QByteArray line = contactName(i).toUtf8() + '\t' + accountName +
+                          "\tprpl-jabber\t" + fingerprint.toHex() + '\t' +
+                          (i % 2? "verified" : "") + '\n';
+        if (file.write(line) != line.size())
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+
+QString OtrBenchmark::contactName(int index)
+{
+    return QString("contact%1@bench.local").arg(index);
+}
+
+//-----------------------------------------------------------------------------
+
+bool OtrBenchmark::generateKey(Peer& peer, const QString& account)
+{
+    peer.callback->resetKeyGenerated();
+    peer.otr->generateKey(account);
+
+    QElapsedTimer timer;
+    timer.start();
+    while (!peer.callback->keyGenerated() && !timer.hasExpired(KEY_TIMEOUT_MSECS))
+    {
+        QCoreApplication::processEvents(QEventLoop::WaitForMoreEvents, 100);
+    }
+    return !peer.callback->generatedFingerprint().isEmpty();
+}
+
+//-----------------------------------------------------------------------------
+
+int OtrBenchmark::deliver(Peer& from, Peer& to, QStringList* plaintexts)
+{
+    QStringList messages = from.callback->takeOutbox();
+    foreach (const QString& message, messages)
+    {
+        QString decrypted;
+        if (to.otr->decryptMessage(to.account, from.jid, message, decrypted) ==
+            psiotr::OTR_MESSAGETYPE_OTR && plaintexts)
+        {
+            plaintexts->append(decrypted);
+        }
+    }
+    return messages.size();
+}
+
+//-----------------------------------------------------------------------------
+
+int OtrBenchmark::pump(Peer& a, Peer& b)
+{
+    int count = 0;
+    while (a.callback->hasOutbox() || b.callback->hasOutbox())
+    {
+        count += deliver(a, b);
+        count += deliver(b, a);
+
+        // Answered here rather than from the callback, which runs
+        // inside libotr
+        if (!m_smpSecret.isEmpty())
+        {
+            foreach (const QString& contact, a.callback->takeSmpRequests())
+            {
+                a.otr->continueSMP(a.account, contact, m_smpSecret);
+            }
+            foreach (const QString& contact, b.callback->takeSmpRequests())
+            {
+                b.otr->continueSMP(b.account, contact, m_smpSecret);
+            }
+        }
+    }
+    return count;
+}
+
+//-----------------------------------------------------------------------------
+
+bool OtrBenchmark::isEncrypted(Peer& a, Peer& b)
+{
+    return a.otr->getMessageState(a.account, b.jid) == psiotr::OTR_MESSAGESTATE_ENCRYPTED &&
+           b.otr->getMessageState(b.account, a.jid) == psiotr::OTR_MESSAGESTATE_ENCRYPTED;
+}
+
+//-----------------------------------------------------------------------------
+
+bool OtrBenchmark::establish(Peer& a, Peer& b)
+{
+    if (isEncrypted(a, b))
+    {
+        return true;
+    }
+    endSessions(a, b);
+    a.otr->startSession(a.account, b.jid);
+    pump(a, b);
+    return isEncrypted(a, b);
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrBenchmark::endSessions(Peer& a, Peer& b)
+{
+    a.otr->endSession(a.account, b.jid);
+    pump(a, b);
+    b.otr->endSession(b.account, a.jid);
+    pump(a, b);
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * Generation of a key for a further account, which includes storing
+ * all keys of the peer, and the rewrite of the keys file when it is
+ * deleted again.
+ */
+bool OtrBenchmark::runKeys(JsonObject& result)
+{
+    Samples generation;
+    Samples deletion;
+    QElapsedTimer timer;
+
+    for (int i = 0; i < KEY_RUNS; i++)
+    {
+        QString account = QString("spare%1").arg(i);
+
+        timer.start();
+        if (!generateKey(m_alice, account))
+        {
+            result = error("key generation failed");
+            return false;
+        }
+        generation.add(timer.nsecsElapsed());
+
+        timer.start();
+        m_alice.otr->deleteKey(account);
+        deletion.add(timer.nsecsElapsed());
+    }
+
+    result.insert("generate_and_store", generation.toJson());
+    result.insert("delete_and_store", deletion.toJson());
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * Query until both sides are encrypted, after ending the previous
+ * session on both sides.
+ */
+bool OtrBenchmark::runAke(JsonObject& result)
+{
+    Samples ake;
+    int messages = 0;
+    QElapsedTimer timer;
+
+    for (int i = 0; i < AKE_RUNS; i++)
+    {
+        endSessions(m_alice, m_bob);
+
+        timer.start();
+        m_alice.otr->startSession(m_alice.account, m_bob.jid);
+        messages += pump(m_alice, m_bob);
+        ake.add(timer.nsecsElapsed());
+
+        if (!isEncrypted(m_alice, m_bob))
+        {
+            result = error("AKE did not finish");
+            return false;
+        }
+    }
+
+    result.insert("ake", ake.toJson());
+    result.insert("messages_per_ake", static_cast<double>(messages) / AKE_RUNS);
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * Messages of each size are all encrypted by alice first and then
+ * decrypted by bob, so both directions are timed on their own.
+ */
+bool OtrBenchmark::runThroughput(JsonObject& result)
+{
+    if (!establish(m_alice, m_bob))
+    {
+        result = error("no encrypted session");
+        return false;
+    }
+
+    for (size_t s = 0; s < sizeof(THROUGHPUT_SIZES) / sizeof(THROUGHPUT_SIZES[0]); s++)
+    {
+        int size = THROUGHPUT_SIZES[s];
+        int runs = qBound(THROUGHPUT_MIN_RUNS, THROUGHPUT_BYTES / size,
+                          THROUGHPUT_MAX_RUNS);
+
+        JsonObject json;
+        if (!measureThroughput(size, runs, json))
+        {
+            result = json;
+            return false;
+        }
+        result.insert(QString::number(size), json);
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * Pastes of 1 MB sent whole and in fragments of several sizes.
+ * Fragments are counted as wire messages; all but the last one are
+ * injected while the message is encrypted.
+ */
+bool OtrBenchmark::runLargeMessages(JsonObject& result)
+{
+    if (!establish(m_alice, m_bob))
+    {
+        result = error("no encrypted session");
+        return false;
+    }
+
+    bool ok = true;
+    for (size_t f = 0; ok && f < sizeof(LARGE_FRAGMENT_SIZES) / sizeof(LARGE_FRAGMENT_SIZES[0]); f++)
+    {
+        int fragmentSize = LARGE_FRAGMENT_SIZES[f];
+        m_alice.callback->setMaxMessageSize(fragmentSize);
+
+        JsonObject json;
+        ok = measureThroughput(LARGE_SIZE, LARGE_RUNS, json);
+        if (ok)
+        {
+            result.insert(fragmentSize? QString("fragments_%1").arg(fragmentSize)
+                                      : QString("unfragmented"), json);
+        }
+        else
+        {
+            result = json;
+        }
+    }
+    m_alice.callback->setMaxMessageSize(0);
+    return ok;
+}
+
+//-----------------------------------------------------------------------------
+
+bool OtrBenchmark::measureThroughput(int size, int runs, JsonObject& json)
+{
+    QElapsedTimer timer;
+
+    // Sent the way the outbound catcher sends the returned text
+    for (int i = 0; i < THROUGHPUT_WARMUP; i++)
+    {
+        QString encrypted = m_alice.otr->encryptMessage(m_alice.account, m_bob.jid,
+                                                        benchText(size, i));
+        m_alice.callback->sendMessage(m_alice.account, m_bob.jid, encrypted);
+        pump(m_alice, m_bob);
+    }
+
+    QList<QString> texts;
+    for (int i = 0; i < runs; i++)
+    {
+        texts.append(benchText(size, i));
+    }
+
+    Samples encrypt;
+    QStringList wire;
+    foreach (const QString& text, texts)
+    {
+        timer.start();
+        QString encrypted = m_alice.otr->encryptMessage(m_alice.account, m_bob.jid,
+                                                        text);
+        encrypt.add(timer.nsecsElapsed());
+
+        wire += m_alice.callback->takeOutbox();
+        wire.append(encrypted);
+    }
+
+    Samples decrypt;
+    int received = 0;
+    bool intact = true;
+    foreach (const QString& message, wire)
+    {
+        QString decrypted;
+        timer.start();
+        psiotr::OtrMessageType type = m_bob.otr->decryptMessage(m_bob.account,
+                                                                m_alice.jid,
+                                                                message,
+                                                                decrypted);
+        decrypt.add(timer.nsecsElapsed());
+
+        if (type == psiotr::OTR_MESSAGETYPE_OTR)
+        {
+            intact = intact && received < texts.size() &&
+                     decrypted == texts.at(received);
+            received++;
+        }
+    }
+    pump(m_alice, m_bob);
+
+    if (!intact || received != runs)
+    {
+        json = error(QString("%1 of %2 messages of %3 bytes arrived intact")
+                             .arg(received).arg(runs).arg(size));
+        return false;
+    }
+
+    double megabytes = static_cast<double>(size) * runs / (1024 * 1024);
+    json.insert("messages", runs);
+    json.insert("wire_messages", wire.size());
+    json.insert("encrypt", encrypt.toJson());
+    json.insert("decrypt", decrypt.toJson());
+    json.insert("encrypt_mb_per_s", megabytes / (encrypt.total() / 1e9));
+    json.insert("decrypt_mb_per_s", megabytes / (decrypt.total() / 1e9));
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * Socialist millionaires' protocol without a question, from the
+ * request of alice until both sides know the result.
+ */
+bool OtrBenchmark::runSmp(JsonObject& result)
+{
+    if (!establish(m_alice, m_bob))
+    {
+        result = error("no encrypted session");
+        return false;
+    }
+
+    Samples smp;
+    QElapsedTimer timer;
+    m_smpSecret = "benchmark secret";
+
+    for (int i = 0; i < SMP_RUNS; i++)
+    {
+        m_alice.callback->resetSmp();
+        m_bob.callback->resetSmp();
+
+        timer.start();
+        m_alice.otr->startSMP(m_alice.account, m_bob.jid, QString(), m_smpSecret);
+        pump(m_alice, m_bob);
+        smp.add(timer.nsecsElapsed());
+
+        if (m_alice.callback->smpProgress(m_bob.jid) != 100 ||
+            m_bob.callback->smpProgress(m_alice.jid) != 100 ||
+            !m_alice.otr->smpSucceeded(m_alice.account, m_bob.jid))
+        {
+            result = error("SMP failed");
+            return false;
+        }
+    }
+
+    result.insert("smp", smp.toJson());
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * Trust changes of a known fingerprint, each of which is persisted
+ * before the call returns.
+ */
+bool OtrBenchmark::runFingerprints(JsonObject& result)
+{
+    if (!establish(m_alice, m_bob))
+    {
+        result = error("no encrypted session");
+        return false;
+    }
+
+    QList<psiotr::Fingerprint> fingerprints =
+        m_alice.otr->getFingerprints(m_alice.account, m_bob.jid);
+    if (fingerprints.isEmpty())
+    {
+        result = error("no fingerprint of bob");
+        return false;
+    }
+
+    Samples trust;
+    QElapsedTimer timer;
+    for (int i = 0; i < FINGERPRINT_RUNS; i++)
+    {
+        timer.start();
+        m_alice.otr->verifyFingerprint(fingerprints.first(), i % 2 == 0);
+        trust.add(timer.nsecsElapsed());
+    }
+
+    result.insert("verify", trust.toJson());
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * Lookups of random contacts among a growing number of contexts, all
+ * created from a fingerprints file. The state is read from the context
+ * itself, the trust through the session snapshot.
+ */
+bool OtrBenchmark::runContextLookup(JsonObject& result)
+{
+    QElapsedTimer timer;
+    for (size_t c = 0; c < sizeof(LOOKUP_COUNTS) / sizeof(LOOKUP_COUNTS[0]); c++)
+    {
+        int count = LOOKUP_COUNTS[c];
+
+        Peer peer;
+        QString dataDir = QDir(m_workDir).filePath(QString("lookup%1").arg(count));
+        if (!writeFingerprints(dataDir, "lookup", count) ||
+            !createPeer(peer, "lookup", dataDir))
+        {
+            result = error("cannot create " + dataDir);
+            return false;
+        }
+        peer.otr->getFingerprints();
+
+        QStringList contacts;
+        quint32 seed = 1;
+        for (int i = 0; i < LOOKUP_RUNS; i++)
+        {
+            contacts.append(contactName(nextRandom(seed) % count));
+        }
+
+        int found = 0;
+        timer.start();
+        foreach (const QString& contact, contacts)
+        {
+            if (peer.otr->getMessageState(peer.account, contact) ==
+                psiotr::OTR_MESSAGESTATE_PLAINTEXT)
+            {
+                found++;
+            }
+        }
+        qint64 stateNsecs = timer.nsecsElapsed();
+
+        int verified = 0;
+        timer.start();
+        foreach (const QString& contact, contacts)
+        {
+            if (peer.otr->isVerified(peer.account, contact))
+            {
+                verified++;
+            }
+        }
+        qint64 verifiedNsecs = timer.nsecsElapsed();
+
+        destroyPeer(peer);
+
+        if (found != LOOKUP_RUNS)
+        {
+            result = error(QString("%1 of %2 contexts found among %3")
+                                   .arg(found).arg(LOOKUP_RUNS).arg(count));
+            return false;
+        }
+
+        JsonObject json;
+        json.insert("lookups", LOOKUP_RUNS);
+        json.insert("verified", verified);
+        json.insert("message_state_ns", static_cast<double>(stateNsecs) / LOOKUP_RUNS);
+        json.insert("is_verified_ns", static_cast<double>(verifiedNsecs) / LOOKUP_RUNS);
+        result.insert(QString::number(count), json);
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * Heap allocations per message, counted around the calls only, once
+ * names and buffers are in place. The returned QStrings account for
+ * one or two of them.
+ */
+bool OtrBenchmark::runAllocations(JsonObject& result)
+{
+    if (!AllocationCounter::isAvailable())
+    {
+        result = error("allocations are only counted with glibc");
+        return false;
+    }
+    if (!establish(m_alice, m_bob))
+    {
+        result = error("no encrypted session");
+        return false;
+    }
+
+    QString text         = benchText(ALLOCATION_SIZE, 0);
+    QString plainContact = contactName(0);
+    quint64 encryptAllocations = 0;
+    quint64 decryptAllocations = 0;
+    quint64 plainAllocations   = 0;
+    quint64 checkAllocations   = 0;
+    int intact = 0;
+
+    for (int i = -THROUGHPUT_WARMUP; i < ALLOCATION_RUNS; i++)
+    {
+        bool counted = i >= 0;
+        QString decrypted;
+
+        AllocationCounter encrypt;
+        QString encrypted = m_alice.otr->encryptMessage(m_alice.account, m_bob.jid,
+                                                        text);
+        encryptAllocations += counted? encrypt.count() : 0;
+
+        AllocationCounter decrypt;
+        m_bob.otr->decryptMessage(m_bob.account, m_alice.jid, encrypted, decrypted);
+        decryptAllocations += counted? decrypt.count() : 0;
+        intact += counted && decrypted == text? 1 : 0;
+
+        AllocationCounter check;
+        m_bob.otr->needsDecryption(m_bob.account, plainContact, text);
+        checkAllocations += counted? check.count() : 0;
+
+        AllocationCounter plain;
+        m_bob.otr->decryptMessage(m_bob.account, plainContact, text, decrypted);
+        plainAllocations += counted? plain.count() : 0;
+    }
+    pump(m_alice, m_bob);
+
+    if (intact != ALLOCATION_RUNS)
+    {
+        result = error(QString("%1 of %2 messages arrived intact")
+                               .arg(intact).arg(ALLOCATION_RUNS));
+        return false;
+    }
+
+    result.insert("bytes", ALLOCATION_SIZE);
+    result.insert("messages", ALLOCATION_RUNS);
+    result.insert("encrypt_per_message",
+                  static_cast<double>(encryptAllocations) / ALLOCATION_RUNS);
+    result.insert("decrypt_per_message",
+                  static_cast<double>(decryptAllocations) / ALLOCATION_RUNS);
+    result.insert("needs_decryption_per_message",
+                  static_cast<double>(checkAllocations) / ALLOCATION_RUNS);
+    result.insert("plaintext_receive_per_message",
+                  static_cast<double>(plainAllocations) / ALLOCATION_RUNS);
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * Trust changes in stores of a growing number of fingerprints. Every
+ * change is appended to the journal; the last one starts a compaction,
+ * whose snapshot is taken in the call and written in the background
+ * until the rotated journal is removed.
+ */
+bool OtrBenchmark::runStoreWrites(JsonObject& result)
+{
+    QElapsedTimer timer;
+    for (size_t c = 0; c < sizeof(STORE_COUNTS) / sizeof(STORE_COUNTS[0]); c++)
+    {
+        int count = STORE_COUNTS[c];
+
+        Peer peer;
+        QString dataDir = QDir(m_workDir).filePath(QString("store%1").arg(count));
+        if (!writeFingerprints(dataDir, "store", count) ||
+            !createPeer(peer, "store", dataDir))
+        {
+            result = error("cannot create " + dataDir);
+            return false;
+        }
+
+        QList<psiotr::Fingerprint> fingerprints =
+            peer.otr->getFingerprints(peer.account, contactName(1));
+        if (fingerprints.isEmpty())
+        {
+            destroyPeer(peer);
+            result = error(QString("no fingerprint among %1").arg(count));
+            return false;
+        }
+
+        Samples journal;
+        qint64 snapshotNsecs = 0;
+        for (int i = 0; i < STORE_WRITE_RUNS; i++)
+        {
+            timer.start();
+            peer.otr->verifyFingerprint(fingerprints.first(), i % 2 == 0);
+            if (i + 1 < STORE_WRITE_RUNS)
+            {
+                journal.add(timer.nsecsElapsed());
+            }
+            else
+            {
+                snapshotNsecs = timer.nsecsElapsed();
+            }
+        }
+
+        QString oldJournal = QDir(dataDir).filePath("otr.fingerprints.journal.old");
+        timer.start();
+        while (QFile::exists(oldJournal) && !timer.hasExpired(STORE_TIMEOUT_MSECS))
+        {
+            QCoreApplication::processEvents(QEventLoop::AllEvents, 10);
+        }
+        qint64 compactionNsecs = timer.nsecsElapsed();
+        bool compacted = !QFile::exists(oldJournal);
+
+        JsonObject json;
+        json.insert("journal_write", journal.toJson());
+        json.insert("snapshot_us", snapshotNsecs / 1000.0);
+        json.insert("background_write_us", compactionNsecs / 1000.0);
+        json.insert("compacted", compacted);
+        json.insert("file_bytes",
+                    QFileInfo(QDir(dataDir).filePath("otr.fingerprints")).size());
+        json.insertRaw("metrics", peer.otr->metrics()->toJson());
+        result.insert(QString::number(count), json);
+
+        destroyPeer(peer);
+
+        if (!compacted)
+        {
+            result = error(QString("no compaction among %1").arg(count));
+            return false;
+        }
+    }
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * Startup with a large fingerprints file: the constructor, which only
+ * starts the parser, the first use of the account, which creates its
+ * contexts, and listing all fingerprints afterwards.
+ */
+bool OtrBenchmark::runStartup(JsonObject& result)
+{
+    QString dataDir = QDir(m_workDir).filePath("startup");
+    if (!writeFingerprints(dataDir, "startup", STARTUP_FINGERPRINTS))
+    {
+        result = error("cannot create " + dataDir);
+        return false;
+    }
+
+    Samples construct;
+    Samples firstUse;
+    Samples listAll;
+    QElapsedTimer timer;
+    for (int i = 0; i < STARTUP_RUNS; i++)
+    {
+        Peer peer;
+        timer.start();
+        bool created = createPeer(peer, "startup", dataDir);
+        construct.add(timer.nsecsElapsed());
+        if (!created)
+        {
+            result = error("cannot create " + dataDir);
+            return false;
+        }
+
+        timer.start();
+        int found = peer.otr->getFingerprints(peer.account, contactName(0)).size();
+        firstUse.add(timer.nsecsElapsed());
+
+        timer.start();
+        int total = peer.otr->getFingerprints().size();
+        listAll.add(timer.nsecsElapsed());
+
+        destroyPeer(peer);
+
+        if (found != 1 || total != STARTUP_FINGERPRINTS)
+        {
+            result = error(QString("%1 of %2 fingerprints loaded")
+                                   .arg(total).arg(STARTUP_FINGERPRINTS));
+            return false;
+        }
+    }
+
+    result.insert("fingerprints", STARTUP_FINGERPRINTS);
+    result.insert("construct", construct.toJson());
+    result.insert("first_use", firstUse.toJson());
+    result.insert("list_all", listAll.toJson());
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+
+static QList<Stanza> chatStanzas(const QString& from, const QString& to,
+                                 const QStringList& bodies)
+{
+    QList<Stanza> stanzas;
+    foreach (const QString& body, bodies)
+    {
+        Message message;
+        message.setType(Message::Chat).setFrom(from).setTo(to).setBody(body);
+        stanzas.append(message.stanza());
+    }
+    return stanzas;
+}
+
+//-----------------------------------------------------------------------------
+
+static double stanzasPerSecond(int count, qint64 nsecs)
+{
+    return nsecs > 0? count * 1e9 / nsecs : 0.0;
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * Chat stanzas through the catchers of an encrypted session: alice's
+ * outbound catcher encrypts them, bob's inbound catcher decrypts them.
+ * Plain stanzas from a contact without a session show the cost of
+ * passing them through. Without a plugin manager there is no stanza
+ * processor, so both catchers work synchronously as on old hosts.
+ */
+bool OtrBenchmark::runCatchers(JsonObject& result)
+{
+    if (!establish(m_alice, m_bob))
+    {
+        result = error("no encrypted session");
+        return false;
+    }
+
+    OtrRoutingTable routes;
+    routes.insert(Jid(m_alice.jid), m_alice.account);
+    routes.insert(Jid(m_bob.jid), m_bob.account);
+    OutboundStanzaCatcher outbound(m_alice.otr, &routes, NULL);
+    InboundStanzaCatcher inbound(m_bob.otr, &routes, NULL);
+
+    QStringList texts;
+    for (int i = 0; i < CATCHER_RUNS; i++)
+    {
+        texts.append(benchText(CATCHER_SIZE, i));
+    }
+
+    QElapsedTimer timer;
+    bool accept = false;
+
+    QList<Stanza> outgoing = chatStanzas(m_alice.jid, m_bob.jid, texts);
+    timer.start();
+    for (int i = 0; i < outgoing.size(); i++)
+    {
+        outbound.stanzaReadWrite(0, Jid(m_alice.jid), outgoing[i], accept);
+    }
+    qint64 outboundNsecs = timer.nsecsElapsed();
+
+    QStringList encrypted;
+    for (int i = 0; i < outgoing.size(); i++)
+    {
+        encrypted.append(outgoing[i].firstElement("body").text());
+    }
+
+    QList<Stanza> incoming = chatStanzas(m_alice.jid, m_bob.jid, encrypted);
+    timer.start();
+    for (int i = 0; i < incoming.size(); i++)
+    {
+        inbound.stanzaReadWrite(0, Jid(m_bob.jid), incoming[i], accept);
+    }
+    qint64 inboundNsecs = timer.nsecsElapsed();
+
+    int intact = 0;
+    for (int i = 0; i < incoming.size(); i++)
+    {
+        intact += incoming[i].firstElement("body").text() == texts.at(i)? 1 : 0;
+    }
+
+    QList<Stanza> plain = chatStanzas(contactName(0), m_bob.jid, texts);
+    timer.start();
+    for (int i = 0; i < plain.size(); i++)
+    {
+        inbound.stanzaReadWrite(0, Jid(m_bob.jid), plain[i], accept);
+    }
+    qint64 plainNsecs = timer.nsecsElapsed();
+
+    pump(m_alice, m_bob);
+
+    if (intact != CATCHER_RUNS)
+    {
+        result = error(QString("%1 of %2 stanzas arrived intact")
+                               .arg(intact).arg(CATCHER_RUNS));
+        return false;
+    }
+
+    result.insert("bytes", CATCHER_SIZE);
+    result.insert("stanzas", CATCHER_RUNS);
+    result.insert("outbound_per_s", stanzasPerSecond(CATCHER_RUNS, outboundNsecs));
+    result.insert("inbound_per_s", stanzasPerSecond(CATCHER_RUNS, inboundNsecs));
+    result.insert("inbound_plain_per_s", stanzasPerSecond(CATCHER_RUNS, plainNsecs));
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * A roster coming online and going offline again, several times, as
+ * the plugin records it: every resource gets a session when it becomes
+ * available and loses it when it leaves. No closures are created, as
+ * no authentication is started. Memory must return to where it was
+ * after every replay.
+ */
+bool OtrBenchmark::runRosterReplay(JsonObject& result)
+{
+    QString account = m_bob.account;
+    QStringList contacts;
+    for (int i = 0; i < ROSTER_CONTACTS; i++)
+    {
+        for (int r = 0; r < ROSTER_RESOURCES; r++)
+        {
+            contacts.append(contactName(i) + QString("/resource%1").arg(r));
+        }
+    }
+
+    OtrSessionTable sessions;
+    Samples arrival;
+    Samples departure;
+    QElapsedTimer timer;
+    qint64 baseKb   = residentKb();
+    qint64 onlineKb = 0;
+    qint64 maxSize  = 0;
+
+    for (int replay = 0; replay < ROSTER_REPLAYS; replay++)
+    {
+        timer.start();
+        foreach (const QString& contact, contacts)
+        {
+            sessions.insert(account, contact).loggedIn = true;
+        }
+        arrival.add(timer.nsecsElapsed());
+        onlineKb = qMax(onlineKb, residentKb());
+        maxSize  = qMax(maxSize, static_cast<qint64>(sessions.size()));
+
+        timer.start();
+        foreach (const QString& contact, contacts)
+        {
+            sessions.remove(account, contact);
+        }
+        departure.add(timer.nsecsElapsed());
+    }
+    qint64 offlineKb = residentKb();
+
+    if (maxSize != contacts.size() || sessions.size() != 0)
+    {
+        result = error(QString("%1 sessions online, %2 left offline")
+                               .arg(maxSize).arg(sessions.size()));
+        return false;
+    }
+
+    result.insert("resources", contacts.size());
+    result.insert("replays", ROSTER_REPLAYS);
+    result.insert("arrival", arrival.toJson());
+    result.insert("departure", departure.toJson());
+    result.insert("rss_before_kb", baseKb);
+    result.insert("rss_online_kb", onlineKb);
+    result.insert("rss_after_kb", offlineKb);
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+
+static Stanza presenceStanza(const QString& from, bool available)
+{
+    Stanza stanza("presence");
+    stanza.setFrom(from);
+    if (!available)
+    {
+        stanza.setType(PRESENCE_TYPE_UNAVAILABLE);
+    }
+    return stanza;
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * The presences received after a reconnect, handled as the presence
+ * handler of the plugin does with prewarming off: only the type and
+ * from attributes are read, contacts without a context are dropped
+ * and flaps are coalesced until the next event loop iteration, which
+ * applies them to the session table.
+ */
+bool OtrBenchmark::runPresenceStorm(JsonObject& result)
+{
+    Peer peer;
+    QString dataDir = QDir(m_workDir).filePath("storm");
+    if (!writeFingerprints(dataDir, "storm", STORM_KNOWN) ||
+        !createPeer(peer, "storm", dataDir))
+    {
+        result = error("cannot create " + dataDir);
+        return false;
+    }
+    // Creates the contexts, as earlier conversations would have
+    peer.otr->getFingerprints();
+
+    Jid streamJid(peer.jid);
+    OtrRoutingTable routes;
+    routes.insert(streamJid, peer.account);
+
+    QList<Stanza> presences;
+    for (int i = 0; i < STORM_CONTACTS; i++)
+    {
+        presences.append(presenceStanza(contactName(i), true));
+        if (i % STORM_FLAP_EVERY == 0)
+        {
+            presences.append(presenceStanza(contactName(i), false));
+            presences.append(presenceStanza(contactName(i), true));
+        }
+    }
+
+    OtrSessionTable sessions;
+    QElapsedTimer timer;
+    int dropped = 0;
+
+    timer.start();
+    foreach (const Stanza& stanza, presences)
+    {
+        QString type = stanza.type();
+        bool available = (type == PRESENCE_TYPE_AVAILABLE);
+        if (!available && type != PRESENCE_TYPE_UNAVAILABLE)
+        {
+            continue;
+        }
+
+        QString account = routes.account(streamJid);
+        QString contact = stanza.from();
+        const OtrSessionTable::PresenceUpdate* pending =
+            sessions.findPresenceUpdate(account, contact);
+        bool tracked = sessions.contains(account, contact) ||
+                       (pending && pending->tracked) ||
+                       peer.otr->hasContext(account, contact);
+        if (!tracked && !pending)
+        {
+            dropped++;
+            continue;
+        }
+        sessions.addPresenceUpdate(streamJid, account, contact, available, tracked);
+    }
+    qint64 receiveNsecs = timer.nsecsElapsed();
+
+    timer.start();
+    OtrSessionTable::PresenceUpdates updates = sessions.takePresenceUpdates();
+    OtrSessionTable::PresenceUpdates::const_iterator it;
+    for (it = updates.constBegin(); it != updates.constEnd(); ++it)
+    {
+        const QString& account = it.key().first;
+        const QString& contact = it.key().second;
+        if (it->available && it->tracked)
+        {
+            sessions.insert(account, contact).loggedIn = true;
+        }
+        else if (!it->available && (sessions.contains(account, contact) ||
+                                    peer.otr->hasContext(account, contact)))
+        {
+            sessions.remove(account, contact);
+        }
+    }
+    qint64 processNsecs = timer.nsecsElapsed();
+
+    destroyPeer(peer);
+
+    if (updates.size() != STORM_KNOWN || sessions.size() != STORM_KNOWN)
+    {
+        result = error(QString("%1 updates and %2 sessions for %3 known contacts")
+                               .arg(updates.size()).arg(sessions.size())
+                               .arg(STORM_KNOWN));
+        return false;
+    }
+
+    result.insert("presences", presences.size());
+    result.insert("dropped", dropped);
+    result.insert("coalesced", presences.size() - dropped - updates.size());
+    result.insert("receive_per_s", receiveNsecs > 0?
+                                   presences.size() * 1e9 / receiveNsecs : 0.0);
+    result.insert("process_us", processNsecs / 1000.0);
+    return true;
+}
+
+//-----------------------------------------------------------------------------
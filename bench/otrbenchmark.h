@@ -0,0 +1,149 @@
+/*
+ * otrbenchmark.h - Benchmark scenarios for OtrMessaging
+ *
+ * Off-the-Record Messaging plugin for Psi+
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef OTRBENCHMARK_H_
+#define OTRBENCHMARK_H_
+
+#include "benchresults.h"
+
+#include <QString>
+#include <QStringList>
+
+namespace psiotr
+{
+    class OtrMessaging;
+}
+
+class LoopbackCallback;
+
+// ---------------------------------------------------------------------------
+
+/**
+ * Runs the benchmark scenarios on two OtrMessaging instances, "alice"
+ * and "bob", which talk through LoopbackCallback. Every instance keeps
+ * its files in a directory of its own below workDir.
+ *
+ * Messages are delivered by pump() once the call which produced them
+ * returned, as a server would, so the timings include every libotr call
+ * on both sides but no network.
+ */
+class OtrBenchmark
+{
+public:
+    OtrBenchmark(const QString& workDir);
+
+    /**
+     * Destroys the peers; their directories are left to the caller.
+     */
+    ~OtrBenchmark();
+
+    /**
+     * Names of all scenarios, in the order they are run by default.
+     */
+    static QStringList scenarios();
+
+    /**
+     * Generate the keys of both peers.
+     */
+    bool setUp();
+
+    /**
+     * Run scenario and store its results. Returns false if it is unknown
+     * or failed; result then holds an "error".
+     */
+    bool run(const QString& scenario, JsonObject& result);
+
+    /**
+     * Metrics collected by both peers during all scenarios.
+     */
+    JsonObject metrics() const;
+
+private:
+    struct Peer
+    {
+        Peer();
+
+        QString                account;
+        QString                jid;
+        QString                dataDir;
+        LoopbackCallback*      callback;
+        psiotr::OtrMessaging*  otr;
+    };
+
+    bool createPeer(Peer& peer, const QString& name, const QString& dataDir);
+    void destroyPeer(Peer& peer);
+
+    /**
+     * Write a fingerprints file with count contacts of account, see
+     * contactName(), so that a peer created on dataDir knows them.
+     */
+    static bool writeFingerprints(const QString& dataDir, const QString& account,
+                                  int count);
+    static QString contactName(int index);
+
+    /**
+     * Wait in the event loop until a key for account is stored.
+     */
+    bool generateKey(Peer& peer, const QString& account);
+
+    /**
+     * Deliver the outbox of from to to. Returns the number of messages.
+     */
+    int deliver(Peer& from, Peer& to, QStringList* plaintexts = 0);
+
+    /**
+     * Deliver messages both ways until both outboxes stay empty,
+     * answering SMP requests with m_smpSecret.
+     */
+    int pump(Peer& a, Peer& b);
+
+    bool isEncrypted(Peer& a, Peer& b);
+    bool establish(Peer& a, Peer& b);
+    void endSessions(Peer& a, Peer& b);
+
+    /**
+     * Encrypt runs messages of size bytes from alice, then decrypt them
+     * all at bob. Returns false with an "error" in json if any is lost.
+     */
+    bool measureThroughput(int size, int runs, JsonObject& json);
+
+    bool runKeys(JsonObject& result);
+    bool runAke(JsonObject& result);
+    bool runThroughput(JsonObject& result);
+    bool runSmp(JsonObject& result);
+    bool runFingerprints(JsonObject& result);
+    bool runContextLookup(JsonObject& result);
+    bool runAllocations(JsonObject& result);
+    bool runStoreWrites(JsonObject& result);
+    bool runStartup(JsonObject& result);
+    bool runCatchers(JsonObject& result);
+    bool runRosterReplay(JsonObject& result);
+    bool runPresenceStorm(JsonObject& result);
+    bool runLargeMessages(JsonObject& result);
+
+    QString m_workDir;
+    Peer    m_alice;
+    Peer    m_bob;
+    QString m_smpSecret;
+};
+
+// ---------------------------------------------------------------------------
+
+#endif
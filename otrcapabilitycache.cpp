@@ -0,0 +1,216 @@
+/*
+ * otrcapabilitycache.cpp - Remembers which contacts speak OTR
+ *
+ * Off-the-Record Messaging plugin for Psi+
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "otrcapabilitycache.h"
+
+#include <QByteArray>
+#include <QFile>
+#include <QDateTime>
+#include <QStringList>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+extern "C"
+{
+#include "otrlextensions.h"
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * Lifetime of a record in seconds. A contact who answered OTR keeps the
+ * tagged offers for long; one who ignored them is asked again sooner.
+ */
+static const uint CAPABLE_LIFETIME   = 180 * 24 * 3600;
+static const uint INCAPABLE_LIFETIME = 30 * 24 * 3600;
+
+static const int SAVE_DELAY_MSECS = 5000;
+
+//-----------------------------------------------------------------------------
+
+static uint now()
+{
+    return QDateTime::currentDateTime().toTime_t();
+}
+
+//-----------------------------------------------------------------------------
+
+OtrCapabilityCache::OtrCapabilityCache(const QString& file, QObject* parent)
+    : QObject(parent),
+      m_file(file),
+      m_records(),
+      m_saveTimer()
+{
+    m_saveTimer.setSingleShot(true);
+    m_saveTimer.setInterval(SAVE_DELAY_MSECS);
+    connect(&m_saveTimer, SIGNAL(timeout()), SLOT(save()));
+}
+
+//-----------------------------------------------------------------------------
+
+OtrCapabilityCache::~OtrCapabilityCache()
+{
+    if (m_saveTimer.isActive())
+    {
+        save();
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrCapabilityCache::load()
+{
+    QFile file(m_file);
+    if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+    {
+        return;
+    }
+
+    // account \t contact \t y|n \t expiry
+    uint time = now();
+    while (!file.atEnd())
+    {
+        QStringList fields = QString::fromUtf8(file.readLine()).trimmed()
+                                                               .split('\t');
+        if (fields.size() != 4)
+        {
+            continue;
+        }
+
+        Record record;
+        record.capability = fields.at(2) == "y"? CAPABILITY_OTR
+                                                : CAPABILITY_NO_OTR;
+        record.expires    = fields.at(3).toUInt();
+        if (record.expires > time)
+        {
+            m_records.insert(key(fields.at(0), fields.at(1)), record);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+OtrCapabilityCache::Capability OtrCapabilityCache::capability(const QString& account,
+                                                              const QString& contact) const
+{
+    QHash<QString, Record>::const_iterator it = m_records.constFind(key(account,
+                                                                        contact));
+    if (it == m_records.constEnd() || it->expires <= now())
+    {
+        return CAPABILITY_UNKNOWN;
+    }
+    return it->capability;
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrCapabilityCache::setCapability(const QString& account,
+                                       const QString& contact,
+                                       Capability capability)
+{
+    QString recordKey = key(account, contact);
+
+    if (capability == CAPABILITY_UNKNOWN)
+    {
+        if (m_records.remove(recordKey) > 0)
+        {
+            m_saveTimer.start();
+        }
+        return;
+    }
+
+    // Renew a record only when half of its lifetime is over, so that
+    // every received tag does not cause a write.
+    uint lifetime = capability == CAPABILITY_OTR? CAPABLE_LIFETIME
+                                                : INCAPABLE_LIFETIME;
+    uint time     = now();
+    QHash<QString, Record>::iterator it = m_records.find(recordKey);
+    if (it != m_records.end() && it->capability == capability &&
+        it->expires > time + lifetime / 2)
+    {
+        return;
+    }
+
+    Record record;
+    record.capability = capability;
+    record.expires    = time + lifetime;
+    m_records.insert(recordKey, record);
+
+    if (!m_saveTimer.isActive())
+    {
+        m_saveTimer.start();
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrCapabilityCache::save()
+{
+    m_saveTimer.stop();
+
+    uint time = now();
+    QByteArray data;
+    QHash<QString, Record>::const_iterator it = m_records.constBegin();
+    for (; it != m_records.constEnd(); ++it)
+    {
+        if (it->expires <= time)
+        {
+            continue;
+        }
+        QString line = it.key();
+        line += it->capability == CAPABILITY_OTR? "\ty\t" : "\tn\t";
+        line += QString::number(it->expires);
+        line += '\n';
+        data += line.toUtf8();
+    }
+
+    // Written like the keys and fingerprints, the old file stays
+    // complete until the new one replaces it.
+    QByteArray name = QFile::encodeName(m_file);
+    char* tmpName;
+    FILE* tmp = otrl_file_open_tmp(name.constData(), &tmpName);
+    if (!tmp)
+    {
+        return;
+    }
+
+    if (fwrite(data.constData(), 1, data.size(), tmp) != static_cast<size_t>(data.size()))
+    {
+        fclose(tmp);
+        remove(tmpName);
+    }
+    else
+    {
+        otrl_file_replace(tmp, tmpName, name.constData());
+    }
+    free(tmpName);
+}
+
+//-----------------------------------------------------------------------------
+
+QString OtrCapabilityCache::key(const QString& account, const QString& contact)
+{
+    // Whether a client speaks OTR is decided per resource, but the
+    // resource changes with every login.
+    return account + '\t' + contact.section('/', 0, 0);
+}
+
+//-----------------------------------------------------------------------------
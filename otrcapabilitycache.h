@@ -0,0 +1,84 @@
+/*
+ * otrcapabilitycache.h - Remembers which contacts speak OTR
+ *
+ * Off-the-Record Messaging plugin for Psi+
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef OTRCAPABILITYCACHE_H_
+#define OTRCAPABILITYCACHE_H_
+
+#include <QObject>
+#include <QHash>
+#include <QString>
+#include <QTimer>
+
+// ---------------------------------------------------------------------------
+
+/**
+ * Persistent record of whether the client of a contact answered OTR.
+ *
+ * Contacts are recorded by their bare JID. A record expires after a
+ * while, so a contact who installs or removes OTR support is probed
+ * again. Changes are written to the file a few seconds later and when
+ * the cache is destroyed.
+ */
+class OtrCapabilityCache : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum Capability
+    {
+        CAPABILITY_UNKNOWN,
+        CAPABILITY_OTR,
+        CAPABILITY_NO_OTR
+    };
+
+    OtrCapabilityCache(const QString& file, QObject* parent = 0);
+
+    /**
+     * Writes pending changes.
+     */
+    ~OtrCapabilityCache();
+
+    void load();
+
+    Capability capability(const QString& account, const QString& contact) const;
+
+    void setCapability(const QString& account, const QString& contact,
+                       Capability capability);
+
+private slots:
+    void save();
+
+private:
+    struct Record
+    {
+        Capability capability;
+        uint       expires;     // seconds since the epoch
+    };
+
+    static QString key(const QString& account, const QString& contact);
+
+    QString                m_file;
+    QHash<QString, Record> m_records;
+    QTimer                 m_saveTimer;
+};
+
+// ---------------------------------------------------------------------------
+
+#endif
@@ -0,0 +1,667 @@
+/*
+ * otrfingerprintstore.cpp - Journaled storage of known fingerprints
+ *
+ * Off-the-Record Messaging plugin for Psi+
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "otrfingerprintstore.h"
+
+#include <QtConcurrentRun>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//-----------------------------------------------------------------------------
+
+/**
+ * Number of journal records which trigger a compaction.
+ */
+static const int JOURNAL_COMPACT_RECORDS = 1000;
+
+static const int FINGERPRINT_LEN = 20;
+
+//-----------------------------------------------------------------------------
+
+OtrFingerprintStore::OtrFingerprintStore(OtrlUserState userstate,
+                                         const QString& fingerprintFile,
+                                         OtrMetrics* metrics,
+                                         QObject* parent)
+    : QObject(parent),
+      m_userstate(userstate),
+      m_metrics(metrics),
+      m_fingerprintFile(fingerprintFile),
+      m_journalFile(fingerprintFile + ".journal"),
+      m_oldJournalFile(fingerprintFile + ".journal.old"),
+      m_journal(),
+      m_addAppData(NULL),
+      m_appData(NULL),
+      m_unloaded(),
+      m_loader(NULL),
+      m_records(0),
+      m_compactAgain(false),
+      m_compaction(NULL)
+{
+}
+
+//-----------------------------------------------------------------------------
+
+OtrFingerprintStore::~OtrFingerprintStore()
+{
+    if (m_loader)
+    {
+        m_loader->disconnect(this);
+        m_loader->waitForFinished();
+        delete m_loader;
+    }
+
+    if (m_compaction)
+    {
+        m_compaction->disconnect(this);
+        m_compaction->waitForFinished();
+        if (m_compaction->result())
+        {
+            QFile::remove(m_oldJournalFile);
+        }
+        delete m_compaction;
+    }
+
+    // Changes unknown to the journal have to be written now.
+    if (m_compactAgain && rotateJournal() &&
+        writeSnapshot(m_fingerprintFile, snapshot()))
+    {
+        QFile::remove(m_oldJournalFile);
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrFingerprintStore::load(void (*addAppData)(void*, ConnContext*),
+                               void* data)
+{
+    m_addAppData = addAppData;
+    m_appData    = data;
+
+    // Left over by an interrupted compaction, whose records the journals
+    // still hold. Without a fingerprints file it may hold older ones too.
+    QString tmpFile = m_fingerprintFile + ".tmp";
+    if (QFile::exists(tmpFile))
+    {
+        if (QFile::exists(m_fingerprintFile))
+        {
+            QFile::remove(tmpFile);
+        }
+        else
+        {
+            QFile::rename(tmpFile, m_fingerprintFile);
+        }
+    }
+
+    // Nothing is appended before the files are parsed, see ensureLoaded().
+    openJournal();
+
+    m_loader = new QFutureWatcher<ParseResult>(this);
+    connect(m_loader, SIGNAL(finished()), SLOT(onParsed()));
+    m_loader->setFuture(QtConcurrent::run(&OtrFingerprintStore::parse,
+                                          m_fingerprintFile,
+                                          m_oldJournalFile,
+                                          m_journalFile));
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrFingerprintStore::ensureLoaded(const char* accountname)
+{
+    if (m_loader)
+    {
+        takeParsed();
+    }
+    if (m_unloaded.isEmpty())
+    {
+        return;
+    }
+
+    AccountRecords::iterator it =
+        m_unloaded.find(QByteArray::fromRawData(accountname, qstrlen(accountname)));
+    if (it != m_unloaded.end())
+    {
+        QByteArray account = it.key();
+        QList<Record> records = it.value();
+        m_unloaded.erase(it);
+
+        apply(account, records);
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrFingerprintStore::ensureAllLoaded()
+{
+    if (m_loader)
+    {
+        takeParsed();
+    }
+
+    AccountRecords unloaded = m_unloaded;
+    m_unloaded.clear();
+
+    AccountRecords::const_iterator it;
+    for (it = unloaded.constBegin(); it != unloaded.constEnd(); ++it)
+    {
+        apply(it.key(), it.value());
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+QList<QByteArray> OtrFingerprintStore::unloadedAccounts()
+{
+    if (m_loader)
+    {
+        takeParsed();
+    }
+    return m_unloaded.keys();
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrFingerprintStore::contextChanged(ConnContext* context)
+{
+    ConnContext* master = masterContext(context);
+
+    QByteArray records;
+    int count = 0;
+    for (::Fingerprint* fp = master->fingerprint_root.next; fp; fp = fp->next)
+    {
+        appendRecord(records, '+', master, fp);
+        count++;
+    }
+
+    append(records, count);
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrFingerprintStore::fingerprintChanged(ConnContext* context,
+                                             ::Fingerprint* fingerprint)
+{
+    QByteArray record;
+    appendRecord(record, '+', masterContext(context), fingerprint);
+    append(record, 1);
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrFingerprintStore::fingerprintRemoved(ConnContext* context,
+                                             ::Fingerprint* fingerprint)
+{
+    QByteArray record;
+    appendRecord(record, '-', masterContext(context), fingerprint);
+    append(record, 1);
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrFingerprintStore::compact()
+{
+    if (m_compaction)
+    {
+        m_compactAgain = true;
+        return;
+    }
+    m_compactAgain = false;
+
+    QByteArray data = snapshot();
+
+    // The snapshot contains every journaled change, so the journal
+    // stays valid if it cannot be rotated.
+    if (!rotateJournal())
+    {
+        qWarning("Failed to rotate %s", qPrintable(m_journalFile));
+    }
+    m_records = 0;
+
+    m_metrics->add(OtrMetrics::COUNTER_FINGERPRINTS_BYTES, data.size());
+    m_metrics->start(OtrMetrics::OP_FINGERPRINTS_WRITE, m_fingerprintFile);
+
+    m_compaction = new QFutureWatcher<bool>(this);
+    connect(m_compaction, SIGNAL(finished()), SLOT(onCompacted()));
+    m_compaction->setFuture(QtConcurrent::run(&OtrFingerprintStore::writeSnapshot,
+                                              m_fingerprintFile, data));
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrFingerprintStore::onCompacted()
+{
+    bool written = m_compaction->result();
+    m_compaction->deleteLater();
+    m_compaction = NULL;
+
+    m_metrics->finish(OtrMetrics::OP_FINGERPRINTS_WRITE, m_fingerprintFile);
+
+    if (written)
+    {
+        QFile::remove(m_oldJournalFile);
+    }
+    else
+    {
+        // The rotated journal is kept and merged by the next compaction.
+        qWarning("Failed to write %s", qPrintable(m_fingerprintFile));
+    }
+
+    if (m_compactAgain || m_records >= JOURNAL_COMPACT_RECORDS)
+    {
+        compact();
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrFingerprintStore::append(const QByteArray& records, int count)
+{
+    if (count == 0)
+    {
+        return;
+    }
+
+    bool written;
+    {
+        OtrMetrics::Timer timer(m_metrics, OtrMetrics::OP_JOURNAL_WRITE);
+        written = m_journal.isOpen() &&
+                  m_journal.write(records) == records.size() && m_journal.flush();
+    }
+    if (!written)
+    {
+        // Without a journal only a full rewrite keeps the file up to date.
+        compact();
+        return;
+    }
+    m_metrics->add(OtrMetrics::COUNTER_JOURNAL_BYTES, records.size());
+
+    m_records += count;
+    if (m_records >= JOURNAL_COMPACT_RECORDS)
+    {
+        compact();
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+bool OtrFingerprintStore::openJournal()
+{
+    m_journal.setFileName(m_journalFile);
+    return m_journal.open(QIODevice::WriteOnly | QIODevice::Append);
+}
+
+//-----------------------------------------------------------------------------
+
+bool OtrFingerprintStore::rotateJournal()
+{
+    m_journal.close();
+
+    if (QFile::exists(m_journalFile))
+    {
+        if (QFile::exists(m_oldJournalFile))
+        {
+            // The previous compaction failed, keep its records.
+            QFile oldJournal(m_oldJournalFile);
+            QFile journal(m_journalFile);
+            if (!oldJournal.open(QIODevice::WriteOnly | QIODevice::Append) ||
+                !journal.open(QIODevice::ReadOnly) ||
+                oldJournal.write(journal.readAll()) < 0 ||
+                !oldJournal.flush())
+            {
+                openJournal();
+                return false;
+            }
+            journal.close();
+            QFile::remove(m_journalFile);
+        }
+        else if (!QFile::rename(m_journalFile, m_oldJournalFile))
+        {
+            openJournal();
+            return false;
+        }
+    }
+
+    openJournal();
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrFingerprintStore::onParsed()
+{
+    takeParsed();
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrFingerprintStore::takeParsed()
+{
+    m_loader->disconnect(this);
+    m_loader->waitForFinished();
+
+    ParseResult result = m_loader->result();
+    m_loader->deleteLater();
+    m_loader = NULL;
+
+    m_unloaded = result.accounts;
+    m_records += result.journalRecords;
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrFingerprintStore::apply(const QByteArray& accountname,
+                                const QList<Record>& records)
+{
+    foreach (const Record& record, records)
+    {
+        ConnContext* context = otrl_context_find(m_userstate,
+                                                 record.username.constData(),
+                                                 accountname.constData(),
+                                                 record.protocol.constData(),
+#if (OTRL_VERSION_MAJOR >= 4)
+                                                 OTRL_INSTAG_MASTER,
+#endif
+                                                 record.add, NULL,
+                                                 m_addAppData, m_appData);
+        if (!context)
+        {
+            continue;
+        }
+
+        QByteArray hash(record.fingerprint);
+        ::Fingerprint* fp = otrl_context_find_fingerprint(context,
+                                                          reinterpret_cast<unsigned char*>(hash.data()),
+                                                          record.add, NULL);
+        if (!fp)
+        {
+            continue;
+        }
+
+        if (record.add)
+        {
+            otrl_context_set_trust(fp, record.trust.constData());
+        }
+        else
+        {
+            otrl_context_forget_fingerprint(fp, true);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+OtrFingerprintStore::ParseResult OtrFingerprintStore::parse(const QString& fingerprintFile,
+                                                            const QString& oldJournalFile,
+                                                            const QString& journalFile)
+{
+    ParseResult result;
+    parseFile(fingerprintFile, false, result.accounts);
+    result.journalRecords  = parseFile(oldJournalFile, true, result.accounts);
+    result.journalRecords += parseFile(journalFile, true, result.accounts);
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * Parse a fingerprints file, or a journal where every line is prefixed
+ * with '+' or '-', and append the records to the lists of their accounts.
+ * Runs in the thread pool.
+ */
+int OtrFingerprintStore::parseFile(const QString& fileName, bool journal,
+                                   AccountRecords& accounts)
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly) || file.size() == 0)
+    {
+        return 0;
+    }
+
+    QByteArray buffer;
+    const char* pos = reinterpret_cast<const char*>(file.map(0, file.size()));
+    if (!pos)
+    {
+        buffer = file.readAll();
+        pos    = buffer.constData();
+    }
+    const char* end = pos + file.size();
+
+    int count = 0;
+    while (pos < end)
+    {
+        const char* eol = static_cast<const char*>(memchr(pos, '\n', end - pos));
+        if (!eol)
+        {
+            if (journal)
+            {
+                // Incomplete last record
+                break;
+            }
+            eol = end;
+        }
+
+        // [op,] username, accountname, protocol, fingerprint[, trust]
+        QList<QByteArray> fields = QByteArray::fromRawData(pos, eol - pos).split('\t');
+        pos = eol + 1;
+
+        Record record;
+        record.add = true;
+        if (journal)
+        {
+            if (fields.isEmpty() || fields.first().size() != 1)
+            {
+                continue;
+            }
+            record.add = (fields.takeFirst().at(0) == '+');
+        }
+
+        if (fields.size() < 4)
+        {
+            continue;
+        }
+
+        record.username    = fields.at(0);
+        record.protocol    = fields.at(2);
+        record.fingerprint = QByteArray::fromHex(fields.at(3));
+        record.trust       = fields.value(4);
+        if (record.fingerprint.size() != FINGERPRINT_LEN)
+        {
+            continue;
+        }
+
+        accounts[fields.at(1)].append(record);
+        count++;
+    }
+
+    return count;
+}
+
+//-----------------------------------------------------------------------------
+
+QByteArray OtrFingerprintStore::snapshot()
+{
+    if (m_loader)
+    {
+        takeParsed();
+    }
+
+    // The accounts not used yet are carried over as parsed, so that
+    // a compaction does not create all their contexts.
+    QByteArray data;
+    AccountRecords::iterator account;
+    for (account = m_unloaded.begin(); account != m_unloaded.end(); ++account)
+    {
+        account.value() = merge(account.value());
+        foreach (const Record& record, account.value())
+        {
+            appendRecord(data, account.key(), record);
+        }
+    }
+
+    for (ConnContext* context = m_userstate->context_root; context;
+         context = context->next)
+    {
+#if (OTRL_VERSION_MAJOR >= 4)
+        if (context->m_context != context)
+        {
+            continue;
+        }
+#endif
+        for (::Fingerprint* fp = context->fingerprint_root.next; fp; fp = fp->next)
+        {
+            appendRecord(data, 0, context, fp);
+        }
+    }
+    return data;
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * Reduce the records of an account to the fingerprints which are known
+ * after applying them in order, keeping the latest trust of each.
+ */
+QList<OtrFingerprintStore::Record> OtrFingerprintStore::merge(const QList<Record>& records)
+{
+    QList<Record> merged;
+    QHash<QByteArray, int> positions;
+    foreach (const Record& record, records)
+    {
+        QByteArray key = record.username + '\t' + record.protocol + '\t' +
+                         record.fingerprint;
+        QHash<QByteArray, int>::iterator it = positions.find(key);
+        if (record.add)
+        {
+            if (it == positions.end())
+            {
+                positions.insert(key, merged.size());
+                merged.append(record);
+            }
+            else
+            {
+                merged[it.value()].trust = record.trust;
+            }
+        }
+        else if (it != positions.end())
+        {
+            merged[it.value()].add = false;
+            positions.erase(it);
+        }
+    }
+
+    QList<Record> result;
+    foreach (const Record& record, merged)
+    {
+        if (record.add)
+        {
+            result.append(record);
+        }
+    }
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+
+ConnContext* OtrFingerprintStore::masterContext(ConnContext* context)
+{
+#if (OTRL_VERSION_MAJOR >= 4)
+    return context->m_context;
+#else
+    return context;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * Append a line in the format of otrl_privkey_write_fingerprints(),
+ * prefixed with op unless it is 0. Removals carry no trust.
+ */
+void OtrFingerprintStore::appendRecord(QByteArray& out, char op,
+                                       ConnContext* context,
+                                       ::Fingerprint* fingerprint)
+{
+    if (op)
+    {
+        out.append(op).append('\t');
+    }
+    out.append(context->username).append('\t')
+       .append(context->accountname).append('\t')
+       .append(context->protocol).append('\t')
+       .append(QByteArray::fromRawData(reinterpret_cast<const char*>(fingerprint->fingerprint),
+                                       FINGERPRINT_LEN).toHex());
+    if (op != '-')
+    {
+        out.append('\t');
+        if (fingerprint->trust)
+        {
+            out.append(fingerprint->trust);
+        }
+    }
+    out.append('\n');
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * Append a parsed record of accountname in the format of the
+ * fingerprints file.
+ */
+void OtrFingerprintStore::appendRecord(QByteArray& out,
+                                       const QByteArray& accountname,
+                                       const Record& record)
+{
+    out.append(record.username).append('\t')
+       .append(accountname).append('\t')
+       .append(record.protocol).append('\t')
+       .append(record.fingerprint.toHex()).append('\t')
+       .append(record.trust).append('\n');
+}
+
+//-----------------------------------------------------------------------------
+
+bool OtrFingerprintStore::writeSnapshot(const QString& fileName,
+                                        const QByteArray& data)
+{
+    QByteArray name = QFile::encodeName(fileName);
+    char* tmpName;
+    FILE* tmp = otrl_file_open_tmp(name.constData(), &tmpName);
+    if (!tmp)
+    {
+        return false;
+    }
+
+    bool written;
+    if (fwrite(data.constData(), 1, data.size(), tmp) != static_cast<size_t>(data.size()))
+    {
+        fclose(tmp);
+        remove(tmpName);
+        written = false;
+    }
+    else
+    {
+        // Synced and renamed over the old file, which stays complete
+        // until then.
+        written = !otrl_file_replace(tmp, tmpName, name.constData());
+    }
+    free(tmpName);
+    return written;
+}
@@ -0,0 +1,183 @@
+/*
+ * otrfingerprintstore.h - Journaled storage of known fingerprints
+ *
+ * Off-the-Record Messaging plugin for Psi+
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef OTRFINGERPRINTSTORE_H_
+#define OTRFINGERPRINTSTORE_H_
+
+#include "otrinternal.h"
+
+#include <QObject>
+#include <QString>
+#include <QByteArray>
+#include <QList>
+#include <QHash>
+#include <QFile>
+#include <QFutureWatcher>
+
+// ---------------------------------------------------------------------------
+
+/**
+ * Keeps the fingerprints file of a userstate up to date without
+ * rewriting it on every change.
+ *
+ * Changes are appended to a journal next to the fingerprints file.
+ * When the journal grows too long it is compacted: the fingerprints are
+ * serialized on the calling thread and written in the background, the
+ * journal is meanwhile rotated to "<file>.journal.old". Accounts which
+ * are not loaded yet are written from their parsed records. Loading reads
+ * the fingerprints file, the rotated and the current journal, in that
+ * order.
+ *
+ * The files are parsed in the background. The contexts of an account
+ * are created when it is first used, waiting for the parser if needed.
+ */
+class OtrFingerprintStore : public QObject
+{
+    Q_OBJECT
+
+public:
+    OtrFingerprintStore(OtrlUserState userstate, const QString& fingerprintFile,
+                        OtrMetrics* metrics, QObject* parent = 0);
+
+    /**
+     * Waits for running background work.
+     */
+    ~OtrFingerprintStore();
+
+    /**
+     * Start reading the stored fingerprints.
+     * addAppData is called for every created context.
+     */
+    void load(void (*addAppData)(void*, ConnContext*), void* data);
+
+    /**
+     * Create the contexts and fingerprints stored for accountname.
+     */
+    void ensureLoaded(const char* accountname);
+
+    /**
+     * Create the contexts and fingerprints of all accounts.
+     */
+    void ensureAllLoaded();
+
+    /**
+     * Accounts whose stored fingerprints are not loaded yet.
+     */
+    QList<QByteArray> unloadedAccounts();
+
+    /**
+     * Record all fingerprints of the master context of context.
+     */
+    void contextChanged(ConnContext* context);
+
+    /**
+     * Record the trust of fingerprint.
+     */
+    void fingerprintChanged(ConnContext* context, ::Fingerprint* fingerprint);
+
+    /**
+     * Record that fingerprint is forgotten.
+     * Must be called before the fingerprint is freed.
+     */
+    void fingerprintRemoved(ConnContext* context, ::Fingerprint* fingerprint);
+
+    /**
+     * Rewrite the fingerprints file in the background and start
+     * a new journal.
+     */
+    void compact();
+
+private slots:
+    void onParsed();
+    void onCompacted();
+
+private:
+    struct Record
+    {
+        bool       add;
+        QByteArray username;
+        QByteArray protocol;
+        QByteArray fingerprint;
+        QByteArray trust;
+    };
+
+    typedef QHash<QByteArray, QList<Record> > AccountRecords;
+
+    struct ParseResult
+    {
+        ParseResult() : accounts(), journalRecords(0) {}
+
+        AccountRecords accounts;
+        int            journalRecords;
+    };
+
+    void takeParsed();
+    void apply(const QByteArray& accountname, const QList<Record>& records);
+    void append(const QByteArray& records, int count);
+    bool openJournal();
+    bool rotateJournal();
+    QByteArray snapshot();
+
+    static ParseResult parse(const QString& fingerprintFile,
+                             const QString& oldJournalFile,
+                             const QString& journalFile);
+    static int  parseFile(const QString& fileName, bool journal,
+                          AccountRecords& accounts);
+
+    static QList<Record> merge(const QList<Record>& records);
+    static ConnContext* masterContext(ConnContext* context);
+    static void appendRecord(QByteArray& out, char op, ConnContext* context,
+                             ::Fingerprint* fingerprint);
+    static void appendRecord(QByteArray& out, const QByteArray& accountname,
+                             const Record& record);
+    static bool writeSnapshot(const QString& fileName, const QByteArray& data);
+
+    OtrlUserState          m_userstate;
+    OtrMetrics*            m_metrics;
+    QString                m_fingerprintFile;
+    QString                m_journalFile;
+    QString                m_oldJournalFile;
+    QFile                  m_journal;
+
+    void (*m_addAppData)(void*, ConnContext*);
+    void*                  m_appData;
+
+    /**
+     * Parsed records of the accounts which are not used yet.
+     */
+    AccountRecords         m_unloaded;
+    QFutureWatcher<ParseResult>* m_loader;
+
+    /**
+     * Number of records written since the last compaction.
+     */
+    int                    m_records;
+
+    /**
+     * Set if compact() is called while a compaction is running.
+     */
+    bool                   m_compactAgain;
+
+    QFutureWatcher<bool>*  m_compaction;
+};
+
+// ---------------------------------------------------------------------------
+
+#endif
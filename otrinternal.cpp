@@ -27,21 +27,25 @@
  */
 
 #include "otrinternal.h"
+#include "otrkeygenerator.h"
+#include "otrfingerprintstore.h"
+#include "otrcapabilitycache.h"
 
 #include <assert.h>
+#include <string.h>
 #include <Qt>
 #include <QCoreApplication>
-#include <QMessageBox>
-#include <QAbstractButton>
-#include <QtConcurrentRun>
-#include <QFutureWatcher>
 #include <QString>
+#include <QStringList>
 #include <QByteArray>
 #include <QRegExp>
 #include <QList>
 #include <QHash>
+#include <QSet>
 #include <QDir>
 #include <QFile>
+#include <QFileInfo>
+#include <QElapsedTimer>
 
 //-----------------------------------------------------------------------------
 
@@ -49,6 +53,143 @@ static const char*   OTR_PROTOCOL_STRING = "prpl-jabber";
 static const QString OTR_FINGERPRINTS_FILE = "otr.fingerprints";
 static const QString OTR_KEYS_FILE = "otr.keys";
 static const QString OTR_INSTAGS_FILE = "otr.instags";
+static const QString OTR_CAPABILITIES_FILE = "otr.capabilities";
+static const unsigned int OTR_INSTAG_MASTER = 0;
+
+/**
+ * Time for which messages wait for a running AKE. One the peer never
+ * answers would otherwise hold them until they time out.
+ */
+static const int OTR_AKE_HOLD_MSECS = 5000;
+
+//-----------------------------------------------------------------------------
+
+namespace
+{
+
+/**
+ * Attached to every indexed ConnContext as app_data, so that libotr
+ * reports when the context is freed.
+ */
+struct ContextAppData
+{
+    ContextAppData(OtrInternal* owner, const OtrContextKey& key,
+                   ConnContext* context)
+        : owner(owner), key(key), context(context), akeStarted(),
+          capabilityRead(false), noOtr(false)
+    {
+    }
+
+    OtrInternal*  owner;
+    OtrContextKey key;
+    ConnContext*  context;
+
+    /**
+     * Valid while an AKE runs in the context.
+     */
+    QElapsedTimer akeStarted;
+
+    /**
+     * Copy of the capability cache entry of the contact, read once for
+     * the policy callback and refreshed whenever the capability is
+     * learned.
+     */
+    bool          capabilityRead;
+    bool          noOtr;
+};
+
+/**
+ * Update the cached capability of master and all its instances.
+ */
+void rememberCapability(ConnContext* master, bool noOtr)
+{
+#if (OTRL_VERSION_MAJOR >= 4)
+    // libotr keeps the instances right behind their master.
+    for (ConnContext* context = master; context && context->m_context == master;
+         context = context->next)
+#else
+    for (ConnContext* context = master; context; context = NULL)
+#endif
+    {
+        if (context->app_data)
+        {
+            ContextAppData* appData = static_cast<ContextAppData*>(context->app_data);
+            appData->capabilityRead = true;
+            appData->noOtr          = noOtr;
+        }
+    }
+}
+
+/**
+ * Start or stop the AKE timer of context according to its auth state.
+ */
+void trackAke(ConnContext* context)
+{
+    if (!context || !context->app_data)
+    {
+        return;
+    }
+
+    ContextAppData* appData = static_cast<ContextAppData*>(context->app_data);
+    if (context->auth.authstate == OTRL_AUTHSTATE_NONE)
+    {
+        appData->akeStarted.invalidate();
+    }
+    else if (!appData->akeStarted.isValid())
+    {
+        appData->akeStarted.start();
+    }
+}
+
+/**
+ * True if an AKE runs in context and started recently.
+ */
+bool isRecentAke(ConnContext* context)
+{
+    trackAke(context);
+    if (!context || !context->app_data)
+    {
+        return false;
+    }
+
+    const QElapsedTimer& started =
+        static_cast<ContextAppData*>(context->app_data)->akeStarted;
+    return started.isValid() && !started.hasExpired(OTR_AKE_HOLD_MSECS);
+}
+
+unsigned int contextInstag(ConnContext* context)
+{
+#if (OTRL_VERSION_MAJOR >= 4)
+    return context->their_instance;
+#else
+    Q_UNUSED(context);
+    return OTR_INSTAG_MASTER;
+#endif
+}
+
+} // namespace
+
+// ============================================================================
+
+OtrContextKey::OtrContextKey(const QString& account, const QString& contact,
+                             unsigned int instag)
+    : account(account),
+      contact(contact),
+      instag(instag)
+{
+}
+
+bool OtrContextKey::operator==(const OtrContextKey& other) const
+{
+    return instag == other.instag &&
+           contact == other.contact &&
+           account == other.account;
+}
+
+uint qHash(const OtrContextKey& key)
+{
+    return qHash(key.contact) ^ (qHash(key.account) * 31) ^ key.instag;
+}
 
 // ============================================================================
 
@@ -58,7 +199,10 @@ OtrInternal::OtrInternal(psiotr::OtrCallback* callback,
       m_uiOps(),
       m_callback(callback),
       m_otrPolicy(policy),
-      is_generating(false)
+      m_keyGenerator(NULL),
+      m_fingerprintStore(NULL),
+      m_capabilities(NULL),
+      m_batchDepth(0)
 {
     QDir profileDir(callback->dataDir());
 
@@ -66,6 +210,8 @@ OtrInternal::OtrInternal(psiotr::OtrCallback* callback,
     m_instagsFile     = profileDir.filePath(OTR_INSTAGS_FILE);
     m_fingerprintFile = profileDir.filePath(OTR_FINGERPRINTS_FILE);
 
+    m_messageBuffer.reserve(4096);
+
     OTRL_INIT;
     m_userstate                 = otrl_userstate_create();
     m_uiOps.policy              = (*OtrInternal::cb_policy);
@@ -86,6 +232,7 @@ OtrInternal::OtrInternal(psiotr::OtrCallback* callback,
 #endif
 
 #if (OTRL_VERSION_MAJOR >= 4)
+    m_uiOps.max_message_size    = (*OtrInternal::cb_max_message_size);
     m_uiOps.handle_msg_event    = (*OtrInternal::cb_handle_msg_event);
     m_uiOps.handle_smp_event    = (*OtrInternal::cb_handle_smp_event);
     m_uiOps.create_instag       = (*OtrInternal::cb_create_instag);
@@ -100,18 +247,27 @@ OtrInternal::OtrInternal(psiotr::OtrCallback* callback,
 #endif
 
     otrl_privkey_read(m_userstate, QFile::encodeName(m_keysFile).constData());
-    otrl_privkey_read_fingerprints(m_userstate,
-                                   QFile::encodeName(m_fingerprintFile).constData(),
-                                   NULL, NULL);
+    loadPrivateKeys();
+    m_fingerprintStore = new OtrFingerprintStore(m_userstate, m_fingerprintFile,
+                                                 &m_metrics);
+    m_fingerprintStore->load((*OtrInternal::cb_add_app_data), this);
 #if (OTRL_VERSION_MAJOR >= 4)
     otrl_instag_read(m_userstate, QFile::encodeName(m_instagsFile).constData());
 #endif
+
+    m_keyGenerator = new OtrKeyGenerator(this, m_userstate, m_keysFile);
+
+    m_capabilities = new OtrCapabilityCache(profileDir.filePath(OTR_CAPABILITIES_FILE));
+    m_capabilities->load();
 }
 
 //-----------------------------------------------------------------------------
 
 OtrInternal::~OtrInternal()
 {
+    delete m_keyGenerator;
+    delete m_fingerprintStore;
+    delete m_capabilities;
     otrl_userstate_free(m_userstate);
 }
 
@@ -123,21 +279,56 @@ QString OtrInternal::encryptMessage(const QString& account, const QString& conta
     char* encMessage = NULL;
     gcry_error_t err;
 
-    err = otrl_message_sending(m_userstate, &m_uiOps, this,
-                               account.toUtf8().constData(), OTR_PROTOCOL_STRING,
-                               contact.toUtf8().constData(),
+    if (m_otrPolicy == psiotr::OTR_POLICY_REQUIRE &&
+        (m_keyGenerator->isGenerating(account) ||
+         !otrl_privkey_find(m_userstate, m_names.utf8(account),
+                            OTR_PROTOCOL_STRING)))
+    {
+        // Encryption is required but impossible without a key. The
+        // outbound catcher holds messages until the session is secure, so
+        // only a message sent around it ends up here; it is refused rather
+        // than encrypted from within a libotr callback later.
+        waitForKey(account, contact);
+        m_callback->displayOtrMessage(account, contact,
+                                      QObject::tr("The message was not sent, "
+                                                  "no private key is available yet."));
+        return QString();
+    }
+
+    m_fingerprintStore->ensureLoaded(m_names.utf8(account));
+
+    m_sendingAccount = account;
+    m_sendingContact = contact;
+
+    {
+        OtrMetrics::Timer timer(&m_metrics, OtrMetrics::OP_SEND);
+        err = otrl_message_sending(m_userstate, &m_uiOps, this,
+                                   m_names.utf8(account), OTR_PROTOCOL_STRING,
+                                   m_names.utf8(contact),
 #if (OTRL_VERSION_MAJOR >= 4)
-                               OTRL_INSTAG_BEST,
+                                   OTRL_INSTAG_BEST,
 #endif
-                               message.toUtf8().constData(),
-                               NULL, &encMessage,
+                                   OtrNameTable::encode(message, m_messageBuffer),
+                                   NULL, &encMessage,
 #if (OTRL_VERSION_MAJOR >= 4)
-                               OTRL_FRAGMENT_SEND_SKIP,
-                               NULL,
+                                   OTRL_FRAGMENT_SEND_ALL_BUT_LAST,
+                                   NULL,
 #endif
-                               NULL, NULL);
+                                   (*OtrInternal::cb_add_app_data), this);
+    }
+
+    m_sendingAccount.clear();
+    m_sendingContact.clear();
+
     if (err)
     {
+        // Without the last fragment the others cannot be reassembled.
+        m_fragments.clear();
+        if (encMessage)
+        {
+            otrl_message_free(encMessage);
+        }
+
         QString err_message = QObject::tr("Encrypting message to %1 "
                                           "failed.\nThe message was not sent.")
                                           .arg(contact);
@@ -148,6 +339,14 @@ QString OtrInternal::encryptMessage(const QString& account, const QString& conta
         return QString();
     }
 
+    // All fragments but the last were injected; they have to leave
+    // before the last one, which is returned in encMessage.
+    if (!m_fragments.isEmpty())
+    {
+        m_callback->sendMessages(account, contact, m_fragments);
+        m_fragments.clear();
+    }
+
     if (encMessage)
     {
         QString retMessage(QString::fromUtf8(encMessage));
@@ -166,31 +365,57 @@ psiotr::OtrMessageType OtrInternal::decryptMessage(const QString& account,
                                                    const QString& cryptedMessage,
                                                    QString& decrypted)
 {
-    QByteArray accArray  = account.toUtf8();
-    QByteArray userArray = contact.toUtf8();
-    const char* accountName = accArray.constData();
-    const char* userName    = userArray.constData();
+    const char* accountName = m_names.utf8(account);
+    const char* userName    = m_names.utf8(contact);
 
     int ignoreMessage = 0;
     char* newMessage  = NULL;
     OtrlTLV* tlvs     = NULL;
     OtrlTLV* tlv      = NULL;
 
-    ignoreMessage = otrl_message_receiving(m_userstate, &m_uiOps, this,
-                                           accountName,
-                                           OTR_PROTOCOL_STRING,
-                                           userName,
-                                           cryptedMessage.toUtf8().constData(),
-                                           &newMessage,
-                                           &tlvs, NULL,
+    m_fingerprintStore->ensureLoaded(accountName);
+
+    ConnContext* master = m_contexts.value(OtrContextKey(account, contact,
+                                                         OTR_INSTAG_MASTER));
+    bool wasRejected = master && master->otr_offer == OFFER_REJECTED;
+
+    m_receivingAccount = account;
+    m_receivingContact = contact;
+
+    {
+        OtrMetrics::Timer timer(&m_metrics, OtrMetrics::OP_RECEIVE);
+        ignoreMessage = otrl_message_receiving(m_userstate, &m_uiOps, this,
+                                               accountName,
+                                               OTR_PROTOCOL_STRING,
+                                               userName,
+                                               OtrNameTable::encode(cryptedMessage,
+                                                                    m_messageBuffer),
+                                               &newMessage,
+                                               &tlvs,
 #if (OTRL_VERSION_MAJOR >= 4)
-                                           NULL,
+                                               NULL,
 #endif
-                                           NULL);
+                                               (*OtrInternal::cb_add_app_data), this);
+    }
+
+    m_receivingAccount.clear();
+    m_receivingContact.clear();
+
+    // Received messages start and finish AKEs, see isNegotiating()
+    trackAke(m_contexts.value(OtrContextKey(account, contact, OTR_INSTAG_MASTER)));
+    trackAke(findContext(account, contact));
+
+    learnCapability(account, contact, cryptedMessage, wasRejected);
+
+    // SMP messages change the state without a callback with libotr < 4.0.0,
+    // and with libotr 4 any message can make another instance the most
+    // recent one.
+    invalidateSnapshot(account, contact);
+
     tlv = otrl_tlv_find(tlvs, OTRL_TLV_DISCONNECTED);
     if (tlv) {
-        m_callback->stateChange(accountName, userName,
-                                psiotr::OTR_STATECHANGE_REMOTECLOSE);
+        notifyStateChange(account, contact,
+                          psiotr::OTR_STATECHANGE_REMOTECLOSE);
     }
 
 #if (OTRL_VERSION_MAJOR >= 4)
@@ -202,9 +427,7 @@ psiotr::OtrMessageType OtrInternal::decryptMessage(const QString& account,
     }
 #else
     // Check for SMP data (required only with libotr < 4.0.0)
-    ConnContext* context = otrl_context_find(m_userstate, userName, accountName,
-                                OTR_PROTOCOL_STRING,
-                                false, NULL, NULL, NULL);
+    ConnContext* context = findContext(account, contact);
     if (context) {
         NextExpectedSMP nextMsg = context->smstate->nextExpected;
 
@@ -214,7 +437,7 @@ psiotr::OtrMessageType OtrInternal::decryptMessage(const QString& account,
             context->smstate->nextExpected  = OTRL_SMP_EXPECT1;
             context->smstate->sm_prog_state = OTRL_SMP_PROG_OK;
             // Report result to user
-            m_callback->updateSMP(accountName, userName, -2);
+            m_callback->updateSMP(account, contact, -2);
         }
         else
         {
@@ -229,7 +452,7 @@ psiotr::OtrMessageType OtrInternal::decryptMessage(const QString& account,
                     char* question = (char *)tlv->data;
                     char* eoq = static_cast<char*>(memchr(question, '\0', tlv->len));
                     if (eoq) {
-                        m_callback->receivedSMP(accountName, userName,
+                        m_callback->receivedSMP(account, contact,
                                                 QString::fromUtf8(question));
                     }
                 }
@@ -242,7 +465,7 @@ psiotr::OtrMessageType OtrInternal::decryptMessage(const QString& account,
                 }
                 else
                 {
-                    m_callback->receivedSMP(accountName, userName, QString());
+                    m_callback->receivedSMP(account, contact, QString());
                 }
             }
             tlv = otrl_tlv_find(tlvs, OTRL_TLV_SMP2);
@@ -256,7 +479,7 @@ psiotr::OtrMessageType OtrInternal::decryptMessage(const QString& account,
                     // If we received TLV2, we will send TLV3 and expect TLV4
                     context->smstate->nextExpected = OTRL_SMP_EXPECT4;
                     // Report result to user
-                    m_callback->updateSMP(accountName, userName, 66);
+                    m_callback->updateSMP(account, contact, 66);
                 }
             }
             tlv = otrl_tlv_find(tlvs, OTRL_TLV_SMP3);
@@ -270,7 +493,7 @@ psiotr::OtrMessageType OtrInternal::decryptMessage(const QString& account,
                     // SMP finished, reset
                     context->smstate->nextExpected = OTRL_SMP_EXPECT1;
                     // Report result to user
-                    m_callback->updateSMP(accountName, userName, 100);
+                    m_callback->updateSMP(account, contact, 100);
                 }
             }
             tlv = otrl_tlv_find(tlvs, OTRL_TLV_SMP4);
@@ -284,7 +507,7 @@ psiotr::OtrMessageType OtrInternal::decryptMessage(const QString& account,
                     // SMP finished, reset
                     context->smstate->nextExpected = OTRL_SMP_EXPECT1;
                     // Report result to user
-                    m_callback->updateSMP(accountName, userName, 100);
+                    m_callback->updateSMP(account, contact, 100);
                 }
             }
             tlv = otrl_tlv_find(tlvs, OTRL_TLV_SMP_ABORT);
@@ -292,7 +515,7 @@ psiotr::OtrMessageType OtrInternal::decryptMessage(const QString& account,
                 // SMP aborted, reset
                 context->smstate->nextExpected = OTRL_SMP_EXPECT1;
                 // Report result to user
-                m_callback->updateSMP(accountName, userName, -1);
+                m_callback->updateSMP(account, contact, -1);
             }
         }
     }
@@ -318,12 +541,132 @@ psiotr::OtrMessageType OtrInternal::decryptMessage(const QString& account,
 
 //-----------------------------------------------------------------------------
 
+void OtrInternal::decryptMessages(const QString& account,
+                                  QList<psiotr::IncomingMessage>& messages)
+{
+    // State changes caused by the batch are reported once it is done.
+    m_batchDepth++;
+
+    QList<psiotr::IncomingMessage>::iterator it;
+    for (it = messages.begin(); it != messages.end(); ++it)
+    {
+        it->type = decryptMessage(account, it->contact, it->message,
+                                  it->decrypted);
+    }
+
+    m_batchDepth--;
+
+    if (m_batchDepth == 0)
+    {
+        QList<PendingStateChange> pending(m_pendingStateChanges);
+        m_pendingStateChanges.clear();
+
+        foreach (const PendingStateChange& change, pending)
+        {
+            m_callback->stateChange(change.account, change.contact,
+                                    change.change);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+bool OtrInternal::needsDecryption(const QString& account,
+                                  const QString& contact,
+                                  const QString& message)
+{
+    // Every OTR message contains "?OTR" and every whitespace tag starts
+    // with a tab, so one pass over the UTF-16 data without any conversion
+    // finds the first kind; the tag is looked for once after the pass.
+    bool hasTab = false;
+    const ushort* pos = message.utf16();
+    const ushort* end = pos + message.size();
+    for (; pos != end; ++pos)
+    {
+        if (*pos == '?')
+        {
+            if (end - pos >= 4 && pos[1] == 'O' && pos[2] == 'T' && pos[3] == 'R')
+            {
+                return true;
+            }
+        }
+        else if (*pos == '\t')
+        {
+            hasTab = true;
+        }
+    }
+
+    if (hasTab && message.contains(QLatin1String(OTRL_MESSAGE_TAG_BASE)))
+    {
+        return true;
+    }
+
+    // libotr warns about plain text when encryption is required or the
+    // conversation is not in plain text, and withdraws a whitespace
+    // offer which is not answered.
+    if (m_otrPolicy == psiotr::OTR_POLICY_REQUIRE)
+    {
+        return true;
+    }
+
+    // Stored fingerprints only create plain text contexts, so the
+    // accounts are not loaded for this.
+    ConnContext* context = m_contexts.value(OtrContextKey(account, contact,
+                                                          OTR_INSTAG_MASTER));
+    if (!context)
+    {
+        return false;
+    }
+#if (OTRL_VERSION_MAJOR >= 4)
+    context = otrl_context_find_recent_secure_instance(context);
+#endif
+    return context->msgstate != OTRL_MSGSTATE_PLAINTEXT ||
+           context->otr_offer == OFFER_SENT;
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrInternal::learnCapability(const QString& account, const QString& contact,
+                                  const QString& message, bool wasRejected)
+{
+    // Only a tag or an encoded message (data, AKE or a fragment of them)
+    // comes from an OTR client; a query or an error can be an echo of
+    // our own text.
+    ConnContext* context = m_contexts.value(OtrContextKey(account, contact,
+                                                          OTR_INSTAG_MASTER));
+    if (message.contains(QLatin1String(OTRL_MESSAGE_TAG_BASE)) ||
+        message.contains(QLatin1String("?OTR:")) ||
+        message.contains(QLatin1String("?OTR|")) ||
+        message.contains(QLatin1String("?OTR,")))
+    {
+        m_capabilities->setCapability(account, contact,
+                                      OtrCapabilityCache::CAPABILITY_OTR);
+        rememberCapability(context, false);
+        return;
+    }
+
+    // libotr rejects its own whitespace offer when the answer is plain
+    // text without a tag. Only that answer is recorded, later plain
+    // messages say nothing new.
+    if (!wasRejected && context && context->otr_offer == OFFER_REJECTED &&
+        context->msgstate == OTRL_MSGSTATE_PLAINTEXT)
+    {
+        m_capabilities->setCapability(account, contact,
+                                      OtrCapabilityCache::CAPABILITY_NO_OTR);
+        rememberCapability(context, true);
+    }
+}
+
+//-----------------------------------------------------------------------------
+
 QList<psiotr::Fingerprint> OtrInternal::getFingerprints()
 {
     QList<psiotr::Fingerprint> fpList;
     ConnContext* context;
     ::Fingerprint* fingerprint;
 
+    m_fingerprintStore->ensureAllLoaded();
+
     for (context = m_userstate->context_root; context != NULL;
          context = context->next)
     {
@@ -331,8 +674,8 @@ QList<psiotr::Fingerprint> OtrInternal::getFingerprints()
         while(fingerprint)
         {
             psiotr::Fingerprint fp (fingerprint->fingerprint,
-                                    QString::fromUtf8(context->accountname),
-                                    QString::fromUtf8(context->username),
+                                    m_names.string(context->accountname),
+                                    m_names.string(context->username),
                                     QString::fromUtf8(fingerprint->trust));
 
             fpList.append(fp);
@@ -344,17 +687,94 @@ QList<psiotr::Fingerprint> OtrInternal::getFingerprints()
 
 //-----------------------------------------------------------------------------
 
-void OtrInternal::verifyFingerprint(const psiotr::Fingerprint& fingerprint,
-                                    bool verified)
+QList<psiotr::Fingerprint> OtrInternal::getFingerprints(const QString& account)
 {
-    ConnContext* context = otrl_context_find(m_userstate,
-                                             fingerprint.username.toUtf8().constData(),
-                                             fingerprint.account.toUtf8().constData(),
-                                             OTR_PROTOCOL_STRING,
+    QList<psiotr::Fingerprint> fpList;
+    const char* accountName = m_names.utf8(account);
+
+    m_fingerprintStore->ensureLoaded(accountName);
+
+    for (ConnContext* context = m_userstate->context_root; context != NULL;
+         context = context->next)
+    {
+        if (strcmp(context->accountname, accountName) != 0)
+        {
+            continue;
+        }
+        for (::Fingerprint* fingerprint = context->fingerprint_root.next;
+             fingerprint != NULL; fingerprint = fingerprint->next)
+        {
+            fpList.append(psiotr::Fingerprint(fingerprint->fingerprint, account,
+                                              m_names.string(context->username),
+                                              QString::fromUtf8(fingerprint->trust)));
+        }
+    }
+    return fpList;
+}
+
+//-----------------------------------------------------------------------------
+
+QStringList OtrInternal::getFingerprintAccounts()
+{
+    QStringList accounts;
+
+    for (ConnContext* context = m_userstate->context_root; context != NULL;
+         context = context->next)
+    {
+        if (context->fingerprint_root.next)
+        {
+            QString account = m_names.string(context->accountname);
+            if (!accounts.contains(account))
+            {
+                accounts.append(account);
+            }
+        }
+    }
+
+    foreach (const QByteArray& accountname, m_fingerprintStore->unloadedAccounts())
+    {
+        QString account = m_names.string(accountname.constData());
+        if (!accounts.contains(account))
+        {
+            accounts.append(account);
+        }
+    }
+    return accounts;
+}
+
+//-----------------------------------------------------------------------------
+
+QList<psiotr::Fingerprint> OtrInternal::getFingerprints(const QString& account,
+                                                        const QString& contact)
+{
+    QList<psiotr::Fingerprint> fpList;
+    ConnContext* context = findContext(account, contact);
 #if (OTRL_VERSION_MAJOR >= 4)
-                                             OTRL_INSTAG_BEST,
+    if (context)
+    {
+        // Fingerprints are kept by the master context
+        context = context->m_context;
+    }
 #endif
-                                             false, NULL, NULL, NULL);
+    if (context)
+    {
+        for (::Fingerprint* fingerprint = context->fingerprint_root.next;
+             fingerprint != NULL; fingerprint = fingerprint->next)
+        {
+            fpList.append(psiotr::Fingerprint(fingerprint->fingerprint,
+                                              account, contact,
+                                              QString::fromUtf8(fingerprint->trust)));
+        }
+    }
+    return fpList;
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrInternal::verifyFingerprint(const psiotr::Fingerprint& fingerprint,
+                                    bool verified)
+{
+    ConnContext* context = findContext(fingerprint.account, fingerprint.username);
     if (context)
     {
         ::Fingerprint* fp = otrl_context_find_fingerprint(context,
@@ -363,13 +783,15 @@ void OtrInternal::verifyFingerprint(const psiotr::Fingerprint& fingerprint,
         if (fp)
         {
             otrl_context_set_trust(fp, verified? "verified" : "");
-            write_fingerprints();
+            invalidateSnapshot(context);
+            m_fingerprintStore->fingerprintChanged(context, fp);
+            m_callback->fingerprintsChanged(fingerprint.account, fingerprint.username);
 
             if (context->active_fingerprint == fp)
             {
-                m_callback->stateChange(QString::fromUtf8(context->accountname),
-                                        QString::fromUtf8(context->username),
-                                        psiotr::OTR_STATECHANGE_TRUST);
+                notifyStateChange(m_names.string(context->accountname),
+                                  m_names.string(context->username),
+                                  psiotr::OTR_STATECHANGE_TRUST);
             }
         }
     }
@@ -379,14 +801,7 @@ void OtrInternal::verifyFingerprint(const psiotr::Fingerprint& fingerprint,
 
 void OtrInternal::deleteFingerprint(const psiotr::Fingerprint& fingerprint)
 {
-    ConnContext* context = otrl_context_find(m_userstate,
-                                             fingerprint.username.toUtf8().constData(),
-                                             fingerprint.account.toUtf8().constData(),
-                                             OTR_PROTOCOL_STRING,
-#if (OTRL_VERSION_MAJOR >= 4)
-                                             OTRL_INSTAG_BEST,
-#endif
-                                             false, NULL, NULL, NULL);
+    ConnContext* context = findContext(fingerprint.account, fingerprint.username);
     if (context)
     {
         ::Fingerprint* fp = otrl_context_find_fingerprint(context,
@@ -398,8 +813,10 @@ void OtrInternal::deleteFingerprint(const psiotr::Fingerprint& fingerprint)
             {
                 otrl_context_force_finished(context);
             }
+            m_fingerprintStore->fingerprintRemoved(context, fp);
+            invalidateSnapshot(context);
             otrl_context_forget_fingerprint(fp, true);
-            write_fingerprints();
+            m_callback->fingerprintsChanged(fingerprint.account, fingerprint.username);
         }
     }
 }
@@ -408,25 +825,38 @@ void OtrInternal::deleteFingerprint(const psiotr::Fingerprint& fingerprint)
 
 QHash<QString, QString> OtrInternal::getPrivateKeys()
 {
-    QHash<QString, QString> privKeyList;
-    OtrlPrivKey* privKey;
+    return m_privateKeys;
+}
 
-    for (privKey = m_userstate->privkey_root; privKey != NULL;
+//-----------------------------------------------------------------------------
+
+void OtrInternal::loadPrivateKeys()
+{
+    m_privateKeys.clear();
+
+    for (OtrlPrivKey* privKey = m_userstate->privkey_root; privKey != NULL;
          privKey = privKey->next)
     {
-        char fingerprintBuf[OTRL_PRIVKEY_FPRINT_HUMAN_LEN];
-        char* success = otrl_privkey_fingerprint(m_userstate,
-                                                 fingerprintBuf,
-                                                 privKey->accountname,
-                                                 OTR_PROTOCOL_STRING);
-        if (success)
+        QString fingerprint = privateKeyFingerprint(privKey->accountname);
+        if (!fingerprint.isEmpty())
         {
-            privKeyList.insert(QString::fromUtf8(privKey->accountname),
-                               QString(fingerprintBuf));
+            m_privateKeys.insert(m_names.string(privKey->accountname),
+                                 fingerprint);
         }
     }
+}
 
-    return privKeyList;
+//-----------------------------------------------------------------------------
+
+QString OtrInternal::privateKeyFingerprint(const char* accountname)
+{
+    char fingerprintBuf[OTRL_PRIVKEY_FPRINT_HUMAN_LEN];
+    if (otrl_privkey_fingerprint(m_userstate, fingerprintBuf,
+                                 accountname, OTR_PROTOCOL_STRING))
+    {
+        return QString(fingerprintBuf);
+    }
+    return QString();
 }
 
 //-----------------------------------------------------------------------------
@@ -434,26 +864,45 @@ QHash<QString, QString> OtrInternal::getPrivateKeys()
 void OtrInternal::deleteKey(const QString& account)
 {
     OtrlPrivKey* privKey = otrl_privkey_find(m_userstate,
-                                             account.toUtf8().constData(),
+                                             m_names.utf8(account),
                                              OTR_PROTOCOL_STRING);
 
     otrl_privkey_forget(privKey);
+    m_privateKeys.remove(account);
+
+    {
+        OtrMetrics::Timer timer(&m_metrics, OtrMetrics::OP_KEYS_WRITE);
+        otrl_privkey_write(m_userstate, QFile::encodeName(m_keysFile).constData());
+    }
+    if (m_metrics.isEnabled())
+    {
+        m_metrics.add(OtrMetrics::COUNTER_KEYS_BYTES, QFileInfo(m_keysFile).size());
+    }
 
-    otrl_privkey_write(m_userstate, QFile::encodeName(m_keysFile).constData());
+    m_callback->keyDeleted(account);
 }
 
 //-----------------------------------------------------------------------------
 
 void OtrInternal::startSession(const QString& account, const QString& contact)
 {
-    m_callback->stateChange(account, contact, psiotr::OTR_STATECHANGE_GOINGSECURE);
+    notifyStateChange(account, contact, psiotr::OTR_STATECHANGE_GOINGSECURE);
 
-    if (!otrl_privkey_find(m_userstate, account.toUtf8().constData(),
+    if (!otrl_privkey_find(m_userstate, m_names.utf8(account),
                            OTR_PROTOCOL_STRING))
     {
-        create_privkey(account.toUtf8().constData(), OTR_PROTOCOL_STRING);
+        // The query is sent by keyGenerated()
+        waitForKey(account, contact);
+        return;
     }
 
+    sendQuery(account, contact);
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrInternal::sendQuery(const QString& account, const QString& contact)
+{
     //TODO: make allowed otr versions configureable
     char* msg = otrl_proto_default_query_msg(m_callback->humanAccountPublic(account).toUtf8().constData(),
                                              OTRL_POLICY_DEFAULT);
@@ -461,51 +910,90 @@ void OtrInternal::startSession(const QString& account, const QString& contact)
     m_callback->sendMessage(account, contact, QString::fromUtf8(msg));
 
     free(msg);
+
+    m_metrics.start(OtrMetrics::OP_AKE, account, contact);
 }
 
 //-----------------------------------------------------------------------------
 
 void OtrInternal::endSession(const QString& account, const QString& contact)
 {
-    ConnContext* context = otrl_context_find(m_userstate,
-                                             contact.toUtf8().constData(),
-                                             account.toUtf8().constData(),
-                                             OTR_PROTOCOL_STRING,
-#if (OTRL_VERSION_MAJOR >= 4)
-                                             OTRL_INSTAG_BEST,
-#endif
-                                             false, NULL, NULL, NULL);
+    ConnContext* context = findContext(account, contact);
     if (context && (context->msgstate != OTRL_MSGSTATE_PLAINTEXT))
     {
-        m_callback->stateChange(account, contact, psiotr::OTR_STATECHANGE_CLOSE);
+        notifyStateChange(account, contact, psiotr::OTR_STATECHANGE_CLOSE);
     }
     otrl_message_disconnect(m_userstate, &m_uiOps, this,
-                            account.toUtf8().constData(), OTR_PROTOCOL_STRING,
-                            contact.toUtf8().constData()
+                            m_names.utf8(account), OTR_PROTOCOL_STRING,
+                            m_names.utf8(contact)
 #if (OTRL_VERSION_MAJOR >= 4)
                             ,OTRL_INSTAG_BEST
 #endif
                             );
+    invalidateSnapshot(account, contact);
 }
 
 //-----------------------------------------------------------------------------
 
 void OtrInternal::expireSession(const QString& account, const QString& contact)
 {
-    ConnContext* context = otrl_context_find(m_userstate,
-                                             contact.toUtf8().constData(),
-                                             account.toUtf8().constData(),
-                                             OTR_PROTOCOL_STRING,
-#if (OTRL_VERSION_MAJOR >= 4)
-                                             OTRL_INSTAG_BEST,
-#endif
-                                             false, NULL, NULL, NULL);
+    ConnContext* context = findContext(account, contact);
     if (context && (context->msgstate == OTRL_MSGSTATE_ENCRYPTED))
     {
         otrl_context_force_finished(context);
-        m_callback->stateChange(account, contact,
-                                psiotr::OTR_STATECHANGE_GONEINSECURE);
+        notifyStateChange(account, contact,
+                          psiotr::OTR_STATECHANGE_GONEINSECURE);
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+QStringList OtrInternal::streamLost(const QString& account)
+{
+    QStringList contacts;
+    QSet<QString> seen;
+    QByteArray accountname(m_names.utf8(account));
+
+    // One pass over all contexts, including the instances of libotr 4.
+    // Nothing can be sent any more, so no disconnect is injected.
+    QSet<QString> names;
+    for (ConnContext* context = m_userstate->context_root; context != NULL;
+         context = context->next)
+    {
+        if (accountname != context->accountname)
+        {
+            continue;
+        }
+
+        QString contact = m_names.string(context->username);
+        names.insert(contact);
+
+        if (context->msgstate == OTRL_MSGSTATE_PLAINTEXT)
+        {
+            continue;
+        }
+
+        otrl_context_force_plaintext(context);
+        invalidateSnapshot(context);
+
+        if (!seen.contains(contact))
+        {
+            seen.insert(contact);
+            contacts.append(contact);
+        }
     }
+
+    // Sessions waiting for the key of the account are not started any more
+    m_pendingSessions.remove(account);
+
+    // The names of the contacts are added again on the next message, so
+    // the table does not grow with every resource seen over a long uptime.
+    foreach (const QString& name, names)
+    {
+        m_names.remove(name);
+    }
+
+    return contacts;
 }
 
 //-----------------------------------------------------------------------------
@@ -513,14 +1001,7 @@ void OtrInternal::expireSession(const QString& account, const QString& contact)
 void OtrInternal::startSMP(const QString& account, const QString& contact,
                            const QString& question, const QString& secret)
 {
-    ConnContext* context = otrl_context_find(m_userstate,
-                                             contact.toUtf8().constData(),
-                                             account.toUtf8().constData(),
-                                             OTR_PROTOCOL_STRING,
-#if (OTRL_VERSION_MAJOR >= 4)
-                                             OTRL_INSTAG_BEST,
-#endif
-                                             false, NULL, NULL, NULL);
+    ConnContext* context = findContext(account, contact);
     if (context)
     {
         QByteArray  secretArray   = secret.toUtf8();
@@ -540,20 +1021,14 @@ void OtrInternal::startSMP(const QString& account, const QString& contact,
                                         reinterpret_cast<const unsigned char*>(const_cast<char*>(secretPointer)),
                                         secretLength);
         }
+        invalidateSnapshot(context);
     }
 }
 
 void OtrInternal::continueSMP(const QString& account, const QString& contact,
                               const QString& secret)
 {
-    ConnContext* context = otrl_context_find(m_userstate,
-                                             contact.toUtf8().constData(),
-                                             account.toUtf8().constData(),
-                                             OTR_PROTOCOL_STRING,
-#if (OTRL_VERSION_MAJOR >= 4)
-                                             OTRL_INSTAG_BEST,
-#endif
-                                             false, NULL, NULL, NULL);
+    ConnContext* context = findContext(account, contact);
     if (context)
     {
         QByteArray  secretArray   = secret.toUtf8();
@@ -563,43 +1038,89 @@ void OtrInternal::continueSMP(const QString& account, const QString& contact,
         otrl_message_respond_smp(m_userstate, &m_uiOps, this, context,
                                  reinterpret_cast<const unsigned char*>(secretPointer),
                                  secretLength);
+        invalidateSnapshot(context);
+    }
+}
+
+void OtrInternal::abortSMP(const QString& account, const QString& contact)
+{
+    ConnContext* context = findContext(account, contact);
+    if (context)
+    {
+        abortSMP(context);
     }
 }
 
-void OtrInternal::abortSMP(const QString& account, const QString& contact)
-{
-    ConnContext* context = otrl_context_find(m_userstate,
-                                             contact.toUtf8().constData(),
-                                             account.toUtf8().constData(),
-                                             OTR_PROTOCOL_STRING,
-#if (OTRL_VERSION_MAJOR >= 4)
-                                             OTRL_INSTAG_BEST,
-#endif
-                                             false, NULL, NULL, NULL);
-    if (context)
+void OtrInternal::abortSMP(ConnContext* context)
+{
+    otrl_message_abort_smp(m_userstate, &m_uiOps, this, context);
+    invalidateSnapshot(context);
+}
+
+//-----------------------------------------------------------------------------
+
+bool OtrInternal::hasContext(const QString& account, const QString& contact)
+{
+    return m_contexts.contains(OtrContextKey(account, contact,
+                                             OTR_INSTAG_MASTER));
+}
+
+//-----------------------------------------------------------------------------
+
+bool OtrInternal::isNegotiating(const QString& account, const QString& contact)
+{
+    if (m_pendingSessions.contains(account, contact))
+    {
+        return true;
+    }
+
+    // The AKE runs in the master context until the instance is known
+    ConnContext* master  = m_contexts.value(OtrContextKey(account, contact,
+                                                          OTR_INSTAG_MASTER));
+    ConnContext* context = findContext(account, contact);
+    return isRecentAke(master) || isRecentAke(context);
+}
+
+//-----------------------------------------------------------------------------
+
+bool OtrInternal::isOtrCapable(const QString& account, const QString& contact)
+{
+    if (m_capabilities->capability(account, contact) ==
+        OtrCapabilityCache::CAPABILITY_OTR)
+    {
+        return true;
+    }
+
+    m_fingerprintStore->ensureLoaded(m_names.utf8(account));
+
+    ConnContext* context = m_contexts.value(OtrContextKey(account, contact,
+                                                          OTR_INSTAG_MASTER));
+    if (!context)
     {
-        abortSMP(context);
+        return false;
+    }
+    for (::Fingerprint* fp = context->fingerprint_root.next; fp; fp = fp->next)
+    {
+        if (fp->trust && fp->trust[0])
+        {
+            return true;
+        }
     }
+    return false;
 }
 
-void OtrInternal::abortSMP(ConnContext* context)
+//-----------------------------------------------------------------------------
+
+psiotr::OtrMessageState OtrInternal::getMessageState(const QString& account,
+                                                     const QString& contact)
 {
-    otrl_message_abort_smp(m_userstate, &m_uiOps, this, context);
+    return messageState(findContext(account, contact));
 }
 
 //-----------------------------------------------------------------------------
 
-psiotr::OtrMessageState OtrInternal::getMessageState(const QString& account,
-                                                     const QString& contact)
+psiotr::OtrMessageState OtrInternal::messageState(ConnContext* context)
 {
-    ConnContext* context = otrl_context_find(m_userstate,
-                                             contact.toUtf8().constData(),
-                                             account.toUtf8().constData(),
-                                             OTR_PROTOCOL_STRING,
-#if (OTRL_VERSION_MAJOR >= 4)
-                                             OTRL_INSTAG_BEST,
-#endif
-                                             false, NULL, NULL, NULL);
     if (context)
     {
         if (context->msgstate == OTRL_MSGSTATE_PLAINTEXT)
@@ -621,11 +1142,101 @@ psiotr::OtrMessageState OtrInternal::getMessageState(const QString& account,
 
 //-----------------------------------------------------------------------------
 
+psiotr::SessionSnapshot OtrInternal::getSessionSnapshot(const QString& account,
+                                                        const QString& contact)
+{
+    OtrContextKey key(account, contact, OTR_INSTAG_MASTER);
+
+    QHash<OtrContextKey, psiotr::SessionSnapshot>::const_iterator it = m_snapshots.constFind(key);
+    if (it != m_snapshots.constEnd())
+    {
+        return it.value();
+    }
+
+    // Nothing is cached for contacts without a context, every contact
+    // in the roster is asked for its state.
+    ConnContext* context = findContext(account, contact);
+    psiotr::SessionSnapshot snapshot = buildSnapshot(context);
+    if (context)
+    {
+        m_snapshots.insert(key, snapshot);
+    }
+    return snapshot;
+}
+
+//-----------------------------------------------------------------------------
+
+psiotr::SessionSnapshot OtrInternal::buildSnapshot(ConnContext* context)
+{
+    if (!context)
+    {
+        return psiotr::SessionSnapshot(psiotr::OTR_MESSAGESTATE_UNKNOWN,
+                                       messageStateString(psiotr::OTR_MESSAGESTATE_UNKNOWN),
+                                       false, QString(), QString(), false,
+                                       psiotr::Fingerprint(), false);
+    }
+
+    QString firstHalf;
+    QString secondHalf;
+    if (context->sessionid_len > 0)
+    {
+        const char* sessionId = reinterpret_cast<const char*>(context->sessionid);
+        int half = static_cast<int>(context->sessionid_len / 2);
+        firstHalf  = QString::fromLatin1(QByteArray(sessionId, half).toHex());
+        secondHalf = QString::fromLatin1(QByteArray(sessionId + half,
+                                                    static_cast<int>(context->sessionid_len) - half)
+                                             .toHex());
+    }
+
+    psiotr::Fingerprint activeFingerprint;
+    if (context->active_fingerprint)
+    {
+        activeFingerprint = psiotr::Fingerprint(context->active_fingerprint->fingerprint,
+                                                m_names.string(context->accountname),
+                                                m_names.string(context->username),
+                                                QString::fromUtf8(context->active_fingerprint->trust));
+    }
+
+    psiotr::OtrMessageState state = messageState(context);
+    return psiotr::SessionSnapshot(state, messageStateString(state),
+                                   isVerified(context),
+                                   firstHalf, secondHalf,
+                                   context->sessionid_half == OTRL_SESSIONID_FIRST_HALF_BOLD,
+                                   activeFingerprint,
+                                   context->smstate->sm_prog_state == OTRL_SMP_PROG_SUCCEEDED);
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrInternal::invalidateSnapshot(const QString& account, const QString& contact)
+{
+    if (!m_snapshots.isEmpty())
+    {
+        m_snapshots.remove(OtrContextKey(account, contact, OTR_INSTAG_MASTER));
+    }
+}
+
+void OtrInternal::invalidateSnapshot(ConnContext* context)
+{
+    if (!m_snapshots.isEmpty())
+    {
+        invalidateSnapshot(m_names.string(context->accountname),
+                           m_names.string(context->username));
+    }
+}
+
+//-----------------------------------------------------------------------------
+
 QString OtrInternal::getMessageStateString(const QString& account,
                                            const QString& contact)
 {
-    psiotr::OtrMessageState state = getMessageState(account, contact);
+    return messageStateString(getMessageState(account, contact));
+}
 
+//-----------------------------------------------------------------------------
+
+QString OtrInternal::messageStateString(psiotr::OtrMessageState state)
+{
     if (state == psiotr::OTR_MESSAGESTATE_PLAINTEXT)
     {
         return QObject::tr("plaintext");
@@ -647,47 +1258,7 @@ QString OtrInternal::getMessageStateString(const QString& account,
 QString OtrInternal::getSessionId(const QString& account,
                                   const QString& contact)
 {
-    ConnContext* context;
-    context = otrl_context_find(m_userstate, contact.toUtf8().constData(),
-                                account.toUtf8().constData(), OTR_PROTOCOL_STRING,
-#if (OTRL_VERSION_MAJOR >= 4)
-                                OTRL_INSTAG_BEST,
-#endif
-                                false, NULL, NULL, NULL);
-    if (context && (context->sessionid_len > 0))
-    {
-        QString firstHalf;
-        QString secondHalf;
-
-        for (unsigned int i = 0; i < context->sessionid_len / 2; i++)
-        {
-            if (context->sessionid[i] <= 0xf)
-            {
-                firstHalf.append("0");
-            }
-            firstHalf.append(QString::number(context->sessionid[i], 16));
-        }
-        for (size_t i = context->sessionid_len / 2;
-             i < context->sessionid_len; i++)
-        {
-            if (context->sessionid[i] <= 0xf)
-            {
-                secondHalf.append("0");
-            }
-            secondHalf.append(QString::number(context->sessionid[i], 16));
-        }
-
-        if (context->sessionid_half == OTRL_SESSIONID_FIRST_HALF_BOLD)
-        {
-            return QString("<b>" + firstHalf + "</b> " + secondHalf);
-        }
-        else
-        {
-            return QString(firstHalf + " <b>" + secondHalf + "</b>");
-        }
-    }
-
-    return QString();
+    return getSessionSnapshot(account, contact).sessionId();
 }
 
 //-----------------------------------------------------------------------------
@@ -695,23 +1266,7 @@ QString OtrInternal::getSessionId(const QString& account,
 psiotr::Fingerprint OtrInternal::getActiveFingerprint(const QString& account,
                                                       const QString& contact)
 {
-    ConnContext* context;
-    context = otrl_context_find(m_userstate, contact.toUtf8().constData(),
-                                account.toUtf8().constData(), OTR_PROTOCOL_STRING,
-#if (OTRL_VERSION_MAJOR >= 4)
-                                OTRL_INSTAG_BEST,
-#endif
-                                false, NULL, NULL, NULL);
-
-    if (context && context->active_fingerprint)
-    {
-        return psiotr::Fingerprint(context->active_fingerprint->fingerprint,
-                                   QString::fromUtf8(context->accountname),
-                                   QString::fromUtf8(context->username),
-                                   QString::fromUtf8(context->active_fingerprint->trust));
-    }
-
-    return psiotr::Fingerprint();
+    return getSessionSnapshot(account, contact).activeFingerprint();
 }
 
 //-----------------------------------------------------------------------------
@@ -719,16 +1274,7 @@ psiotr::Fingerprint OtrInternal::getActiveFingerprint(const QString& account,
 bool OtrInternal::isVerified(const QString& account,
                              const QString& contact)
 {
-    ConnContext* context;
-    context = otrl_context_find(m_userstate, contact.toUtf8().constData(),
-                                account.toUtf8().constData(),
-                                OTR_PROTOCOL_STRING,
-#if (OTRL_VERSION_MAJOR >= 4)
-                                OTRL_INSTAG_BEST,
-#endif
-                                false, NULL, NULL, NULL);
-
-    return isVerified(context);
+    return getSessionSnapshot(account, contact).isVerified();
 }
 
 //-----------------------------------------------------------------------------
@@ -750,140 +1296,249 @@ bool OtrInternal::isVerified(ConnContext* context)
 bool OtrInternal::smpSucceeded(const QString& account,
                                const QString& contact)
 {
-    ConnContext* context;
-    context = otrl_context_find(m_userstate, contact.toUtf8().constData(),
-                                account.toUtf8().constData(), OTR_PROTOCOL_STRING,
-#if (OTRL_VERSION_MAJOR >= 4)
-                                OTRL_INSTAG_BEST,
-#endif
-                                false, NULL, NULL, NULL);
+    return getSessionSnapshot(account, contact).smpSucceeded();
+}
 
-    if (context)
+//-----------------------------------------------------------------------------
+
+void OtrInternal::generateKey(const QString& account)
+{
+    if (m_keyGenerator->generate(account, OTR_PROTOCOL_STRING))
     {
-        return context->smstate->sm_prog_state == OTRL_SMP_PROG_SUCCEEDED;
+        m_metrics.start(OtrMetrics::OP_KEY_GENERATION, account);
     }
-
-    return false;
 }
 
 //-----------------------------------------------------------------------------
 
-void OtrInternal::generateKey(const QString& account)
+bool OtrInternal::isGeneratingKey(const QString& account)
 {
-    create_privkey(account.toUtf8().constData(), OTR_PROTOCOL_STRING);
+    return m_keyGenerator->isGenerating(account);
 }
 
 //-----------------------------------------------------------------------------
 
-QString OtrInternal::humanFingerprint(const unsigned char* fingerprint)
+bool OtrInternal::hasPrivateKey(const QString& account)
 {
-    char fpHash[OTRL_PRIVKEY_FPRINT_HUMAN_LEN];
-    otrl_privkey_hash_to_human(fpHash, fingerprint);
-    return QString(fpHash);
+    return otrl_privkey_find(m_userstate, m_names.utf8(account),
+                             OTR_PROTOCOL_STRING) != NULL;
 }
 
 //-----------------------------------------------------------------------------
-/***  implemented callback functions for libotr ***/
 
-OtrlPolicy OtrInternal::policy(ConnContext*)
+void OtrInternal::keyGenerated(const QString& account, bool success)
 {
-    if (m_otrPolicy == psiotr::OTR_POLICY_OFF)
+    m_metrics.finish(OtrMetrics::OP_KEY_GENERATION, account);
+
+    QString fingerprint;
+    if (success)
     {
-        return OTRL_POLICY_NEVER; // otr disabled
+        // The new key replaces any previous one of the account
+        fingerprint = privateKeyFingerprint(m_names.utf8(account));
+        if (fingerprint.isEmpty())
+        {
+            m_privateKeys.remove(account);
+        }
+        else
+        {
+            m_privateKeys.insert(account, fingerprint);
+        }
     }
-    else if (m_otrPolicy == psiotr::OTR_POLICY_ENABLED)
+
+    m_callback->keyGenerated(account, fingerprint);
+
+    QStringList contacts = m_pendingSessions.values(account);
+    m_pendingSessions.remove(account);
+
+    if (fingerprint.isEmpty())
     {
-        return OTRL_POLICY_MANUAL; // otr enabled, session started manual
+        return;
     }
-    else if (m_otrPolicy == psiotr::OTR_POLICY_AUTO)
+
+    foreach (const QString& contact, contacts)
     {
-        return OTRL_POLICY_OPPORTUNISTIC; // automatically initiate private messaging
+        sendQuery(account, contact);
     }
-    else if (m_otrPolicy == psiotr::OTR_POLICY_REQUIRE)
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrInternal::waitForKey(const QString& account, const QString& contact)
+{
+    // Does nothing if the key is being generated already
+    generateKey(account);
+
+    if (!m_pendingSessions.contains(account, contact))
     {
-        return OTRL_POLICY_ALWAYS; // require private messaging
+        m_pendingSessions.insert(account, contact);
+
+        m_callback->displayOtrMessage(account, contact,
+                                      QObject::tr("Private keys for account \"%1\" "
+                                                  "are being generated. The private "
+                                                  "conversation will start as soon as "
+                                                  "they are available.")
+                                                  .arg(m_callback->humanAccount(account)));
     }
+}
 
-    return OTRL_POLICY_NEVER;
+//-----------------------------------------------------------------------------
+
+OtrMetrics* OtrInternal::metrics()
+{
+    return &m_metrics;
 }
 
-// ---------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
 
-void OtrInternal::create_privkey(const char* accountname,
-                                 const char* protocol)
+QString OtrInternal::humanFingerprint(const unsigned char* fingerprint)
+{
+    char fpHash[OTRL_PRIVKEY_FPRINT_HUMAN_LEN];
+    otrl_privkey_hash_to_human(fpHash, fingerprint);
+    return QString(fpHash);
+}
+
+//-----------------------------------------------------------------------------
+
+ConnContext* OtrInternal::findContext(const QString& account,
+                                      const QString& contact)
 {
-    if (is_generating)
+    m_fingerprintStore->ensureLoaded(m_names.utf8(account));
+
+    ConnContext* context = m_contexts.value(OtrContextKey(account, contact,
+                                                          OTR_INSTAG_MASTER));
+#if (OTRL_VERSION_MAJOR >= 4)
+    if (context)
     {
-        return;
+        // This is what otrl_context_find() does for OTRL_INSTAG_BEST.
+        context = otrl_context_find_recent_secure_instance(context);
     }
+#endif
+    return context;
+}
 
-    QMessageBox qMB(QMessageBox::Question, QObject::tr("Psi OTR"),
-                    QObject::tr("Private keys for account \"%1\" need to be generated. "
-                                "This takes quite some time (from a few seconds to a "
-                                "couple of minutes), and while you can use Psi+ in the "
-                                "meantime, all the messages will be sent unencrypted "
-                                "until keys are generated. You will be notified when "
-                                "this process finishes.\n"
-                                "\n"
-                                "Do you want to generate keys now?")
-                                .arg(m_callback->humanAccount(
-                                            QString::fromUtf8(accountname))),
-                       QMessageBox::Yes | QMessageBox::No);
+//-----------------------------------------------------------------------------
 
-    if (qMB.exec() != QMessageBox::Yes)
+void OtrInternal::indexContext(ConnContext* context)
+{
+    if (context->app_data)
     {
         return;
     }
 
-    void *newkeyp;
-    if (otrl_privkey_generate_start(m_userstate, accountname, protocol, &newkeyp) == gcry_error(GPG_ERR_EEXIST)) {
-        qWarning("libotr reports it's still generating a previous key while it shouldn't be");
-        return;
-    }
+    OtrContextKey key(m_names.string(context->accountname),
+                      m_names.string(context->username),
+                      contextInstag(context));
 
-    is_generating = true;
+    context->app_data      = new ContextAppData(this, key, context);
+    context->app_data_free = (*OtrInternal::cb_free_app_data);
 
-    QEventLoop loop;
-    QFutureWatcher<gcry_error_t> watcher;
+    m_contexts.insert(key, context);
+    invalidateSnapshot(key.account, key.contact);
+}
 
-    QObject::connect(&watcher, SIGNAL(finished()), &loop, SLOT(quit()));
+//-----------------------------------------------------------------------------
 
-    QFuture<gcry_error_t> future = QtConcurrent::run(otrl_privkey_generate_calculate, newkeyp);
-    watcher.setFuture(future);
+void OtrInternal::unindexContext(const OtrContextKey& key, ConnContext* context)
+{
+    QHash<OtrContextKey, ConnContext*>::iterator it = m_contexts.find(key);
+    if (it != m_contexts.end() && it.value() == context)
+    {
+        m_contexts.erase(it);
+    }
+    invalidateSnapshot(key.account, key.contact);
+}
 
-    loop.exec();
+//-----------------------------------------------------------------------------
 
-    is_generating = false;
+void OtrInternal::notifyStateChange(const QString& account,
+                                    const QString& contact,
+                                    psiotr::OtrStateChange change)
+{
+    m_metrics.countEvent(OtrMetrics::EVENT_STATE_CHANGE, change);
+    invalidateSnapshot(account, contact);
 
-    if (future.result() == gcry_error(GPG_ERR_NO_ERROR)) {
-        otrl_privkey_generate_finish(m_userstate, newkeyp, QFile::encodeName(m_keysFile));
+    if (m_batchDepth == 0)
+    {
+        m_callback->stateChange(account, contact, change);
+        return;
     }
 
-    char fingerprint[OTRL_PRIVKEY_FPRINT_HUMAN_LEN];
-    if (otrl_privkey_fingerprint(m_userstate, fingerprint, accountname,
-                                 protocol))
+    // Drop repetitions of the last pending change of a conversation,
+    // e.g. a series of still_secure during a batch.
+    for (int i = m_pendingStateChanges.size() - 1; i >= 0; i--)
     {
-        QMessageBox infoMb(QMessageBox::Information, QObject::tr("Psi OTR"),
-                           QObject::tr("Keys have been generated. "
-                                       "Fingerprint for account \"%1\":\n"
-                                       "%2\n"
-                                       "\n"
-                                       "Thanks for your patience.")
-                                   .arg(m_callback->humanAccount(
-                                            QString::fromUtf8(accountname)))
-                                   .arg(QString(fingerprint)));
-        infoMb.exec();
+        const PendingStateChange& pending = m_pendingStateChanges.at(i);
+        if (pending.contact == contact && pending.account == account)
+        {
+            if (pending.change == change)
+            {
+                return;
+            }
+            break;
+        }
     }
-    else
+
+    PendingStateChange pending;
+    pending.account = account;
+    pending.contact = contact;
+    pending.change  = change;
+    m_pendingStateChanges.append(pending);
+}
+
+//-----------------------------------------------------------------------------
+/***  implemented callback functions for libotr ***/
+
+OtrlPolicy OtrInternal::policy(ConnContext* context)
+{
+    if (m_otrPolicy == psiotr::OTR_POLICY_OFF)
+    {
+        return OTRL_POLICY_NEVER; // otr disabled
+    }
+    else if (m_otrPolicy == psiotr::OTR_POLICY_ENABLED)
+    {
+        return OTRL_POLICY_MANUAL; // otr enabled, session started manual
+    }
+    else if (m_otrPolicy == psiotr::OTR_POLICY_AUTO)
+    {
+        // Contacts who ignored the whitespace tag before are not offered
+        // OTR again, until the record expires or they send OTR data.
+        // libotr asks several times per message, so the answer comes
+        // from the context and the cache is consulted only once.
+        if (context && context->app_data)
+        {
+            ContextAppData* appData = static_cast<ContextAppData*>(context->app_data);
+            if (!appData->capabilityRead)
+            {
+                appData->noOtr = m_capabilities->capability(appData->key.account,
+                                                            appData->key.contact) ==
+                                 OtrCapabilityCache::CAPABILITY_NO_OTR;
+                appData->capabilityRead = true;
+            }
+            if (appData->noOtr)
+            {
+                return OTRL_POLICY_MANUAL;
+            }
+        }
+        return OTRL_POLICY_OPPORTUNISTIC; // automatically initiate private messaging
+    }
+    else if (m_otrPolicy == psiotr::OTR_POLICY_REQUIRE)
     {
-        QMessageBox failMb(QMessageBox::Critical, QObject::tr("Psi OTR"),
-                           QObject::tr("Failed to generate keys for account \"%1\"."
-                                       "\nThe OTR Plugin will not work.")
-                                       .arg(m_callback->humanAccount(
-                                                QString::fromUtf8(accountname))),
-                           QMessageBox::Ok);
-        failMb.exec();
+        return OTRL_POLICY_ALWAYS; // require private messaging
     }
+
+    return OTRL_POLICY_NEVER;
+}
+
+// ---------------------------------------------------------------------------
+
+void OtrInternal::create_privkey(const char* accountname,
+                                 const char* protocol)
+{
+    // libotr asks for a key while handling a message, so it cannot wait
+    // for one. The key is generated in the background and the AKE has
+    // to be restarted once it is available.
+    Q_UNUSED(protocol);
+    generateKey(m_names.string(accountname));
 }
 
 // ---------------------------------------------------------------------------
@@ -893,8 +1548,8 @@ int OtrInternal::is_logged_in(const char* accountname, const char* protocol,
 {
     Q_UNUSED(protocol);
 
-    if (m_callback->isLoggedIn(QString::fromUtf8(accountname),
-                               QString::fromUtf8(recipient)))
+    if (m_callback->isLoggedIn(m_names.string(accountname),
+                               m_names.string(recipient)))
     {
         return 1; // contact online
     }
@@ -912,9 +1567,23 @@ void OtrInternal::inject_message(const char* accountname,
 {
     Q_UNUSED(protocol);
 
-    m_callback->sendMessage(QString::fromUtf8(accountname),
-                            QString::fromUtf8(recipient),
-                            QString::fromUtf8(message));
+    if (m_metrics.isEnabled())
+    {
+        m_metrics.add(OtrMetrics::COUNTER_INJECTED_MESSAGES);
+        m_metrics.add(OtrMetrics::COUNTER_INJECTED_BYTES, qstrlen(message));
+    }
+
+    QString account = m_names.string(accountname);
+    QString contact = m_names.string(recipient);
+
+    if (!m_sendingContact.isEmpty() && contact == m_sendingContact &&
+        account == m_sendingAccount)
+    {
+        m_fragments.append(QString::fromUtf8(message));
+        return;
+    }
+
+    m_callback->sendMessage(account, contact, QString::fromUtf8(message));
 }
 
 // ---------------------------------------------------------------------------
@@ -926,8 +1595,10 @@ void OtrInternal::handle_msg_event(OtrlMessageEvent msg_event, ConnContext* cont
     Q_UNUSED(err);
     Q_UNUSED(message);
 
-    QString account = QString::fromUtf8(context->accountname);
-    QString contact = QString::fromUtf8(context->username);
+    m_metrics.countEvent(OtrMetrics::EVENT_MESSAGE, msg_event);
+
+    QString account = m_names.string(context->accountname);
+    QString contact = m_names.string(context->username);
 
     QString errorString;
     switch (msg_event)
@@ -959,8 +1630,8 @@ void OtrInternal::handle_msg_event(OtrlMessageEvent msg_event, ConnContext* cont
     }
 
     if (!errorString.isEmpty()) {
-        m_callback->displayOtrMessage(QString::fromUtf8(context->accountname),
-                                      QString::fromUtf8(context->username),
+        m_callback->displayOtrMessage(m_names.string(context->accountname),
+                                      m_names.string(context->username),
                                       errorString);
     }
 }
@@ -968,21 +1639,24 @@ void OtrInternal::handle_msg_event(OtrlMessageEvent msg_event, ConnContext* cont
 void OtrInternal::handle_smp_event(OtrlSMPEvent smp_event, ConnContext* context,
                                    unsigned short progress_percent, char* question)
 {
+    m_metrics.countEvent(OtrMetrics::EVENT_SMP, smp_event);
+    invalidateSnapshot(context);
+
     if (smp_event == OTRL_SMPEVENT_CHEATED || smp_event == OTRL_SMPEVENT_ERROR) {
         abortSMP(context);
-        m_callback->updateSMP(QString::fromUtf8(context->accountname),
-                              QString::fromUtf8(context->username),
+        m_callback->updateSMP(m_names.string(context->accountname),
+                              m_names.string(context->username),
                               -2);
     }
     else if (smp_event == OTRL_SMPEVENT_ASK_FOR_SECRET ||
              smp_event == OTRL_SMPEVENT_ASK_FOR_ANSWER) {
-        m_callback->receivedSMP(QString::fromUtf8(context->accountname),
-                                QString::fromUtf8(context->username),
+        m_callback->receivedSMP(m_names.string(context->accountname),
+                                m_names.string(context->username),
                                 QString::fromUtf8(question));
     }
     else {
-        m_callback->updateSMP(QString::fromUtf8(context->accountname),
-                              QString::fromUtf8(context->username),
+        m_callback->updateSMP(m_names.string(context->accountname),
+                              m_names.string(context->username),
                               progress_percent);
     }
 }
@@ -992,6 +1666,12 @@ void OtrInternal::create_instag(const char* accountname, const char* protocol)
     otrl_instag_generate(m_userstate, QFile::encodeName(m_instagsFile).constData(),
                          accountname, protocol);
 }
+
+int OtrInternal::max_message_size(ConnContext* context)
+{
+    // 0 lets libotr send messages of any size unfragmented
+    return m_callback->maxMessageSize(m_names.string(context->accountname));
+}
 #else
 void OtrInternal::notify(OtrlNotifyLevel level, const char* accountname,
                          const char* protocol, const char* username,
@@ -1000,8 +1680,8 @@ void OtrInternal::notify(OtrlNotifyLevel level, const char* accountname,
     Q_UNUSED(protocol);
     Q_UNUSED(title);
 
-    QString account = QString::fromUtf8(accountname);
-    QString contact = QString::fromUtf8(username);
+    QString account = m_names.string(accountname);
+    QString contact = m_names.string(username);
     QString message = QString(primary) + "\n" + QString(secondary);
 
     if (!m_callback->displayOtrMessage(account, contact, message))
@@ -1042,8 +1722,8 @@ int OtrInternal::display_otr_message(const char* accountname,
     }
     else
     {
-        return m_callback->displayOtrMessage(QString::fromUtf8(accountname),
-                                             QString::fromUtf8(username),
+        return m_callback->displayOtrMessage(m_names.string(accountname),
+                                             m_names.string(username),
                                              message)? 0 : -1;
     }
 }
@@ -1053,6 +1733,16 @@ int OtrInternal::display_otr_message(const char* accountname,
 
 void OtrInternal::update_context_list()
 {
+    // Contexts are indexed by cb_add_app_data when libotr creates them,
+    // this only picks up contexts created on a path without that hook.
+    for (ConnContext* context = m_userstate->context_root; context != NULL;
+         context = context->next)
+    {
+        if (!context->app_data)
+        {
+            indexContext(context);
+        }
+    }
 }
 
 // ---------------------------------------------------------------------------
@@ -1079,8 +1769,8 @@ void OtrInternal::new_fingerprint(OtrlUserState us, const char* accountname,
     Q_UNUSED(us);
     Q_UNUSED(protocol);
 
-    QString account = QString::fromUtf8(accountname);
-    QString contact = QString::fromUtf8(username);
+    QString account = m_names.string(accountname);
+    QString contact = m_names.string(username);
     QString message = QObject::tr("You have received a new "
                                 "fingerprint from %1:\n%2")
                                 .arg(m_callback->humanContact(account, contact))
@@ -1090,32 +1780,54 @@ void OtrInternal::new_fingerprint(OtrlUserState us, const char* accountname,
     {
         m_callback->notifyUser(account, contact, message, psiotr::OTR_NOTIFY_INFO);
     }
+
+    // libotr has already added the fingerprint to the context
+    m_callback->fingerprintsChanged(account, contact);
 }
 
 // ---------------------------------------------------------------------------
 
 void OtrInternal::write_fingerprints()
 {
-    otrl_privkey_write_fingerprints(m_userstate,
-                                    QFile::encodeName(m_fingerprintFile).constData());
+    // libotr adds fingerprints and changes their trust while it handles
+    // a received message, so only that conversation has to be journaled.
+    ConnContext* context = NULL;
+    if (!m_receivingContact.isEmpty())
+    {
+        context = findContext(m_receivingAccount, m_receivingContact);
+    }
+
+    if (context)
+    {
+        m_fingerprintStore->contextChanged(context);
+    }
+    else
+    {
+        m_fingerprintStore->compact();
+    }
 }
 
 // ---------------------------------------------------------------------------
 
 void OtrInternal::gone_secure(ConnContext* context)
 {
-    m_callback->stateChange(QString::fromUtf8(context->accountname),
-                            QString::fromUtf8(context->username),
-                            psiotr::OTR_STATECHANGE_GONESECURE);
+    QString account = m_names.string(context->accountname);
+    QString contact = m_names.string(context->username);
+
+    m_metrics.finish(OtrMetrics::OP_AKE, account, contact);
+    m_capabilities->setCapability(account, contact,
+                                  OtrCapabilityCache::CAPABILITY_OTR);
+
+    notifyStateChange(account, contact, psiotr::OTR_STATECHANGE_GONESECURE);
 }
 
 // ---------------------------------------------------------------------------
 
 void OtrInternal::gone_insecure(ConnContext* context)
 {
-    m_callback->stateChange(QString::fromUtf8(context->accountname),
-                            QString::fromUtf8(context->username),
-                            psiotr::OTR_STATECHANGE_GONEINSECURE);
+    notifyStateChange(m_names.string(context->accountname),
+                      m_names.string(context->username),
+                      psiotr::OTR_STATECHANGE_GONEINSECURE);
 }
 
 // ---------------------------------------------------------------------------
@@ -1123,9 +1835,9 @@ void OtrInternal::gone_insecure(ConnContext* context)
 void OtrInternal::still_secure(ConnContext* context, int is_reply)
 {
     Q_UNUSED(is_reply);
-    m_callback->stateChange(QString::fromUtf8(context->accountname),
-                            QString::fromUtf8(context->username),
-                            psiotr::OTR_STATECHANGE_STILLSECURE);
+    notifyStateChange(m_names.string(context->accountname),
+                      m_names.string(context->username),
+                      psiotr::OTR_STATECHANGE_STILLSECURE);
 }
 
 // ---------------------------------------------------------------------------
@@ -1143,7 +1855,7 @@ const char* OtrInternal::account_name(const char* account,
                                       const char* protocol)
 {
     Q_UNUSED(protocol);
-    return qstrdup(m_callback->humanAccountPublic(QString::fromUtf8(account))
+    return qstrdup(m_callback->humanAccountPublic(m_names.string(account))
                                                  .toUtf8().constData());
 }
 
@@ -1185,6 +1897,10 @@ void OtrInternal::cb_handle_smp_event(void* opdata, OtrlSMPEvent smp_event, Conn
 void OtrInternal::cb_create_instag(void* opdata, const char* accountname, const char* protocol) {
     static_cast<OtrInternal*>(opdata)->create_instag(accountname, protocol);
 }
+
+int OtrInternal::cb_max_message_size(void* opdata, ConnContext* context) {
+    return static_cast<OtrInternal*>(opdata)->max_message_size(context);
+}
 #else
 void OtrInternal::cb_notify(void* opdata, OtrlNotifyLevel level, const char* accountname, const char* protocol, const char* username, const char* title, const char* primary, const char* secondary) {
     static_cast<OtrInternal*>(opdata)->notify(level, accountname, protocol, username, title, primary, secondary);
@@ -1199,6 +1915,16 @@ void OtrInternal::cb_update_context_list(void* opdata) {
     static_cast<OtrInternal*>(opdata)->update_context_list();
 }
 
+void OtrInternal::cb_add_app_data(void* data, ConnContext* context) {
+    static_cast<OtrInternal*>(data)->indexContext(context);
+}
+
+void OtrInternal::cb_free_app_data(void* data) {
+    ContextAppData* appData = static_cast<ContextAppData*>(data);
+    appData->owner->unindexContext(appData->key, appData->context);
+    delete appData;
+}
+
 #if !(OTRL_VERSION_MAJOR >= 4)
 const char* OtrInternal::cb_protocol_name(void* opdata, const char* protocol) {
     return static_cast<OtrInternal*>(opdata)->protocol_name(protocol);
@@ -29,9 +29,13 @@
 #define OTRINTERNAL_H_
 
 #include "otrmessaging.h"
+#include "otrnametable.h"
+#include "otrmetrics.h"
 
 #include <QList>
 #include <QHash>
+#include <QMultiHash>
+#include <QStringList>
 
 extern "C"
 {
@@ -48,6 +52,29 @@ extern "C"
 }
 
 class QString;
+class OtrKeyGenerator;
+class OtrFingerprintStore;
+class OtrCapabilityCache;
+
+// ---------------------------------------------------------------------------
+
+/**
+ * Key of the context index: own account, contact and the instance tag
+ * of the contact's client (0 for the master context).
+ */
+struct OtrContextKey
+{
+    OtrContextKey(const QString& account, const QString& contact,
+                  unsigned int instag);
+
+    bool operator==(const OtrContextKey& other) const;
+
+    QString      account;
+    QString      contact;
+    unsigned int instag;
+};
+
+uint qHash(const OtrContextKey& key);
 
 // ---------------------------------------------------------------------------
 
@@ -70,8 +97,21 @@ public:
                                           const QString& message,
                                           QString& decrypted);
 
+    void decryptMessages(const QString& account,
+                         QList<psiotr::IncomingMessage>& messages);
+
+    bool needsDecryption(const QString& account, const QString& contact,
+                         const QString& message);
+
     QList<psiotr::Fingerprint> getFingerprints();
 
+    QList<psiotr::Fingerprint> getFingerprints(const QString& account);
+
+    QStringList getFingerprintAccounts();
+
+    QList<psiotr::Fingerprint> getFingerprints(const QString& account,
+                                               const QString& contact);
+
     void verifyFingerprint(const psiotr::Fingerprint& fingerprint, bool verified);
 
     void deleteFingerprint(const psiotr::Fingerprint& fingerprint);
@@ -87,6 +127,8 @@ public:
 
     void expireSession(const QString& account, const QString& contact);
 
+    QStringList streamLost(const QString& account);
+
 
     void startSMP(const QString& account, const QString& contact,
                   const QString& question, const QString& secret);
@@ -98,9 +140,18 @@ public:
     void abortSMP(ConnContext* context);
 
 
+    bool hasContext(const QString& account, const QString& contact);
+
+    bool isNegotiating(const QString& account, const QString& contact);
+
+    bool isOtrCapable(const QString& account, const QString& contact);
+
     psiotr::OtrMessageState getMessageState(const QString& account,
                                             const QString& contact);
 
+    psiotr::SessionSnapshot getSessionSnapshot(const QString& account,
+                                               const QString& contact);
+
     QString getMessageStateString(const QString& account,
                                   const QString& contact);
 
@@ -116,8 +167,20 @@ public:
 
     void generateKey(const QString& account);
 
+    bool isGeneratingKey(const QString& account);
+
+    bool hasPrivateKey(const QString& account);
+
+    /**
+     * Called by OtrKeyGenerator when a key has been stored or
+     * generating it failed.
+     */
+    void keyGenerated(const QString& account, bool success);
+
     static QString humanFingerprint(const unsigned char* fingerprint);
 
+    OtrMetrics* metrics();
+
     /*** otr callback functions ***/
     OtrlPolicy policy(ConnContext* context);
     void create_privkey(const char* accountname, const char* protocol);
@@ -139,6 +202,7 @@ public:
     void handle_smp_event(OtrlSMPEvent smp_event, ConnContext* context,
                           unsigned short progress_percent, char* question);
     void create_instag(const char* accountname, const char* protocol);
+    int max_message_size(ConnContext* context);
 #else
     void log_message(const char* message);
     void notify(OtrlNotifyLevel level, const char* accountname,
@@ -180,6 +244,7 @@ public:
                                     ConnContext* context, unsigned short progress_percent,
                                     char* question);
     static void cb_create_instag(void* opdata, const char* accountname, const char* protocol);
+    static int cb_max_message_size(void* opdata, ConnContext* context);
 #else
     static void cb_log_message(void* opdata, const char* message);
     static void cb_notify(void* opdata, OtrlNotifyLevel level,
@@ -197,11 +262,102 @@ public:
     static void cb_account_name_free(void* opdata, const char* account_name);
 private:
 
+    /**
+     * Return the best instance of the context for a conversation, like
+     * otrl_context_find() with OTRL_INSTAG_BEST, but without walking
+     * the context list.
+     */
+    ConnContext* findContext(const QString& account, const QString& contact);
+
+    void indexContext(ConnContext* context);
+
+    /**
+     * Compute the snapshot of a context, or an empty one for NULL.
+     */
+    psiotr::SessionSnapshot buildSnapshot(ConnContext* context);
+
+    /**
+     * Drop the snapshot of a conversation after its context changed.
+     */
+    void invalidateSnapshot(const QString& account, const QString& contact);
+    void invalidateSnapshot(ConnContext* context);
+    void unindexContext(const OtrContextKey& key, ConnContext* context);
+
+    /**
+     * Report a change of state to the callback, or queue it while
+     * decryptMessages() is running.
+     */
+    void notifyStateChange(const QString& account, const QString& contact,
+                           psiotr::OtrStateChange change);
+
+    static psiotr::OtrMessageState messageState(ConnContext* context);
+
+    static QString messageStateString(psiotr::OtrMessageState state);
+
+    /**
+     * Send an OTR query message from account to contact.
+     */
+    void sendQuery(const QString& account, const QString& contact);
+
+    /**
+     * Generate a key for account if needed and start the session with
+     * contact once it is available.
+     */
+    void waitForKey(const QString& account, const QString& contact);
+
+    /**
+     * Record whether contact speaks OTR, judging by a received message
+     * and the answer to our whitespace offer. wasRejected tells whether
+     * the offer was rejected before message arrived.
+     */
+    void learnCapability(const QString& account, const QString& contact,
+                         const QString& message, bool wasRejected);
+
+    /**
+     * Fill m_privateKeys from the keys in m_userstate.
+     */
+    void loadPrivateKeys();
+
+    /**
+     * Human-readable fingerprint of the private key of account,
+     * empty if there is none.
+     */
+    QString privateKeyFingerprint(const char* accountname);
+
+    static void cb_add_app_data(void* data, ConnContext* context);
+    static void cb_free_app_data(void* data);
+
     /**
      * The userstate contains keys and known fingerprints.
      */
     OtrlUserState m_userstate;
 
+    /**
+     * Index of all contexts in m_userstate.
+     */
+    QHash<OtrContextKey, ConnContext*> m_contexts;
+
+    /**
+     * Snapshots of the conversations read since their last change,
+     * by the key of the master context.
+     */
+    QHash<OtrContextKey, psiotr::SessionSnapshot> m_snapshots;
+
+    /**
+     * UTF-8 and QString forms of account and contact names.
+     */
+    OtrNameTable m_names;
+
+    /**
+     * Timings and counters, collected if enabled.
+     */
+    OtrMetrics m_metrics;
+
+    /**
+     * Reusable buffer for UTF-8 message bodies passed to libotr.
+     */
+    QByteArray m_messageBuffer;
+
     /**
      * Pointers to callback functions.
      */
@@ -233,9 +389,62 @@ private:
     psiotr::OtrPolicy& m_otrPolicy;
 
     /**
-     * Variable used during generating of private key.
+     * Fingerprints of the own private keys by account. Computed when a
+     * key is read or generated, as libotr hashes the public key on
+     * every request.
+     */
+    QHash<QString, QString> m_privateKeys;
+
+    /**
+     * Generates private keys in the background.
+     */
+    OtrKeyGenerator* m_keyGenerator;
+
+    /**
+     * Journal of the fingerprints file.
+     */
+    OtrFingerprintStore* m_fingerprintStore;
+
+    /**
+     * Contacts known to answer OTR or not, so that whitespace tags are
+     * only offered to contacts which may understand them.
+     */
+    OtrCapabilityCache* m_capabilities;
+
+    /**
+     * Account and contact of the message passed to libotr,
+     * the conversation write_fingerprints() refers to.
+     */
+    QString m_receivingAccount;
+    QString m_receivingContact;
+
+    /**
+     * Account and contact of the message being encrypted. Fragments
+     * libotr injects for it are collected and sent as one batch.
+     */
+    QString     m_sendingAccount;
+    QString     m_sendingContact;
+    QStringList m_fragments;
+
+    /**
+     * Contacts to send an OTR query to, once the key
+     * of the account is generated. Account -> Contact
+     */
+    QMultiHash<QString, QString> m_pendingSessions;
+
+    struct PendingStateChange
+    {
+        QString                account;
+        QString                contact;
+        psiotr::OtrStateChange change;
+    };
+
+    /**
+     * Nesting depth of decryptMessages() and the state changes
+     * collected meanwhile.
      */
-    bool is_generating;
+    int                       m_batchDepth;
+    QList<PendingStateChange> m_pendingStateChanges;
 };
 
 // ---------------------------------------------------------------------------
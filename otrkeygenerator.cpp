@@ -0,0 +1,167 @@
+/*
+ * otrkeygenerator.cpp - Background generation of private keys
+ *
+ * Off-the-Record Messaging plugin for Psi+
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "otrkeygenerator.h"
+
+#include <QtConcurrentRun>
+#include <QByteArray>
+#include <QFile>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+//-----------------------------------------------------------------------------
+
+OtrKeyGenerator::OtrKeyGenerator(OtrInternal* owner, OtrlUserState userstate,
+                                 const QString& keysFile, QObject* parent)
+    : QObject(parent),
+      m_owner(owner),
+      m_userstate(userstate),
+      m_keysFile(keysFile),
+      m_jobs()
+{
+}
+
+//-----------------------------------------------------------------------------
+
+OtrKeyGenerator::~OtrKeyGenerator()
+{
+    // A running calculation cannot be interrupted.
+    QHash<QFutureWatcher<gcry_error_t>*, Job>::iterator it;
+    for (it = m_jobs.begin(); it != m_jobs.end(); ++it)
+    {
+        it.key()->disconnect(this);
+        it.key()->waitForFinished();
+        otrl_privkey_generate_cancelled(m_userstate, it.value().newkey);
+        delete it.key();
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+bool OtrKeyGenerator::generate(const QString& account, const char* protocol)
+{
+    if (isGenerating(account))
+    {
+        return false;
+    }
+
+    void* newkey = NULL;
+    gcry_error_t err = otrl_privkey_generate_start(m_userstate,
+                                                   account.toUtf8().constData(),
+                                                   protocol, &newkey);
+    if (err)
+    {
+        qWarning("libotr refused to start generating a key: %s",
+                 gcry_strerror(err));
+        return false;
+    }
+
+    QFutureWatcher<gcry_error_t>* watcher = new QFutureWatcher<gcry_error_t>(this);
+    connect(watcher, SIGNAL(finished()), SLOT(onCalculated()));
+
+    Job job;
+    job.account = account;
+    job.newkey  = newkey;
+    m_jobs.insert(watcher, job);
+
+    watcher->setFuture(QtConcurrent::run(otrl_privkey_generate_calculate, newkey));
+
+    return true;
+}
+
+//-----------------------------------------------------------------------------
+
+bool OtrKeyGenerator::isGenerating(const QString& account) const
+{
+    foreach (const Job& job, m_jobs)
+    {
+        if (job.account == account)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrKeyGenerator::onCalculated()
+{
+    QFutureWatcher<gcry_error_t>* watcher =
+        static_cast<QFutureWatcher<gcry_error_t>*>(sender());
+
+    if (!m_jobs.contains(watcher))
+    {
+        return;
+    }
+
+    Job job = m_jobs.take(watcher);
+    gcry_error_t err = watcher->result();
+    watcher->deleteLater();
+
+    if (err == gcry_error(GPG_ERR_NO_ERROR))
+    {
+        err = finish(job.newkey);
+    }
+    else
+    {
+        otrl_privkey_generate_cancelled(m_userstate, job.newkey);
+    }
+
+    m_owner->keyGenerated(job.account, err == gcry_error(GPG_ERR_NO_ERROR));
+}
+
+//-----------------------------------------------------------------------------
+
+/**
+ * Add newkey to the userstate and write all keys. The keys go to a
+ * temporary file which replaces the keys file once it is synced, so a
+ * crash cannot leave the existing keys truncated.
+ */
+gcry_error_t OtrKeyGenerator::finish(void* newkey)
+{
+    QByteArray keysFile = QFile::encodeName(m_keysFile);
+    char* tmpName;
+    FILE* tmp = otrl_file_open_tmp(keysFile.constData(), &tmpName);
+    if (!tmp)
+    {
+        gcry_error_t err = gcry_error_from_errno(errno);
+        otrl_privkey_generate_cancelled(m_userstate, newkey);
+        return err;
+    }
+
+    // Writes the known keys and the new one, then reads them back
+    gcry_error_t err = otrl_privkey_generate_finish_FILEp(m_userstate, newkey, tmp);
+    if (err)
+    {
+        fclose(tmp);
+        remove(tmpName);
+    }
+    else
+    {
+        err = otrl_file_replace(tmp, tmpName, keysFile.constData());
+    }
+    free(tmpName);
+    return err;
+}
+
+//-----------------------------------------------------------------------------
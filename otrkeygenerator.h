@@ -0,0 +1,81 @@
+/*
+ * otrkeygenerator.h - Background generation of private keys
+ *
+ * Off-the-Record Messaging plugin for Psi+
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef OTRKEYGENERATOR_H_
+#define OTRKEYGENERATOR_H_
+
+#include "otrinternal.h"
+
+#include <QObject>
+#include <QHash>
+#include <QString>
+#include <QFutureWatcher>
+
+// ---------------------------------------------------------------------------
+
+/**
+ * Generates private keys in the global thread pool, so that neither the
+ * GUI nor the stanza path waits for them. Keys for several accounts are
+ * calculated in parallel. OtrInternal::keyGenerated() is called when a
+ * key is stored.
+ */
+class OtrKeyGenerator : public QObject
+{
+    Q_OBJECT
+
+public:
+    OtrKeyGenerator(OtrInternal* owner, OtrlUserState userstate,
+                    const QString& keysFile, QObject* parent = 0);
+
+    /**
+     * Waits for running calculations and discards their keys.
+     */
+    ~OtrKeyGenerator();
+
+    /**
+     * Start generating a key for account.
+     * Returns false if a key for account is already being generated
+     * or libotr refused to start.
+     */
+    bool generate(const QString& account, const char* protocol);
+
+    bool isGenerating(const QString& account) const;
+
+private slots:
+    void onCalculated();
+
+private:
+    struct Job
+    {
+        QString account;
+        void*   newkey;
+    };
+
+    gcry_error_t finish(void* newkey);
+
+    OtrInternal*   m_owner;
+    OtrlUserState  m_userstate;
+    QString        m_keysFile;
+    QHash<QFutureWatcher<gcry_error_t>*, Job> m_jobs;
+};
+
+// ---------------------------------------------------------------------------
+
+#endif
@@ -22,8 +22,16 @@
 /* system headers */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#ifdef WIN32
+#include <io.h>
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
 
 /* libgcrypt headers */
 #include <gcrypt.h>
@@ -33,95 +41,247 @@
 
 #include "otrlextensions.h"
 
-static gcry_error_t sexp_write(FILE* privf, gcry_sexp_t sexp)
+/* Output buffer of the key file. While data is NULL, only the
+ * required size is counted. */
+struct privkey_buffer {
+    char* data;
+    size_t len;
+    size_t size;
+};
+
+static void buffer_append(struct privkey_buffer* buf, const char* str)
 {
-    size_t buflen;
-    char* buf;
+    size_t len = strlen(str);
 
-    buflen = gcry_sexp_sprint(sexp, GCRYSEXP_FMT_ADVANCED, NULL, 0);
-    buf = malloc(buflen);
-    if (buf == NULL && buflen > 0) {
-        return gcry_error(GPG_ERR_ENOMEM);
+    if (buf->data) {
+        memcpy(buf->data + buf->len, str, len);
     }
-    gcry_sexp_sprint(sexp, GCRYSEXP_FMT_ADVANCED, buf, buflen);
-
-    fprintf(privf, "%s", buf);
-    free(buf);
+    buf->len += len;
+}
 
-    return gcry_error(GPG_ERR_NO_ERROR);
+static void sexp_append(struct privkey_buffer* buf, gcry_sexp_t sexp)
+{
+    if (buf->data) {
+        buf->len += gcry_sexp_sprint(sexp, GCRYSEXP_FMT_ADVANCED,
+                                     buf->data + buf->len,
+                                     buf->size - buf->len);
+    } else {
+        /* includes the terminating 0 */
+        buf->len += gcry_sexp_sprint(sexp, GCRYSEXP_FMT_ADVANCED, NULL, 0);
+    }
 }
 
-static gcry_error_t account_write(FILE* privf, const char* accountname,
-    const char* protocol, gcry_sexp_t privkey)
+static gcry_error_t account_append(struct privkey_buffer* buf,
+    const char* accountname, const char* protocol, gcry_sexp_t privkey)
 {
     gcry_error_t err;
     gcry_sexp_t names, protos;
 
-    fprintf(privf, " (account\n");
+    buffer_append(buf, " (account\n");
 
     err = gcry_sexp_build(&names, NULL, "(name %s)", accountname);
     if (!err) {
-        err = sexp_write(privf, names);
+        sexp_append(buf, names);
         gcry_sexp_release(names);
     }
     if (!err) err = gcry_sexp_build(&protos, NULL, "(protocol %s)", protocol);
     if (!err) {
-        err = sexp_write(privf, protos);
+        sexp_append(buf, protos);
         gcry_sexp_release(protos);
     }
-    if (!err) err = sexp_write(privf, privkey);
+    if (!err) sexp_append(buf, privkey);
+
+    buffer_append(buf, " )\n");
+
+    return err;
+}
+
+static gcry_error_t privkeys_append(OtrlUserState us,
+    struct privkey_buffer* buf)
+{
+    gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
+    OtrlPrivKey* p;
+
+    buffer_append(buf, "(privkeys\n");
+
+    for (p=us->privkey_root; p && !err; p=p->next) {
+        err = account_append(buf, p->accountname, p->protocol, p->privkey);
+    }
 
-    fprintf(privf, " )\n");
+    buffer_append(buf, ")\n");
 
     return err;
 }
 
+/* Serialize all keys of an OtrlUserState into one buffer, which is
+ * allocated once. The caller frees buf->data. */
+static gcry_error_t privkeys_serialize(OtrlUserState us,
+    struct privkey_buffer* buf)
+{
+    gcry_error_t err;
+
+    buf->data = NULL;
+    buf->len = 0;
+    err = privkeys_append(us, buf);
+    if (err) return err;
+
+    buf->size = buf->len + 1;
+    buf->data = malloc(buf->size);
+    if (buf->data == NULL) {
+        return gcry_error(GPG_ERR_ENOMEM);
+    }
+    buf->len = 0;
+
+    return privkeys_append(us, buf);
+}
+
 /* Store all keys of an OtrlUserState.
- * The FILE* must be open for reading and writing. */
+ * The keys in memory are not changed, the file is not read back. */
 gcry_error_t otrl_privkey_write_FILEp(OtrlUserState us, FILE* privf)
 {
-    OtrlPrivKey* p;
+    gcry_error_t err;
+    struct privkey_buffer buf;
+
+    err = privkeys_serialize(us, &buf);
+    if (!err && fwrite(buf.data, 1, buf.len, privf) != buf.len) {
+        err = gcry_error_from_errno(errno);
+    }
+    free(buf.data);
+
+    return err;
+}
 
-    /* Output the other keys we know */
-    fprintf(privf, "(privkeys\n");
+/* Create "<filename>.tmp" for reading and writing, accessible only to
+ * the user. *tmpname receives its name, which the caller frees.
+ * The permissions are given to open() instead of changing the umask,
+ * which is shared by all threads of the process. */
+FILE* otrl_file_open_tmp(const char* filename, char** tmpname)
+{
+    FILE* tmpf = NULL;
+    int fd;
 
-    for (p=us->privkey_root; p; p=p->next) {
-        account_write(privf, p->accountname, p->protocol, p->privkey);
+    *tmpname = malloc(strlen(filename) + 5);
+    if (*tmpname == NULL) {
+        errno = ENOMEM;
+        return NULL;
     }
+    strcpy(*tmpname, filename);
+    strcat(*tmpname, ".tmp");
 
-    fprintf(privf, ")\n");
+#ifdef WIN32
+    fd = _open(*tmpname, _O_CREAT | _O_EXCL | _O_RDWR | _O_BINARY,
+               _S_IREAD | _S_IWRITE);
+    if (fd < 0 && errno == EEXIST) {
+        /* Left over by an interrupted write */
+        remove(*tmpname);
+        fd = _open(*tmpname, _O_CREAT | _O_EXCL | _O_RDWR | _O_BINARY,
+                   _S_IREAD | _S_IWRITE);
+    }
+#else
+    fd = open(*tmpname, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0 && errno == EEXIST) {
+        /* Left over by an interrupted write */
+        remove(*tmpname);
+        fd = open(*tmpname, O_CREAT | O_EXCL | O_RDWR, 0600);
+    }
+#endif
+    if (fd >= 0) {
+#ifdef WIN32
+        tmpf = _fdopen(fd, "w+b");
+#else
+        tmpf = fdopen(fd, "w+b");
+#endif
+        if (!tmpf) {
+            int saved = errno;
+#ifdef WIN32
+            _close(fd);
+#else
+            close(fd);
+#endif
+            remove(*tmpname);
+            errno = saved;
+        }
+    }
+    if (!tmpf) {
+        free(*tmpname);
+        *tmpname = NULL;
+    }
+    return tmpf;
+}
+
+/* Sync and close tmpf, then move tmpname over filename, so filename
+ * never holds a partial file. tmpf is closed and, on failure, tmpname
+ * removed in any case. */
+gcry_error_t otrl_file_replace(FILE* tmpf, const char* tmpname,
+    const char* filename)
+{
+    gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
+
+    if (fflush(tmpf) != 0) {
+        err = gcry_error_from_errno(errno);
+    }
+#ifdef WIN32
+    if (!err && _commit(_fileno(tmpf)) != 0) {
+#else
+    if (!err && fsync(fileno(tmpf)) != 0) {
+#endif
+        err = gcry_error_from_errno(errno);
+    }
+    if (fclose(tmpf) != 0 && !err) {
+        err = gcry_error_from_errno(errno);
+    }
 
-    fseek(privf, 0, SEEK_SET);
+    if (!err) {
+#ifdef WIN32
+        if (!MoveFileExA(tmpname, filename,
+                         MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH)) {
+            err = gcry_error(GPG_ERR_EIO);
+        }
+#else
+        if (rename(tmpname, filename) != 0) {
+            err = gcry_error_from_errno(errno);
+        }
+#endif
+    }
+    if (err) {
+        remove(tmpname);
+    }
 
-    return otrl_privkey_read_FILEp(us, privf);
+    return err;
 }
 
-/* Store all keys of an OtrlUserState. */
+/* Store all keys of an OtrlUserState.
+ * The keys are written to a temporary file, which replaces filename
+ * once it is synced, so filename never holds a partial key list. */
 gcry_error_t otrl_privkey_write(OtrlUserState us, const char* filename)
 {
     gcry_error_t err;
+    struct privkey_buffer buf;
+    char* tmpname;
     FILE* privf;
-#ifndef WIN32
-    mode_t oldmask;
-#endif
 
-#ifndef WIN32
-    oldmask = umask(077);
-#endif
-    privf = fopen(filename, "w+b");
+    err = privkeys_serialize(us, &buf);
+    if (err) {
+        free(buf.data);
+        return err;
+    }
+
+    privf = otrl_file_open_tmp(filename, &tmpname);
     if (!privf) {
-#ifndef WIN32
-        umask(oldmask);
-#endif
         err = gcry_error_from_errno(errno);
+        free(buf.data);
         return err;
     }
 
-    err = otrl_privkey_write_FILEp(us, privf);
+    if (fwrite(buf.data, 1, buf.len, privf) != buf.len) {
+        err = gcry_error_from_errno(errno);
+        fclose(privf);
+        remove(tmpname);
+    } else {
+        err = otrl_file_replace(privf, tmpname, filename);
+    }
 
-    fclose(privf);
-#ifndef WIN32
-    umask(oldmask);
-#endif
+    free(tmpname);
+    free(buf.data);
     return err;
 }
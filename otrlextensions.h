@@ -25,11 +25,22 @@
 #include <stdio.h>
 #include <libotr/userstate.h>
 
-/* Store all keys of an OtrlUserState. */
+/* Store all keys of an OtrlUserState.
+ * filename is replaced atomically. */
 gcry_error_t otrl_privkey_write(OtrlUserState us, const char* filename);
 
 /* Store all keys of an OtrlUserState.
- * The FILE* must be open for reading and writing. */
+ * The FILE* must be open for writing. */
 gcry_error_t otrl_privkey_write_FILEp(OtrlUserState us, FILE* privf);
 
+/* Create "<filename>.tmp" for reading and writing, accessible only to
+ * the user, replacing a stale one. *tmpname receives its name, which
+ * the caller frees. Safe to call from any thread. */
+FILE* otrl_file_open_tmp(const char* filename, char** tmpname);
+
+/* Sync and close tmpf, then atomically replace filename with tmpname.
+ * tmpname is removed on failure. */
+gcry_error_t otrl_file_replace(FILE* tmpf, const char* tmpname,
+                               const char* filename);
+
 #endif
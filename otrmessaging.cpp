@@ -60,6 +60,163 @@ Fingerprint::Fingerprint(unsigned char* fingerprint,
 
 //-----------------------------------------------------------------------------
 
+IncomingMessage::IncomingMessage()
+    : type(OTR_MESSAGETYPE_NONE)
+{
+
+}
+
+IncomingMessage::IncomingMessage(const QString& contact,
+                                 const QString& message)
+    : contact(contact),
+      message(message),
+      type(OTR_MESSAGETYPE_NONE)
+{
+
+}
+
+//-----------------------------------------------------------------------------
+
+class SessionSnapshotData : public QSharedData
+{
+public:
+    SessionSnapshotData()
+        : messageState(OTR_MESSAGESTATE_UNKNOWN),
+          verified(false),
+          firstHalfBold(false),
+          smpSucceeded(false)
+    {
+    }
+
+    OtrMessageState messageState;
+    QString         messageStateString;
+    bool            verified;
+    QString         sessionIdFirstHalf;
+    QString         sessionIdSecondHalf;
+    bool            firstHalfBold;
+    Fingerprint     activeFingerprint;
+    bool            smpSucceeded;
+};
+
+//-----------------------------------------------------------------------------
+
+SessionSnapshot::SessionSnapshot()
+    : d(new SessionSnapshotData)
+{
+}
+
+SessionSnapshot::SessionSnapshot(OtrMessageState messageState,
+                                 const QString& messageStateString,
+                                 bool verified,
+                                 const QString& sessionIdFirstHalf,
+                                 const QString& sessionIdSecondHalf,
+                                 bool firstHalfBold,
+                                 const Fingerprint& activeFingerprint,
+                                 bool smpSucceeded)
+    : d(new SessionSnapshotData)
+{
+    d->messageState        = messageState;
+    d->messageStateString  = messageStateString;
+    d->verified            = verified;
+    d->sessionIdFirstHalf  = sessionIdFirstHalf;
+    d->sessionIdSecondHalf = sessionIdSecondHalf;
+    d->firstHalfBold       = firstHalfBold;
+    d->activeFingerprint   = activeFingerprint;
+    d->smpSucceeded        = smpSucceeded;
+}
+
+SessionSnapshot::SessionSnapshot(const SessionSnapshot& other)
+    : d(other.d)
+{
+}
+
+SessionSnapshot::~SessionSnapshot()
+{
+}
+
+SessionSnapshot& SessionSnapshot::operator=(const SessionSnapshot& other)
+{
+    d = other.d;
+    return *this;
+}
+
+bool SessionSnapshot::operator==(const SessionSnapshot& other) const
+{
+    if (d == other.d)
+    {
+        return true;
+    }
+    return d->messageState == other.d->messageState &&
+           d->messageStateString == other.d->messageStateString &&
+           d->verified == other.d->verified &&
+           d->sessionIdFirstHalf == other.d->sessionIdFirstHalf &&
+           d->sessionIdSecondHalf == other.d->sessionIdSecondHalf &&
+           d->firstHalfBold == other.d->firstHalfBold &&
+           d->activeFingerprint.fingerprintHuman == other.d->activeFingerprint.fingerprintHuman &&
+           d->activeFingerprint.trust == other.d->activeFingerprint.trust &&
+           d->smpSucceeded == other.d->smpSucceeded;
+}
+
+bool SessionSnapshot::operator!=(const SessionSnapshot& other) const
+{
+    return !(*this == other);
+}
+
+OtrMessageState SessionSnapshot::messageState() const
+{
+    return d->messageState;
+}
+
+QString SessionSnapshot::messageStateString() const
+{
+    return d->messageStateString;
+}
+
+bool SessionSnapshot::isVerified() const
+{
+    return d->verified;
+}
+
+QString SessionSnapshot::sessionIdFirstHalf() const
+{
+    return d->sessionIdFirstHalf;
+}
+
+QString SessionSnapshot::sessionIdSecondHalf() const
+{
+    return d->sessionIdSecondHalf;
+}
+
+bool SessionSnapshot::isFirstHalfBold() const
+{
+    return d->firstHalfBold;
+}
+
+QString SessionSnapshot::sessionId() const
+{
+    if (d->sessionIdFirstHalf.isEmpty())
+    {
+        return QString();
+    }
+    if (d->firstHalfBold)
+    {
+        return "<b>" + d->sessionIdFirstHalf + "</b> " + d->sessionIdSecondHalf;
+    }
+    return d->sessionIdFirstHalf + " <b>" + d->sessionIdSecondHalf + "</b>";
+}
+
+Fingerprint SessionSnapshot::activeFingerprint() const
+{
+    return d->activeFingerprint;
+}
+
+bool SessionSnapshot::smpSucceeded() const
+{
+    return d->smpSucceeded;
+}
+
+//-----------------------------------------------------------------------------
+
 OtrMessaging::OtrMessaging(OtrCallback* callback, OtrPolicy policy)
     : m_otrPolicy(policy),
       m_impl(new OtrInternal(callback, m_otrPolicy)),
@@ -95,6 +252,22 @@ OtrMessageType OtrMessaging::decryptMessage(const QString& account,
 
 //-----------------------------------------------------------------------------
 
+void OtrMessaging::decryptMessages(const QString& account,
+                                   QList<IncomingMessage>& messages)
+{
+    m_impl->decryptMessages(account, messages);
+}
+
+//-----------------------------------------------------------------------------
+
+bool OtrMessaging::needsDecryption(const QString& account, const QString& contact,
+                                   const QString& message)
+{
+    return m_impl->needsDecryption(account, contact, message);
+}
+
+//-----------------------------------------------------------------------------
+
 QList<Fingerprint> OtrMessaging::getFingerprints()
 {
     return m_impl->getFingerprints();
@@ -102,6 +275,28 @@ QList<Fingerprint> OtrMessaging::getFingerprints()
 
 //-----------------------------------------------------------------------------
 
+QList<Fingerprint> OtrMessaging::getFingerprints(const QString& account)
+{
+    return m_impl->getFingerprints(account);
+}
+
+//-----------------------------------------------------------------------------
+
+QStringList OtrMessaging::getFingerprintAccounts()
+{
+    return m_impl->getFingerprintAccounts();
+}
+
+//-----------------------------------------------------------------------------
+
+QList<Fingerprint> OtrMessaging::getFingerprints(const QString& account,
+                                                 const QString& contact)
+{
+    return m_impl->getFingerprints(account, contact);
+}
+
+//-----------------------------------------------------------------------------
+
 void OtrMessaging::verifyFingerprint(const psiotr::Fingerprint& fingerprint,
                                      bool verified)
 {
@@ -152,6 +347,13 @@ void OtrMessaging::expireSession(const QString& account, const QString& contact)
 
 //-----------------------------------------------------------------------------
 
+QStringList OtrMessaging::streamLost(const QString& account)
+{
+    return m_impl->streamLost(account);
+}
+
+//-----------------------------------------------------------------------------
+
 void OtrMessaging::startSMP(const QString& account, const QString& contact,
                             const QString& question, const QString& secret)
 {
@@ -175,6 +377,27 @@ void OtrMessaging::abortSMP(const QString& account, const QString& contact)
 
 //-----------------------------------------------------------------------------
 
+bool OtrMessaging::hasContext(const QString& account, const QString& contact)
+{
+    return m_impl->hasContext(account, contact);
+}
+
+//-----------------------------------------------------------------------------
+
+bool OtrMessaging::isNegotiating(const QString& account, const QString& contact)
+{
+    return m_impl->isNegotiating(account, contact);
+}
+
+//-----------------------------------------------------------------------------
+
+bool OtrMessaging::isOtrCapable(const QString& account, const QString& contact)
+{
+    return m_impl->isOtrCapable(account, contact);
+}
+
+//-----------------------------------------------------------------------------
+
 OtrMessageState OtrMessaging::getMessageState(const QString& account,
                                               const QString& contact)
 {
@@ -191,6 +414,14 @@ QString OtrMessaging::getMessageStateString(const QString& account,
 
 //-----------------------------------------------------------------------------
 
+SessionSnapshot OtrMessaging::getSessionSnapshot(const QString& account,
+                                                 const QString& contact)
+{
+    return m_impl->getSessionSnapshot(account, contact);
+}
+
+//-----------------------------------------------------------------------------
+
 QString OtrMessaging::getSessionId(const QString& account,
                                    const QString& contact)
 {
@@ -242,6 +473,27 @@ void OtrMessaging::generateKey(const QString& account)
 
 //-----------------------------------------------------------------------------
 
+bool OtrMessaging::isGeneratingKey(const QString& account)
+{
+    return m_impl->isGeneratingKey(account);
+}
+
+//-----------------------------------------------------------------------------
+
+bool OtrMessaging::hasPrivateKey(const QString& account)
+{
+    return m_impl->hasPrivateKey(account);
+}
+
+//-----------------------------------------------------------------------------
+
+OtrMetrics* OtrMessaging::metrics()
+{
+    return m_impl->metrics();
+}
+
+//-----------------------------------------------------------------------------
+
 bool OtrMessaging::displayOtrMessage(const QString& account,
                                      const QString& contact,
                                      const QString& message)
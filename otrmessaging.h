@@ -27,10 +27,13 @@
 #include <QList>
 #include <QHash>
 #include <QString>
+#include <QStringList>
+#include <QSharedDataPointer>
 
 #include <utils/jid.h>
 
 class OtrInternal;
+class OtrMetrics;
 
 // ---------------------------------------------------------------------------
 
@@ -109,6 +112,18 @@ public:
     virtual void sendMessage(const QString& account, const QString& contact,
                              const QString& message) = 0;
 
+    /**
+     * Sends the fragments of one encrypted message, in order.
+     */
+    virtual void sendMessages(const QString& account, const QString& contact,
+                              const QStringList& messages) = 0;
+
+    /**
+     * Length above which encrypted messages from account are split
+     * into fragments, 0 for no limit.
+     */
+    virtual int maxMessageSize(const QString& account) = 0;
+
     virtual bool isLoggedIn(const QString& account, const QString& contact) = 0;
 
     virtual void notifyUser(const QString& account, const QString& contact,
@@ -131,8 +146,26 @@ public:
     virtual QString humanContact(const QString& accountId,
                                  const QString& contact) = 0;
     virtual void authenticateContact(const QString &account, const QString &contact) =0;
+
+    /**
+     * Key generation for account has finished.
+     * fingerprint is empty if it failed.
+     */
+    virtual void keyGenerated(const QString& account, const QString& fingerprint) = 0;
+
+    /**
+     * The private key of account was deleted.
+     */
+    virtual void keyDeleted(const QString& account) = 0;
+
+    /**
+     * A fingerprint of contact was added, verified or deleted.
+     */
+    virtual void fingerprintsChanged(const QString& account, const QString& contact) = 0;
 protected:
     virtual void otrStateChanged(const Jid &AStreamJid, const Jid &AContactJid) const =0;
+    virtual void privateKeysChanged(const QString &account) const =0;
+    virtual void contactFingerprintsChanged(const QString &account, const QString &contact) const =0;
 };
 
 // ---------------------------------------------------------------------------
@@ -176,6 +209,115 @@ struct Fingerprint
 
 // ---------------------------------------------------------------------------
 
+/**
+ * An incoming message passed to OtrMessaging::decryptMessages().
+ */
+struct IncomingMessage
+{
+    /**
+     * Sender of the message
+     */
+    QString contact;
+
+    /**
+     * The message itself
+     */
+    QString message;
+
+    /**
+     * The decrypted message if type is OTR_MESSAGETYPE_OTR
+     */
+    QString decrypted;
+
+    /**
+     * Type of the message, set by decryptMessages()
+     */
+    OtrMessageType type;
+
+    IncomingMessage();
+    IncomingMessage(const QString& contact, const QString& message);
+};
+
+// ---------------------------------------------------------------------------
+
+class SessionSnapshotData;
+
+/**
+ * Everything the user interface shows about a conversation, computed
+ * from the context once after each change. Snapshots are immutable and
+ * implicitly shared, so they are cheap to copy and keep.
+ */
+class SessionSnapshot
+{
+public:
+    /**
+     * Snapshot of a conversation without a context.
+     */
+    SessionSnapshot();
+
+    SessionSnapshot(OtrMessageState messageState,
+                    const QString& messageStateString, bool verified,
+                    const QString& sessionIdFirstHalf,
+                    const QString& sessionIdSecondHalf, bool firstHalfBold,
+                    const Fingerprint& activeFingerprint, bool smpSucceeded);
+
+    SessionSnapshot(const SessionSnapshot& other);
+
+    ~SessionSnapshot();
+
+    SessionSnapshot& operator=(const SessionSnapshot& other);
+
+    /**
+     * Snapshots are equal if everything shown from them is.
+     */
+    bool operator==(const SessionSnapshot& other) const;
+    bool operator!=(const SessionSnapshot& other) const;
+
+    /**
+     * plaintext, encrypted, finished or unknown
+     */
+    OtrMessageState messageState() const;
+
+    /**
+     * The messageState as human-readable string.
+     */
+    QString messageStateString() const;
+
+    /**
+     * The active fingerprint is trusted.
+     */
+    bool isVerified() const;
+
+    /**
+     * Halves of the secure session id in hex, empty without a session.
+     */
+    QString sessionIdFirstHalf() const;
+    QString sessionIdSecondHalf() const;
+
+    /**
+     * The half to be shown in bold is the first one.
+     */
+    bool isFirstHalfBold() const;
+
+    /**
+     * The session id with the bold half marked up in HTML,
+     * empty without a session.
+     */
+    QString sessionId() const;
+
+    Fingerprint activeFingerprint() const;
+
+    /**
+     * The last Socialist Millionaires' Protocol run succeeded.
+     */
+    bool smpSucceeded() const;
+
+private:
+    QSharedDataPointer<SessionSnapshotData> d;
+};
+
+// ---------------------------------------------------------------------------
+
 /**
  * This class is the interface to the Off the Record Messaging library.
  * See the libotr documentation for more information.
@@ -222,11 +364,44 @@ public:
     OtrMessageType decryptMessage(const QString& account, const QString& contact,
                                   const QString& message, QString& decrypted);
 
+    /**
+     * Decrypt a series of incoming messages to the same account,
+     * e.g. offline messages replayed after connecting.
+     * Type and decrypted text of each message are set in place, in order.
+     * Changes of state are reported once, after the whole batch.
+     */
+    void decryptMessages(const QString& account,
+                         QList<IncomingMessage>& messages);
+
+    /**
+     * Cheap check whether an incoming message has to be passed to
+     * decryptMessage(). Returns false for plain text which libotr
+     * would pass through unchanged.
+     */
+    bool needsDecryption(const QString& account, const QString& contact,
+                         const QString& message);
+
     /**
      * Returns a list of known fingerprints.
      */
     QList<Fingerprint> getFingerprints();
 
+    /**
+     * Returns the known fingerprints of account, loading only them.
+     */
+    QList<Fingerprint> getFingerprints(const QString& account);
+
+    /**
+     * Returns the accounts with known fingerprints without loading them.
+     */
+    QStringList getFingerprintAccounts();
+
+    /**
+     * Returns the known fingerprints of a single contact.
+     */
+    QList<Fingerprint> getFingerprints(const QString& account,
+                                       const QString& contact);
+
     /**
      * Set fingerprint verified/not verified.
      */
@@ -263,6 +438,13 @@ public:
      */
     void expireSession(const QString& account, const QString& contact);
 
+    /**
+     * End all sessions of account locally after its stream is gone,
+     * without sending anything and without reporting each state change.
+     * Returns the contacts whose session was ended.
+     */
+    QStringList streamLost(const QString& account);
+
     /**
      * Start the SMP with an optional question.
      */
@@ -280,6 +462,25 @@ public:
      */
     void abortSMP(const QString& account, const QString& contact);
 
+    /**
+     * Return true if libotr knows a context for contact.
+     * Does not load the stored fingerprints of the account.
+     */
+    bool hasContext(const QString& account, const QString& contact);
+
+    /**
+     * Return true while a session with contact is being started, i.e.
+     * it waits for the private key of account or an AKE runs which
+     * started a few seconds ago at most.
+     */
+    bool isNegotiating(const QString& account, const QString& contact);
+
+    /**
+     * Return true if contact answered OTR before or has a verified
+     * fingerprint, so that starting a session is likely to succeed.
+     */
+    bool isOtrCapable(const QString& account, const QString& contact);
+
     /**
      * Return the messageState of a context,
      * i.e. plaintext, encrypted, finished.
@@ -287,6 +488,12 @@ public:
     OtrMessageState getMessageState(const QString& account,
                                     const QString& contact);
 
+    /**
+     * Return the state of a conversation, as computed after its last change.
+     */
+    SessionSnapshot getSessionSnapshot(const QString& account,
+                                       const QString& contact);
+
     /**
      * Return the messageState as human-readable string.
      */
@@ -325,11 +532,26 @@ public:
     OtrPolicy getPolicy();
 
     /**
-     * Generate own keys.
-     * This function blocks until keys are available.
+     * Generate own keys in the background.
+     * OtrCallback::keyGenerated() is called when keys are available.
      */
     void generateKey(const QString& account);
 
+    /**
+     * Return true while keys for account are being generated.
+     */
+    bool isGeneratingKey(const QString& account);
+
+    /**
+     * Return true if there is a private key for account.
+     */
+    bool hasPrivateKey(const QString& account);
+
+    /**
+     * Timings and counters of the hot paths, disabled by default.
+     */
+    OtrMetrics* metrics();
+
     /**
      * Display OTR message.
      */
@@ -0,0 +1,436 @@
+/*
+ * otrmetrics.cpp - Timings and counters of the plugin's hot paths
+ *
+ * Off-the-Record Messaging plugin for Psi+
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "otrmetrics.h"
+#include "otrmessaging.h"
+
+#include <QStringList>
+
+extern "C"
+{
+#include <libotr/proto.h>
+#include <libotr/message.h>
+}
+
+//-----------------------------------------------------------------------------
+
+OtrMetrics::Timer::Timer(OtrMetrics* metrics, Operation op)
+    : m_metrics(metrics->isEnabled()? metrics : NULL),
+      m_op(op)
+{
+    if (m_metrics)
+    {
+        m_timer.start();
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+OtrMetrics::Timer::~Timer()
+{
+    if (m_metrics)
+    {
+        m_metrics->addLatency(m_op, m_timer.nsecsElapsed());
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+OtrMetrics::Histogram::Histogram()
+    : count(0),
+      total(0),
+      max(0)
+{
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+        buckets[i] = 0;
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrMetrics::Histogram::add(qint64 nsecs)
+{
+    count++;
+    total += nsecs;
+    if (nsecs > max)
+    {
+        max = nsecs;
+    }
+
+    int bucket = 0;
+    for (qint64 usecs = nsecs / 1000; usecs > 0 && bucket < HISTOGRAM_BUCKETS - 1;
+         usecs >>= 1)
+    {
+        bucket++;
+    }
+    buckets[bucket]++;
+}
+
+//-----------------------------------------------------------------------------
+
+OtrMetrics::OtrMetrics()
+    : m_enabled(false)
+{
+    reset();
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrMetrics::setEnabled(bool enabled)
+{
+    if (enabled && !m_enabled)
+    {
+        m_collecting.start();
+    }
+    m_enabled = enabled;
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrMetrics::reset()
+{
+    for (int i = 0; i < OP_COUNT; i++)
+    {
+        m_latencies[i] = Histogram();
+        m_running[i].clear();
+    }
+    for (int i = 0; i < COUNTER_COUNT; i++)
+    {
+        m_counters[i] = 0;
+    }
+    for (int i = 0; i < EVENT_KIND_COUNT; i++)
+    {
+        m_events[i].clear();
+    }
+    m_collecting.start();
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrMetrics::addLatency(Operation op, qint64 nsecs)
+{
+    if (m_enabled)
+    {
+        m_latencies[op].add(nsecs);
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrMetrics::add(Counter counter, qint64 value)
+{
+    if (m_enabled)
+    {
+        m_counters[counter] += value;
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrMetrics::countEvent(EventKind kind, int value)
+{
+    if (m_enabled)
+    {
+        m_events[kind][value]++;
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrMetrics::start(Operation op, const QString& account,
+                       const QString& contact)
+{
+    if (m_enabled)
+    {
+        m_running[op][account + QLatin1Char('\n') + contact].start();
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrMetrics::finish(Operation op, const QString& account,
+                        const QString& contact)
+{
+    if (m_enabled && !m_running[op].isEmpty())
+    {
+        QHash<QString, QElapsedTimer>::iterator it =
+            m_running[op].find(account + QLatin1Char('\n') + contact);
+        if (it != m_running[op].end())
+        {
+            m_latencies[op].add(it.value().nsecsElapsed());
+            m_running[op].erase(it);
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+QString OtrMetrics::report() const
+{
+    QStringList lines;
+    lines << QString("Collecting %1 for %2 s")
+                 .arg(m_enabled? "enabled" : "disabled")
+                 .arg(m_collecting.elapsed() / 1000);
+
+    lines << QString() << "Latencies:";
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        const Histogram& h = m_latencies[op];
+        if (h.count == 0)
+        {
+            continue;
+        }
+
+        // Upper bounds of the buckets holding the percentiles
+        quint64 percentiles[] = { 50, 90, 99 };
+        QStringList bounds;
+        quint64 seen = 0;
+        int p = 0;
+        for (int i = 0; i < HISTOGRAM_BUCKETS && p < 3; i++)
+        {
+            seen += h.buckets[i];
+            while (p < 3 && seen * 100 >= h.count * percentiles[p])
+            {
+                bounds << (i < HISTOGRAM_BUCKETS - 1?
+                               QString("p%1 < %2 us").arg(percentiles[p]).arg(Q_INT64_C(1) << i) :
+                               QString("p%1 above").arg(percentiles[p]));
+                p++;
+            }
+        }
+
+        lines << QString("  %1: %2 x, mean %3 us, max %4 us, %5")
+                     .arg(operationName(static_cast<Operation>(op)))
+                     .arg(h.count)
+                     .arg(h.total / qint64(h.count) / 1000)
+                     .arg(h.max / 1000)
+                     .arg(bounds.join(", "));
+    }
+
+    lines << QString() << "Counters:";
+    for (int counter = 0; counter < COUNTER_COUNT; counter++)
+    {
+        lines << QString("  %1: %2")
+                     .arg(counterName(static_cast<Counter>(counter)))
+                     .arg(m_counters[counter]);
+    }
+
+    const char* kindNames[EVENT_KIND_COUNT] = { "Message events:", "SMP events:",
+                                                "State changes:" };
+    for (int kind = 0; kind < EVENT_KIND_COUNT; kind++)
+    {
+        if (m_events[kind].isEmpty())
+        {
+            continue;
+        }
+        lines << QString() << kindNames[kind];
+        QMap<int, quint64>::const_iterator it;
+        for (it = m_events[kind].constBegin(); it != m_events[kind].constEnd(); ++it)
+        {
+            lines << QString("  %1: %2")
+                         .arg(eventName(static_cast<EventKind>(kind), it.key()))
+                         .arg(it.value());
+        }
+    }
+
+    return lines.join("\n");
+}
+
+//-----------------------------------------------------------------------------
+
+QByteArray OtrMetrics::toJson() const
+{
+    QByteArray json;
+    json += "{\n  \"enabled\": ";
+    json += m_enabled? "true" : "false";
+    json += ",\n  \"seconds\": " + QByteArray::number(m_collecting.elapsed() / 1000);
+
+    // Latencies in microseconds; the bucket keys are the upper bounds
+    json += ",\n  \"latencies\": {";
+    bool first = true;
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        const Histogram& h = m_latencies[op];
+        if (h.count == 0)
+        {
+            continue;
+        }
+        json += first? "\n    " : ",\n    ";
+        first = false;
+        json += jsonString(operationName(static_cast<Operation>(op)));
+        json += ": {\"count\": " + QByteArray::number(h.count);
+        json += ", \"total_us\": " + QByteArray::number(h.total / 1000);
+        json += ", \"max_us\": " + QByteArray::number(h.max / 1000);
+        json += ", \"buckets\": {";
+        bool firstBucket = true;
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+        {
+            if (h.buckets[i] == 0)
+            {
+                continue;
+            }
+            json += firstBucket? "\"" : ", \"";
+            firstBucket = false;
+            json += i < HISTOGRAM_BUCKETS - 1? QByteArray::number(Q_INT64_C(1) << i) :
+                                               QByteArray("inf");
+            json += "\": " + QByteArray::number(h.buckets[i]);
+        }
+        json += "}}";
+    }
+    json += first? "}" : "\n  }";
+
+    json += ",\n  \"counters\": {";
+    for (int counter = 0; counter < COUNTER_COUNT; counter++)
+    {
+        json += counter == 0? "\n    " : ",\n    ";
+        json += jsonString(counterName(static_cast<Counter>(counter)));
+        json += ": " + QByteArray::number(m_counters[counter]);
+    }
+    json += "\n  }";
+
+    const char* kindNames[EVENT_KIND_COUNT] = { "message_events", "smp_events",
+                                                "state_changes" };
+    for (int kind = 0; kind < EVENT_KIND_COUNT; kind++)
+    {
+        json += ",\n  \"" + QByteArray(kindNames[kind]) + "\": {";
+        QMap<int, quint64>::const_iterator it;
+        for (it = m_events[kind].constBegin(); it != m_events[kind].constEnd(); ++it)
+        {
+            json += it == m_events[kind].constBegin()? "" : ", ";
+            json += jsonString(eventName(static_cast<EventKind>(kind), it.key()));
+            json += ": " + QByteArray::number(it.value());
+        }
+        json += "}";
+    }
+
+    json += "\n}\n";
+    return json;
+}
+
+//-----------------------------------------------------------------------------
+
+QByteArray OtrMetrics::jsonString(const QString& text)
+{
+    QByteArray json("\"");
+    foreach (char c, text.toUtf8())
+    {
+        if (c == '"' || c == '\\')
+        {
+            json += '\\';
+        }
+        json += c;
+    }
+    json += '"';
+    return json;
+}
+
+//-----------------------------------------------------------------------------
+
+QString OtrMetrics::operationName(Operation op)
+{
+    switch (op)
+    {
+        case OP_SEND:               return "otrl_message_sending";
+        case OP_RECEIVE:            return "otrl_message_receiving";
+        case OP_AKE:                return "AKE";
+        case OP_KEY_GENERATION:     return "key generation";
+        case OP_JOURNAL_WRITE:      return "fingerprint journal write";
+        case OP_FINGERPRINTS_WRITE: return "fingerprints file write";
+        case OP_KEYS_WRITE:         return "keys file write";
+        default:                    return QString::number(op);
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+QString OtrMetrics::counterName(Counter counter)
+{
+    switch (counter)
+    {
+        case COUNTER_INJECTED_MESSAGES:  return "injected messages";
+        case COUNTER_INJECTED_BYTES:     return "injected bytes";
+        case COUNTER_JOURNAL_BYTES:      return "fingerprint journal bytes";
+        case COUNTER_FINGERPRINTS_BYTES: return "fingerprints file bytes";
+        case COUNTER_KEYS_BYTES:         return "keys file bytes";
+        default:                         return QString::number(counter);
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+QString OtrMetrics::eventName(EventKind kind, int value)
+{
+    const char* name = NULL;
+
+    if (kind == EVENT_STATE_CHANGE)
+    {
+        switch (value)
+        {
+            case psiotr::OTR_STATECHANGE_GOINGSECURE:  name = "going secure"; break;
+            case psiotr::OTR_STATECHANGE_GONESECURE:   name = "gone secure"; break;
+            case psiotr::OTR_STATECHANGE_GONEINSECURE: name = "gone insecure"; break;
+            case psiotr::OTR_STATECHANGE_STILLSECURE:  name = "still secure"; break;
+            case psiotr::OTR_STATECHANGE_CLOSE:        name = "close"; break;
+            case psiotr::OTR_STATECHANGE_REMOTECLOSE:  name = "remote close"; break;
+            case psiotr::OTR_STATECHANGE_TRUST:        name = "trust"; break;
+        }
+    }
+#if (OTRL_VERSION_MAJOR >= 4)
+    else if (kind == EVENT_MESSAGE)
+    {
+        switch (value)
+        {
+            case OTRL_MSGEVENT_ENCRYPTION_REQUIRED:         name = "ENCRYPTION_REQUIRED"; break;
+            case OTRL_MSGEVENT_ENCRYPTION_ERROR:            name = "ENCRYPTION_ERROR"; break;
+            case OTRL_MSGEVENT_CONNECTION_ENDED:            name = "CONNECTION_ENDED"; break;
+            case OTRL_MSGEVENT_SETUP_ERROR:                 name = "SETUP_ERROR"; break;
+            case OTRL_MSGEVENT_MSG_REFLECTED:               name = "MSG_REFLECTED"; break;
+            case OTRL_MSGEVENT_MSG_RESENT:                  name = "MSG_RESENT"; break;
+            case OTRL_MSGEVENT_RCVDMSG_NOT_IN_PRIVATE:      name = "RCVDMSG_NOT_IN_PRIVATE"; break;
+            case OTRL_MSGEVENT_RCVDMSG_UNREADABLE:          name = "RCVDMSG_UNREADABLE"; break;
+            case OTRL_MSGEVENT_RCVDMSG_MALFORMED:           name = "RCVDMSG_MALFORMED"; break;
+            case OTRL_MSGEVENT_LOG_HEARTBEAT_RCVD:          name = "LOG_HEARTBEAT_RCVD"; break;
+            case OTRL_MSGEVENT_LOG_HEARTBEAT_SENT:          name = "LOG_HEARTBEAT_SENT"; break;
+            case OTRL_MSGEVENT_RCVDMSG_GENERAL_ERR:         name = "RCVDMSG_GENERAL_ERR"; break;
+            case OTRL_MSGEVENT_RCVDMSG_UNENCRYPTED:         name = "RCVDMSG_UNENCRYPTED"; break;
+            case OTRL_MSGEVENT_RCVDMSG_UNRECOGNIZED:        name = "RCVDMSG_UNRECOGNIZED"; break;
+            case OTRL_MSGEVENT_RCVDMSG_FOR_OTHER_INSTANCE:  name = "RCVDMSG_FOR_OTHER_INSTANCE"; break;
+        }
+    }
+    else if (kind == EVENT_SMP)
+    {
+        switch (value)
+        {
+            case OTRL_SMPEVENT_ERROR:           name = "ERROR"; break;
+            case OTRL_SMPEVENT_ABORT:           name = "ABORT"; break;
+            case OTRL_SMPEVENT_CHEATED:         name = "CHEATED"; break;
+            case OTRL_SMPEVENT_ASK_FOR_ANSWER:  name = "ASK_FOR_ANSWER"; break;
+            case OTRL_SMPEVENT_ASK_FOR_SECRET:  name = "ASK_FOR_SECRET"; break;
+            case OTRL_SMPEVENT_IN_PROGRESS:     name = "IN_PROGRESS"; break;
+            case OTRL_SMPEVENT_SUCCESS:         name = "SUCCESS"; break;
+            case OTRL_SMPEVENT_FAILURE:         name = "FAILURE"; break;
+        }
+    }
+#endif
+
+    return name? QString(name) : QString::number(value);
+}
+
+//-----------------------------------------------------------------------------
@@ -0,0 +1,169 @@
+/*
+ * otrmetrics.h - Timings and counters of the plugin's hot paths
+ *
+ * Off-the-Record Messaging plugin for Psi+
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef OTRMETRICS_H_
+#define OTRMETRICS_H_
+
+#include <QHash>
+#include <QMap>
+#include <QString>
+#include <QByteArray>
+#include <QElapsedTimer>
+
+// ---------------------------------------------------------------------------
+
+/**
+ * Latency histograms and counters of the operations which decide how
+ * fast a chat feels: libotr calls, AKEs, key generation and file writes.
+ *
+ * Every recording method returns after a single test while collecting
+ * is disabled, the default. All methods must be called from the main
+ * thread; work done in the background is timed from start() to
+ * finish() on the main thread.
+ */
+class OtrMetrics
+{
+public:
+    enum Operation
+    {
+        OP_SEND,                // otrl_message_sending()
+        OP_RECEIVE,             // otrl_message_receiving()
+        OP_AKE,                 // query sent until gone_secure
+        OP_KEY_GENERATION,      // start until the key is stored
+        OP_JOURNAL_WRITE,       // append to the fingerprint journal
+        OP_FINGERPRINTS_WRITE,  // compaction of the fingerprints file
+        OP_KEYS_WRITE,          // rewrite of the keys file
+        OP_COUNT
+    };
+
+    enum Counter
+    {
+        COUNTER_INJECTED_MESSAGES,
+        COUNTER_INJECTED_BYTES,
+        COUNTER_JOURNAL_BYTES,
+        COUNTER_FINGERPRINTS_BYTES,
+        COUNTER_KEYS_BYTES,
+        COUNTER_COUNT
+    };
+
+    enum EventKind
+    {
+        EVENT_MESSAGE,          // OtrlMessageEvent
+        EVENT_SMP,              // OtrlSMPEvent
+        EVENT_STATE_CHANGE,     // psiotr::OtrStateChange
+        EVENT_KIND_COUNT
+    };
+
+    /**
+     * Times an operation from construction to destruction.
+     */
+    class Timer
+    {
+    public:
+        Timer(OtrMetrics* metrics, Operation op);
+        ~Timer();
+
+    private:
+        OtrMetrics*   m_metrics;
+        Operation     m_op;
+        QElapsedTimer m_timer;
+    };
+
+    OtrMetrics();
+
+    bool isEnabled() const;
+
+    /**
+     * Start or stop collecting. Collected values are kept.
+     */
+    void setEnabled(bool enabled);
+
+    void reset();
+
+    void addLatency(Operation op, qint64 nsecs);
+
+    void add(Counter counter, qint64 value = 1);
+
+    void countEvent(EventKind kind, int value);
+
+    /**
+     * Start timing op for an account or a conversation, e.g. an AKE.
+     */
+    void start(Operation op, const QString& account,
+               const QString& contact = QString());
+
+    /**
+     * Record the time since start() was called with the same arguments.
+     */
+    void finish(Operation op, const QString& account,
+                const QString& contact = QString());
+
+    /**
+     * Human-readable dump of everything collected.
+     */
+    QString report() const;
+
+    /**
+     * Everything collected as a JSON object, for comparing runs.
+     */
+    QByteArray toJson() const;
+
+private:
+    /**
+     * Bucket i counts latencies below 2^i microseconds, the last one
+     * everything longer.
+     */
+    static const int HISTOGRAM_BUCKETS = 24;
+
+    struct Histogram
+    {
+        Histogram();
+
+        void add(qint64 nsecs);
+
+        quint64 count;
+        qint64  total;
+        qint64  max;
+        quint64 buckets[HISTOGRAM_BUCKETS];
+    };
+
+    static QString operationName(Operation op);
+    static QString counterName(Counter counter);
+    static QString eventName(EventKind kind, int value);
+    static QByteArray jsonString(const QString& text);
+
+    bool                          m_enabled;
+    QElapsedTimer                 m_collecting;
+    Histogram                     m_latencies[OP_COUNT];
+    qint64                        m_counters[COUNTER_COUNT];
+    QMap<int, quint64>            m_events[EVENT_KIND_COUNT];
+    QHash<QString, QElapsedTimer> m_running[OP_COUNT];
+};
+
+// ---------------------------------------------------------------------------
+
+inline bool OtrMetrics::isEnabled() const
+{
+    return m_enabled;
+}
+
+// ---------------------------------------------------------------------------
+
+#endif
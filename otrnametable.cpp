@@ -0,0 +1,131 @@
+/*
+ * otrnametable.cpp - Interned account and contact names
+ *
+ * Off-the-Record Messaging plugin for Psi+
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "otrnametable.h"
+
+//-----------------------------------------------------------------------------
+
+OtrNameTable::OtrNameTable()
+    : m_utf8(),
+      m_strings()
+{
+}
+
+//-----------------------------------------------------------------------------
+
+const char* OtrNameTable::utf8(const QString& name)
+{
+    QHash<QString, QByteArray>::const_iterator it = m_utf8.constFind(name);
+    if (it == m_utf8.constEnd())
+    {
+        QByteArray bytes = name.toUtf8();
+        m_strings.insert(bytes, name);
+        it = m_utf8.insert(name, bytes);
+    }
+    return it.value().constData();
+}
+
+//-----------------------------------------------------------------------------
+
+QString OtrNameTable::string(const char* name)
+{
+    // fromRawData() does not copy, it is only used as lookup key
+    QByteArray key = QByteArray::fromRawData(name, qstrlen(name));
+
+    QHash<QByteArray, QString>::const_iterator it = m_strings.constFind(key);
+    if (it == m_strings.constEnd())
+    {
+        QByteArray bytes(name);
+        QString string = QString::fromUtf8(name);
+        m_utf8.insert(string, bytes);
+        it = m_strings.insert(bytes, string);
+    }
+    return it.value();
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrNameTable::remove(const QString& name)
+{
+    QHash<QString, QByteArray>::iterator it = m_utf8.find(name);
+    if (it != m_utf8.end())
+    {
+        m_strings.remove(it.value());
+        m_utf8.erase(it);
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrNameTable::clear()
+{
+    m_utf8.clear();
+    m_strings.clear();
+}
+
+//-----------------------------------------------------------------------------
+
+const char* OtrNameTable::encode(const QString& text, QByteArray& buffer)
+{
+    const int      length = text.length();
+    const ushort*  in     = text.utf16();
+
+    // at most three bytes per UTF-16 code unit
+    buffer.resize(length * 3);
+    char* out = buffer.data();
+
+    for (int i = 0; i < length; i++)
+    {
+        uint c = in[i];
+
+        if (c < 0x80)
+        {
+            *out++ = static_cast<char>(c);
+        }
+        else if (c < 0x800)
+        {
+            *out++ = static_cast<char>(0xc0 | (c >> 6));
+            *out++ = static_cast<char>(0x80 | (c & 0x3f));
+        }
+        else if ((c & 0xfc00) == 0xd800 && i + 1 < length &&
+                 (in[i + 1] & 0xfc00) == 0xdc00)
+        {
+            c = 0x10000 + (((c & 0x3ff) << 10) | (in[++i] & 0x3ff));
+            *out++ = static_cast<char>(0xf0 | (c >> 18));
+            *out++ = static_cast<char>(0x80 | ((c >> 12) & 0x3f));
+            *out++ = static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+            *out++ = static_cast<char>(0x80 | (c & 0x3f));
+        }
+        else
+        {
+            if ((c & 0xf800) == 0xd800)
+            {
+                // unpaired surrogate
+                c = 0xfffd;
+            }
+            *out++ = static_cast<char>(0xe0 | (c >> 12));
+            *out++ = static_cast<char>(0x80 | ((c >> 6) & 0x3f));
+            *out++ = static_cast<char>(0x80 | (c & 0x3f));
+        }
+    }
+
+    buffer.resize(out - buffer.constData());
+    return buffer.constData();
+}
@@ -0,0 +1,72 @@
+/*
+ * otrnametable.h - Interned account and contact names
+ *
+ * Off-the-Record Messaging plugin for Psi+
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef OTRNAMETABLE_H_
+#define OTRNAMETABLE_H_
+
+#include <QHash>
+#include <QString>
+#include <QByteArray>
+
+// ---------------------------------------------------------------------------
+
+/**
+ * Keeps the QString and the UTF-8 form of every account and contact name
+ * passed to or received from libotr, so that converting an identifier
+ * on the message path does not allocate after its first use.
+ */
+class OtrNameTable
+{
+public:
+    OtrNameTable();
+
+    /**
+     * Return the UTF-8 form of name.
+     * The pointer stays valid until name is removed or clear() is called,
+     * so it must not be kept beyond the libotr call it is passed to.
+     */
+    const char* utf8(const QString& name);
+
+    /**
+     * Return the QString form of a UTF-8 name coming from libotr.
+     */
+    QString string(const char* name);
+
+    /**
+     * Forget name, e.g. a contact resource which went away.
+     */
+    void remove(const QString& name);
+
+    void clear();
+
+    /**
+     * Encode text as UTF-8 into buffer, reusing its allocation.
+     * Returns buffer.constData().
+     */
+    static const char* encode(const QString& text, QByteArray& buffer);
+
+private:
+    QHash<QString, QByteArray> m_utf8;
+    QHash<QByteArray, QString> m_strings;
+};
+
+// ---------------------------------------------------------------------------
+
+#endif
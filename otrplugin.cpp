@@ -8,9 +8,13 @@
 #include <utils/logger.h>
 
 #include "psiotrclosure.h"
+#include "otrmetrics.h"
 
 #include <QtCore/QPair>
+#include <QtCore/QSet>
+#include <QtCore/QTimer>
 #include <QtGui/QMenu>
+#include <QtGui/QMessageBox>
 #include <QtGui/QToolButton>
 
 namespace psiotr
@@ -22,7 +26,10 @@ namespace psiotr
 
 OtrPlugin::OtrPlugin() :
     m_otrConnection(NULL),
-    m_onlineUsers(),
+    m_prewarmer(NULL),
+    m_sessions(),
+    m_stateWidgets(),
+    m_stateWidgetKeys(),
     FOptionsManager(NULL),
     FAccountManager(NULL),
     FPresenceManager(NULL),
@@ -34,6 +41,11 @@ OtrPlugin::OtrPlugin() :
 
 OtrPlugin::~OtrPlugin()
 {
+    foreach (PsiOtrClosure *closure, m_sessions.closures())
+    {
+        delete closure;
+    }
+    delete m_prewarmer;
     delete m_otrConnection;
 }
 
@@ -99,6 +111,7 @@ bool OtrPlugin::initConnections(IPluginManager *APluginManager, int &AInitOrder)
 
     plugin = APluginManager->pluginInterface("IAccountManager").value(0,NULL);
     FAccountManager = qobject_cast<IAccountManager *>(plugin->instance());
+    m_routes.setAccountManager(FAccountManager);
 
     plugin = APluginManager->pluginInterface("IMessageProcessor").value(0,NULL);
     if (plugin)
@@ -143,6 +156,10 @@ bool OtrPlugin::initSettings()
 {
     Options::setDefaultValue(OPTION_POLICY, OTR_POLICY_ENABLED);
     Options::setDefaultValue(OPTION_END_WHEN_OFFLINE, DEFAULT_END_WHEN_OFFLINE);
+    Options::setDefaultValue(OPTION_GENERATE_KEYS, DEFAULT_GENERATE_KEYS);
+    Options::setDefaultValue(OPTION_COLLECT_METRICS, DEFAULT_COLLECT_METRICS);
+    Options::setDefaultValue(OPTION_MAX_MESSAGE_SIZE, DEFAULT_MAX_MESSAGE_SIZE);
+    Options::setDefaultValue(OPTION_PREWARM_SESSIONS, DEFAULT_PREWARM_SESSIONS);
     if (FOptionsManager)
     {
         IOptionsDialogNode otrNode = { ONO_OTR, OPN_OTR, MNI_OTR_ENCRYPTED, tr("OTR Messaging") };
@@ -174,23 +191,68 @@ bool OtrPlugin::archiveMessageEdit(int AOrder, const Jid &AStreamJid, Message &A
 
 void OtrPlugin::onStreamOpened( IXmppStream *AXmppStream )
 {
-    Q_UNUSED(AXmppStream);
+    IAccount *account = FAccountManager->findAccountByStream(AXmppStream->streamJid());
+    if (!account)
+    {
+        return;
+    }
+
+    QString accountId = account->accountId().toString();
+    m_routes.insert(AXmppStream->streamJid(), accountId);
+
+    if (m_otrConnection && policy() != OTR_POLICY_OFF &&
+        Options::node(OPTION_GENERATE_KEYS).value().toBool() &&
+        !m_otrConnection->hasPrivateKey(accountId) &&
+        !m_otrConnection->isGeneratingKey(accountId))
+    {
+        m_otrConnection->generateKey(accountId);
+    }
 }
 
 void OtrPlugin::onStreamClosed( IXmppStream *AXmppStream )
 {
-    //Q_UNUSED(AXmppStream);
-    QString account = FAccountManager->findAccountByStream(AXmppStream->streamJid())->accountId();
+    Jid streamJid = AXmppStream->streamJid();
+    QString account = m_routes.account(streamJid);
 
-    if (m_onlineUsers.contains(account))
+    // All sessions of the account end at once and locally; a disconnect
+    // message per contact could not be delivered anyway.
+    QStringList contacts;
+    if (m_otrConnection)
+    {
+        contacts = m_otrConnection->streamLost(account);
+    }
+    if (!contacts.isEmpty())
     {
-        foreach(QString contact, m_onlineUsers.value(account).keys())
+        LOG_STRM_INFO(streamJid,QString("OTR stream lost, sessions=%1").arg(contacts.size()));
+
+        QSet<QString> lost;
+        foreach (const QString &contact, contacts)
         {
-            m_otrConnection->endSession(account, contact);
-            m_onlineUsers[account][contact]->setIsLoggedIn(false);
-            //m_onlineUsers[account][contact]->updateMessageState();
+            lost.insert(Jid(contact).pFull());
+        }
+
+        // Only conversations with an open window are told
+        for (QHash<OtrSessionKey, OtrStateWidget*>::const_iterator it = m_stateWidgets.constBegin();
+             it != m_stateWidgets.constEnd(); ++it)
+        {
+            if (it.key().first == account && lost.contains(it.key().second))
+            {
+                notifyInChatWindow(streamJid, Jid(it.key().second), tr("Private conversation lost"));
+                it.value()->refreshState();
+            }
         }
     }
+
+    foreach (const QString &contact, m_sessions.contacts(account))
+    {
+        evictSession(account, contact);
+    }
+    if (m_prewarmer)
+    {
+        m_prewarmer->clear(account);
+    }
+
+    m_routes.remove(streamJid);
 }
 
 void OtrPlugin::onToolBarWidgetCreated(IMessageToolBarWidget *)
@@ -207,13 +269,66 @@ void OtrPlugin::onMessageWindowDestroyed(IMessageWindow *)
 
 void OtrPlugin::onChatWindowCreated(IMessageChatWindow *AWindow)
 {
-    QString account = FAccountManager->findAccountByStream(AWindow->streamJid())->accountId().toString();
+    QString account = m_routes.account(AWindow->streamJid());
     QString contact = AWindow->contactJid().uFull();
     OtrStateWidget *widget = new OtrStateWidget(this, m_otrConnection,AWindow, account, contact,
                                           AWindow->toolBarWidget()->toolBarChanger()->toolBar());
     AWindow->toolBarWidget()->toolBarChanger()->insertWidget(widget,TBG_MWTBW_CHATSTATES);
     widget->setToolButtonStyle(Qt::ToolButtonTextBesideIcon);
     widget->setPopupMode(QToolButton::InstantPopup);
+
+    registerStateWidget(widget);
+    connect(widget, SIGNAL(addressChanged()), SLOT(onStateWidgetAddressChanged()));
+    connect(widget, SIGNAL(destroyed(QObject *)), SLOT(onStateWidgetDestroyed(QObject *)));
+
+    if (isLoggedIn(account, contact))
+    {
+        prewarmSession(account, contact);
+    }
+}
+
+void OtrPlugin::registerStateWidget(OtrStateWidget *AWidget)
+{
+    OtrSessionKey key(AWidget->account(), Jid(AWidget->contact()).pFull());
+    m_stateWidgets.insert(key, AWidget);
+    m_stateWidgetKeys.insert(AWidget, key);
+}
+
+void OtrPlugin::onStateWidgetAddressChanged()
+{
+    OtrStateWidget *widget = qobject_cast<OtrStateWidget *>(sender());
+    if (widget)
+    {
+        OtrSessionKey key = m_stateWidgetKeys.take(widget);
+        if (m_stateWidgets.value(key) == widget)
+        {
+            m_stateWidgets.remove(key);
+        }
+
+        IMessageWindow *window = widget->messageWindow();
+        widget->setSession(m_routes.account(window->streamJid()), window->contactJid().uFull());
+        registerStateWidget(widget);
+    }
+}
+
+void OtrPlugin::onStateWidgetDestroyed(QObject *AObject)
+{
+    // Only the address is used, the widget is gone
+    OtrStateWidget *widget = static_cast<OtrStateWidget *>(AObject);
+    OtrSessionKey key = m_stateWidgetKeys.take(widget);
+    if (m_stateWidgets.value(key) == widget)
+    {
+        m_stateWidgets.remove(key);
+    }
+}
+
+void OtrPlugin::updateStateWidget(const QString &account, const QString &contact)
+{
+    OtrStateWidget *widget = m_stateWidgets.value(OtrSessionKey(account, Jid(contact).pFull()));
+    if (widget)
+    {
+        widget->refreshState();
+    }
 }
 
 void OtrPlugin::onChatWindowDestroyed(IMessageChatWindow *AWindow)
@@ -225,13 +340,15 @@ void OtrPlugin::onProfileOpened(const QString &AProfile)
 {
     m_homePath = FOptionsManager->profilePath(AProfile);
     m_otrConnection = new OtrMessaging(this, policy());
+    m_otrConnection->metrics()->setEnabled(Options::node(OPTION_COLLECT_METRICS).value().toBool());
+    m_prewarmer = new OtrSessionPrewarmer(m_otrConnection);
 }
 
 void OtrPlugin::onPresenceOpened(IPresence *APresence)
 {
     Q_UNUSED(APresence)
-    m_inboundCatcher = new InboundStanzaCatcher(m_otrConnection, FAccountManager, this);
-    m_outboundCatcher = new OutboundStanzaCatcher(m_otrConnection, FAccountManager, this);
+    m_inboundCatcher = new InboundStanzaCatcher(m_otrConnection, &m_routes, this);
+    m_outboundCatcher = new OutboundStanzaCatcher(m_otrConnection, &m_routes, this);
 
     if (FStanzaProcessor)
     {
@@ -265,13 +382,72 @@ void OtrPlugin::onPresenceOpened(IPresence *APresence)
 
 void OtrPlugin::authenticateContact(const QString &account, const QString &contact)
 {
-    if (!m_onlineUsers.value(account).contains(contact))
+    sessionClosure(account, contact)->authenticateContact();
+}
+
+//-----------------------------------------------------------------------------
+
+PsiOtrClosure *OtrPlugin::sessionClosure(const QString &account, const QString &contact)
+{
+    OtrSessionTable::Session &session = m_sessions.insert(account, contact);
+    if (!session.closure)
     {
-        m_onlineUsers[account][contact] = new PsiOtrClosure(account,
-                                                            contact,
-                                                            m_otrConnection);
+        session.closure = new PsiOtrClosure(account, contact, m_otrConnection);
     }
-    m_onlineUsers[account][contact]->authenticateContact();
+    return session.closure;
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrPlugin::evictSession(const QString &account, const QString &contact)
+{
+    OtrSessionTable::Session *session = m_sessions.find(account, contact);
+    if (!session)
+    {
+        return;
+    }
+
+    if (session->closure && session->closure->authenticating())
+    {
+        // Keep the dialog working, the entry goes with the next eviction
+        session->loggedIn = false;
+        return;
+    }
+
+    delete session->closure;
+    m_sessions.remove(account, contact);
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrPlugin::keyGenerated(const QString &account, const QString &fingerprint)
+{
+    if (fingerprint.isEmpty())
+    {
+        QMessageBox *mb = new QMessageBox(QMessageBox::Critical, tr("Psi OTR"),
+                                          tr("Failed to generate keys for account \"%1\"."
+                                             "\nThe OTR Plugin will not work.")
+                                             .arg(humanAccount(account)),
+                                          QMessageBox::Ok);
+        mb->setAttribute(Qt::WA_DeleteOnClose);
+        mb->show();
+    }
+    else
+    {
+        LOG_STRM_INFO(m_routes.streamJid(account),QString("OTR keyGenerated, fingerprint=%1").arg(fingerprint));
+    }
+
+    emit privateKeysChanged(account);
+}
+
+void OtrPlugin::keyDeleted(const QString &account)
+{
+    emit privateKeysChanged(account);
+}
+
+void OtrPlugin::fingerprintsChanged(const QString &account, const QString &contact)
+{
+    emit contactFingerprintsChanged(account, contact);
 }
 
 //-----------------------------------------------------------------------------
@@ -309,21 +485,72 @@ void OtrPlugin::sendMessage(const QString &account, const QString &contact, cons
     {
         message.setTo(contact);//.setId(id);
         message.stanza().setAttribute(SkipOtrCatcherFlag(), "true");
-        FMessageProcessor->sendMessage(FAccountManager->findAccountById(account)->streamJid(), message, IMessageProcessor::DirectionOut);
+        FMessageProcessor->sendMessage(m_routes.streamJid(account), message, IMessageProcessor::DirectionOut);
     }
 
 }
 
+void OtrPlugin::sendMessages(const QString &account, const QString &contact, const QStringList &messages)
+{
+    Jid streamJid = m_routes.streamJid(account);
+    foreach (const QString &messagetxt, messages)
+    {
+        if (!messagetxt.isEmpty())
+        {
+            Message message;
+            message.setType(Message::Chat).setTo(contact).setBody(messagetxt);
+            message.stanza().setAttribute(SkipOtrCatcherFlag(), "true");
+            FMessageProcessor->sendMessage(streamJid, message, IMessageProcessor::DirectionOut);
+        }
+    }
+}
+
+int OtrPlugin::maxMessageSize(const QString &account)
+{
+    Q_UNUSED(account);
+    return Options::node(OPTION_MAX_MESSAGE_SIZE).value().toInt();
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrPlugin::prewarmSession(const QString &account, const QString &contact)
+{
+    if (!m_prewarmer || policy() == OTR_POLICY_OFF ||
+        !Options::node(OPTION_PREWARM_SESSIONS).value().toBool())
+    {
+        return;
+    }
+
+    // A query to a client without OTR would only show up as text
+    if (!account.isEmpty() && m_otrConnection->isOtrCapable(account, contact))
+    {
+        m_prewarmer->request(account, contact);
+    }
+}
+
 //-----------------------------------------------------------------------------
 
 bool OtrPlugin::isLoggedIn(const QString &account, const QString &contact)
 {
-    if (m_onlineUsers.contains(account) &&
-        m_onlineUsers.value(account).contains(contact))
+    const OtrSessionTable::PresenceUpdate *update = m_sessions.findPresenceUpdate(account, contact);
+    if (update)
+    {
+        return update->available;
+    }
+
+    const OtrSessionTable::Session *session = m_sessions.find(account, contact);
+    if (session && session->loggedIn)
     {
-        return m_onlineUsers.value(account).value(contact)->isLoggedIn();
+        return true;
     }
 
+    // Presences of contacts without a context are not tracked
+    IPresence *presence = FPresenceManager!=NULL ? FPresenceManager->findPresence(m_routes.streamJid(account)) : NULL;
+    if (presence)
+    {
+        IPresenceItem item = presence->findItem(contact);
+        return item.show != IPresence::Offline && item.show != IPresence::Error;
+    }
     return false;
 }
 
@@ -335,7 +562,7 @@ void OtrPlugin::notifyUser(const QString &account, const QString &contact,
     Q_UNUSED(message);
     Q_UNUSED(type);
 
-    LOG_STRM_INFO(FAccountManager->findAccountById(account)->streamJid(),QString("OTR notifyUser, contact=%1").arg(contact));
+    LOG_STRM_INFO(m_routes.streamJid(account),QString("OTR notifyUser, contact=%1").arg(contact));
 }
 
 //-----------------------------------------------------------------------------
@@ -344,9 +571,10 @@ bool OtrPlugin::displayOtrMessage(const QString &account,
                                      const QString &contact,
                                      const QString& message)
 {
+    Jid streamJid = m_routes.streamJid(account);
     Jid contactJid(contact);
-    notifyInChatWindow(FAccountManager->findAccountById(account)->streamJid(),contactJid, message);
-    LOG_STRM_INFO(FAccountManager->findAccountById(account)->streamJid(),QString("OTR displayOtrMessage, contact=%1").arg(contact));
+    notifyInChatWindow(streamJid, contactJid, message);
+    LOG_STRM_INFO(streamJid,QString("OTR displayOtrMessage, contact=%1").arg(contact));
     return true;
 }
 
@@ -355,25 +583,24 @@ bool OtrPlugin::displayOtrMessage(const QString &account,
 void OtrPlugin::stateChange(const QString &account, const QString &contact,
                                OtrStateChange change)
 {
-    LOG_STRM_INFO(FAccountManager->findAccountById(account)->streamJid(),QString("OTR stateChange, contact=%1").arg(contact));
+    Jid streamJid = m_routes.streamJid(account);
+    LOG_STRM_INFO(streamJid,QString("OTR stateChange, contact=%1").arg(contact));
 
-    if (!m_onlineUsers.value(account).contains(contact))
-    {
-        m_onlineUsers[account][contact] = new PsiOtrClosure(account,
-                                                            contact,
-                                                            m_otrConnection);
-    }
-
-    bool verified  = m_otrConnection->isVerified(account, contact);
-    bool encrypted = m_onlineUsers[account][contact]->encrypted();
+    SessionSnapshot snapshot = m_otrConnection->getSessionSnapshot(account, contact);
+    bool verified  = snapshot.isVerified();
+    bool encrypted = snapshot.messageState() == OTR_MESSAGESTATE_ENCRYPTED;
     QString msg;
 
     switch (change)
     {
         case OTR_STATECHANGE_GOINGSECURE:
-            msg = encrypted?
-                      tr("Attempting to refresh the private conversation")
-                    : tr("Attempting to start a private conversation");
+            // A handshake started in advance is not announced
+            if (!m_prewarmer->isRunning(account, contact))
+            {
+                msg = encrypted?
+                          tr("Attempting to refresh the private conversation")
+                        : tr("Attempting to start a private conversation");
+            }
             break;
 
         case OTR_STATECHANGE_GONESECURE:
@@ -406,9 +633,24 @@ void OtrPlugin::stateChange(const QString &account, const QString &contact,
             break;
     }
 
+    if (change != OTR_STATECHANGE_GOINGSECURE && change != OTR_STATECHANGE_TRUST)
+    {
+        m_prewarmer->finished(account, contact);
+    }
+
+    // Messages typed during the AKE follow in one burst
+    if (change == OTR_STATECHANGE_GONESECURE && m_outboundCatcher)
+    {
+        m_outboundCatcher->releaseHeld(account, contact);
+    }
+
     Jid contactJid(contact);
-    notifyInChatWindow(FAccountManager->findAccountById(account)->streamJid(),contactJid, msg);
-    emit otrStateChanged(FAccountManager->findAccountById(account)->streamJid(),contactJid);
+    if (!msg.isEmpty())
+    {
+        notifyInChatWindow(streamJid, contactJid, msg);
+    }
+    updateStateWidget(account, contact);
+    emit otrStateChanged(streamJid, contactJid);
 }
 
 //-----------------------------------------------------------------------------
@@ -416,13 +658,9 @@ void OtrPlugin::stateChange(const QString &account, const QString &contact,
 void OtrPlugin::receivedSMP(const QString &account, const QString &contact,
                                const QString& question)
 {
-    LOG_STRM_INFO(FAccountManager->findAccountById(account)->streamJid(),QString("OTR receivedSMP, contact=%1").arg(contact));
+    LOG_STRM_INFO(m_routes.streamJid(account),QString("OTR receivedSMP, contact=%1").arg(contact));
 
-    if (m_onlineUsers.contains(account) &&
-        m_onlineUsers.value(account).contains(contact))
-    {
-        m_onlineUsers[account][contact]->receivedSMP(question);
-    }
+    sessionClosure(account, contact)->receivedSMP(question);
 }
 
 //-----------------------------------------------------------------------------
@@ -430,12 +668,12 @@ void OtrPlugin::receivedSMP(const QString &account, const QString &contact,
 void OtrPlugin::updateSMP(const QString &account, const QString &contact,
                              int progress)
 {
-    LOG_STRM_INFO(FAccountManager->findAccountById(account)->streamJid(),QString("OTR updateSMP, contact=%1").arg(contact));
+    LOG_STRM_INFO(m_routes.streamJid(account),QString("OTR updateSMP, contact=%1").arg(contact));
 
-    if (m_onlineUsers.contains(account) &&
-        m_onlineUsers.value(account).contains(contact))
+    OtrSessionTable::Session *session = m_sessions.find(account, contact);
+    if (session && session->closure)
     {
-        m_onlineUsers[account][contact]->updateSMP(progress);
+        session->closure->updateSMP(progress);
     }
 }
 
@@ -446,14 +684,14 @@ QString OtrPlugin::humanAccount(const QString& accountId)
     /*QString human(FAccountManager->findAccountById(accountId)->accountId());
 
     return human.isEmpty()? accountId : human;*/
-    return FAccountManager->findAccountById(accountId)->streamJid().bare();
+    return m_routes.streamJid(accountId).bare();
 }
 
 //-----------------------------------------------------------------------------
 
 QString OtrPlugin::humanAccountPublic(const QString& accountId)
 {
-    return FAccountManager->findAccountById(accountId)->streamJid().bare();
+    return m_routes.streamJid(accountId).bare();
 }
 
 //-----------------------------------------------------------------------------
@@ -487,40 +725,69 @@ bool OtrPlugin::stanzaReadWrite(int AHandlerId, const Jid &AStreamJid, Stanza &A
 
     if (AHandlerId == FSHIPresence)
     {
-        QDomElement xml = AStanza.document().firstChildElement("presence");
-        if (!xml.isNull())
+        // Only the attributes are read, the handle matches presences only
+        QString type = AStanza.type();
+        bool available = (type == PRESENCE_TYPE_AVAILABLE);
+        if (!available && type != PRESENCE_TYPE_UNAVAILABLE)
+        {
+            return false;
+        }
+
+        QString account = m_routes.account(AStreamJid);
+        QString contact = AStanza.from();
+        const OtrSessionTable::PresenceUpdate *pending = m_sessions.findPresenceUpdate(account, contact);
+
+        // Contacts without a context need no tracking, see isLoggedIn(),
+        // only their arrival may start a session in advance
+        bool tracked = m_sessions.contains(account, contact) || (pending && pending->tracked) ||
+                       m_otrConnection->hasContext(account, contact);
+        if (!tracked && !(available && Options::node(OPTION_PREWARM_SESSIONS).value().toBool()) &&
+            !pending)
         {
-            QString contact = AStanza.from();
-            QString account = FAccountManager->findAccountByStream(AStreamJid)->accountId();
+            return false;
+        }
 
-            if (AStanza.type() == PRESENCE_TYPE_AVAILABLE)
+        // A contact flapping within one event loop iteration is
+        // handled once, with its last presence.
+        if (m_sessions.addPresenceUpdate(AStreamJid, account, contact, available, tracked))
+        {
+            QTimer::singleShot(0, this, SLOT(processPresenceUpdates()));
+        }
+    }
+    return false;
+}
+
+void OtrPlugin::processPresenceUpdates()
+{
+    OtrSessionTable::PresenceUpdates updates = m_sessions.takePresenceUpdates();
+
+    bool endWhenOffline = Options::node(OPTION_END_WHEN_OFFLINE).value().toBool();
+
+    OtrSessionTable::PresenceUpdates::const_iterator it;
+    for (it = updates.constBegin(); it != updates.constEnd(); ++it)
+    {
+        const QString &account = it.key().first;
+        const QString &contact = it.key().second;
+
+        if (it->available)
+        {
+            if (it->tracked)
             {
-                if (!m_onlineUsers.value(account).contains(contact))
-                {
-                    m_onlineUsers[account][contact] = new PsiOtrClosure(account,
-                                                                        contact,
-                                                                        m_otrConnection);
-                }
-
-                m_onlineUsers[account][contact]->setIsLoggedIn(true);
+                m_sessions.insert(account, contact).loggedIn = true;
             }
-            else if (AStanza.type() == PRESENCE_TYPE_UNAVAILABLE)
+            prewarmSession(account, contact);
+        }
+        else if (m_sessions.contains(account, contact) || m_otrConnection->hasContext(account, contact))
+        {
+            if (endWhenOffline)
             {
-                if (m_onlineUsers.contains(account) &&
-                    m_onlineUsers.value(account).contains(contact))
-                {
-                    if (Options::node(OPTION_END_WHEN_OFFLINE).value().toBool())
-                    {
-                        m_otrConnection->expireSession(account, contact);
-                    }
-                    m_onlineUsers[account][contact]->setIsLoggedIn(false);
-                    Jid contactJid(AStanza.from());
-                    emit otrStateChanged(AStreamJid,contactJid);
-                }
+                m_otrConnection->expireSession(account, contact);
             }
+            evictSession(account, contact);
+            updateStateWidget(account, contact);
+            emit otrStateChanged(it->streamJid, Jid(contact));
         }
     }
-    return false;
 }
 
 #if QT_VERSION < 0x050000
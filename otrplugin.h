@@ -2,6 +2,7 @@
 #define OTRPLUGIN_H
 
 #include <QMultiMap>
+#include <QPair>
 
 #include <interfaces/ipluginmanager.h>
 #include <interfaces/ipresencemanager.h>
@@ -24,6 +25,9 @@
 
 #include "stanza_catchers.h"
 #include "otrstatewidget.h"
+#include "otrroutingtable.h"
+#include "otrsessiontable.h"
+#include "otrsessionprewarmer.h"
 
 class QToolButton;
 class QAction;
@@ -85,6 +89,9 @@ public:
     virtual QString dataDir();
     virtual void sendMessage(const QString &account, const QString &contact,
                              const QString& message);
+    virtual void sendMessages(const QString &account, const QString &contact,
+                              const QStringList& messages);
+    virtual int maxMessageSize(const QString &account);
     virtual bool isLoggedIn(const QString &account, const QString &contact);
     virtual void notifyUser(const QString &account, const QString &contact,
                             const QString& message, const OtrNotifyType& type);
@@ -104,16 +111,30 @@ public:
     virtual QString humanContact(const QString& accountId,
                                  const QString &AContactJid);
     virtual void authenticateContact(const QString &account, const QString &contact);
+    virtual void keyGenerated(const QString &account, const QString &fingerprint);
+    virtual void keyDeleted(const QString &account);
+    virtual void fingerprintsChanged(const QString &account, const QString &contact);
 signals:
 	void otrStateChanged(const Jid &AStreamJid, const Jid &AContactJid) const;
+	void privateKeysChanged(const QString &account) const;
+	void contactFingerprintsChanged(const QString &account, const QString &contact) const;
 
-private:
-	void onStreamOpened(IXmppStream *AXmppStream);
-	void onStreamClosed(IXmppStream *AXmppStream);
 protected:
+	// Creates the closure of a contact on first use
+	PsiOtrClosure *sessionClosure(const QString &account, const QString &contact);
+	// Drops the session of a contact unless an authentication is running
+	void evictSession(const QString &account, const QString &contact);
+	// Shows the current state in the chat window of the contact, if any
+	void updateStateWidget(const QString &account, const QString &contact);
+	void registerStateWidget(OtrStateWidget *AWidget);
 	void notifyInChatWindow(const Jid &AStreamJid, const Jid &AContactJid, const QString &AMessage) const;
+	// Starts the AKE with an online contact in the background if enabled
+	// and the contact is known to speak OTR
+	void prewarmSession(const QString &account, const QString &contact);
 
 private slots:
+	void onStreamOpened(IXmppStream *AXmppStream);
+	void onStreamClosed(IXmppStream *AXmppStream);
 	void onToolBarWidgetCreated(IMessageToolBarWidget *AWidget);
 
 	void onMessageWindowCreated(IMessageWindow *AWindow);
@@ -122,14 +143,24 @@ private slots:
 	void onChatWindowDestroyed(IMessageChatWindow *AWindow);
 	void onPresenceOpened(IPresence *APresence);
 	void onProfileOpened(const QString &AProfile);
+	void processPresenceUpdates();
+	void onStateWidgetAddressChanged();
+	void onStateWidgetDestroyed(QObject *AObject);
 
 private:
+	typedef QPair<QString, QString> OtrSessionKey; // account, contact
+
 	OtrMessaging* m_otrConnection;
-	QHash<QString, QHash<QString, PsiOtrClosure*> > m_onlineUsers;
+	OtrSessionPrewarmer* m_prewarmer;
+	OtrSessionTable m_sessions;
+	// State widgets by account and prepared full contact JID
+	QHash<OtrSessionKey, OtrStateWidget*> m_stateWidgets;
+	QHash<OtrStateWidget*, OtrSessionKey> m_stateWidgetKeys;
 	IOptionsManager* FOptionsManager;
 	IStanzaProcessor *FStanzaProcessor;
 	IMessageArchiver *FMessageArchiver;
 	IAccountManager* FAccountManager;
+	OtrRoutingTable m_routes;
 	IPresenceManager *FPresenceManager;
 	IMessageProcessor* FMessageProcessor;
 	InboundStanzaCatcher* m_inboundCatcher;
@@ -1,6 +1,14 @@
 HEADERS = otrplugin.h \
       otrmessaging.h \
       otrinternal.h \
+      otrnametable.h \
+      otrkeygenerator.h \
+      otrfingerprintstore.h \
+      otrroutingtable.h \
+      otrsessiontable.h \
+      otrmetrics.h \
+      otrcapabilitycache.h \
+      otrsessionprewarmer.h \
       psiotrconfig.h \
       otrlextensions.h \
       stanza_catchers.h \
@@ -10,6 +18,14 @@ HEADERS = otrplugin.h \
 SOURCES = otrplugin.cpp \
       otrmessaging.cpp \
       otrinternal.cpp \
+      otrnametable.cpp \
+      otrkeygenerator.cpp \
+      otrfingerprintstore.cpp \
+      otrroutingtable.cpp \
+      otrsessiontable.cpp \
+      otrmetrics.cpp \
+      otrcapabilitycache.cpp \
+      otrsessionprewarmer.cpp \
       psiotrconfig.cpp \
       otrlextensions.c \
       stanza_catchers.cpp \
@@ -0,0 +1,104 @@
+/*
+ * otrroutingtable.cpp - Stream and account lookup
+ *
+ * Off-the-Record Messaging plugin for Psi+
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "otrroutingtable.h"
+
+#include <interfaces/iaccountmanager.h>
+
+//-----------------------------------------------------------------------------
+
+OtrRoutingTable::OtrRoutingTable()
+    : m_accountManager(NULL),
+      m_accounts(),
+      m_streams()
+{
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrRoutingTable::setAccountManager(IAccountManager* accountManager)
+{
+    m_accountManager = accountManager;
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrRoutingTable::insert(const Jid& streamJid, const QString& account)
+{
+    m_accounts.insert(streamJid.pFull(), account);
+    m_streams.insert(account, streamJid);
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrRoutingTable::remove(const Jid& streamJid)
+{
+    QString account = m_accounts.take(streamJid.pFull());
+    if (!account.isEmpty())
+    {
+        m_streams.remove(account);
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+QString OtrRoutingTable::account(const Jid& streamJid)
+{
+    QHash<QString, QString>::const_iterator it = m_accounts.constFind(streamJid.pFull());
+    if (it != m_accounts.constEnd())
+    {
+        return it.value();
+    }
+
+    IAccount* account = m_accountManager
+                        ? m_accountManager->findAccountByStream(streamJid)
+                        : NULL;
+    if (!account)
+    {
+        return QString();
+    }
+
+    QString accountId = account->accountId().toString();
+    insert(streamJid, accountId);
+    return accountId;
+}
+
+//-----------------------------------------------------------------------------
+
+Jid OtrRoutingTable::streamJid(const QString& account)
+{
+    QHash<QString, Jid>::const_iterator it = m_streams.constFind(account);
+    if (it != m_streams.constEnd())
+    {
+        return it.value();
+    }
+
+    IAccount* accountPtr = m_accountManager
+                           ? m_accountManager->findAccountById(account)
+                           : NULL;
+    if (!accountPtr)
+    {
+        return Jid();
+    }
+
+    Jid streamJid = accountPtr->streamJid();
+    insert(streamJid, account);
+    return streamJid;
+}
@@ -0,0 +1,76 @@
+/*
+ * otrroutingtable.h - Stream and account lookup
+ *
+ * Off-the-Record Messaging plugin for Psi+
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef OTRROUTINGTABLE_H_
+#define OTRROUTINGTABLE_H_
+
+#include <QHash>
+#include <QString>
+
+#include <utils/jid.h>
+
+class IAccountManager;
+
+// ---------------------------------------------------------------------------
+
+/**
+ * Maps the JIDs of open streams to the account ids used by OtrMessaging
+ * and back. Entries are added when a stream opens and removed when it
+ * closes; a lookup which misses asks the account manager and caches
+ * the result.
+ */
+class OtrRoutingTable
+{
+public:
+    OtrRoutingTable();
+
+    void setAccountManager(IAccountManager* accountManager);
+
+    void insert(const Jid& streamJid, const QString& account);
+
+    void remove(const Jid& streamJid);
+
+    /**
+     * Account id of the stream or an empty string.
+     */
+    QString account(const Jid& streamJid);
+
+    /**
+     * Stream of the account or an invalid Jid.
+     */
+    Jid streamJid(const QString& account);
+
+private:
+    IAccountManager*        m_accountManager;
+
+    /**
+     * Full stream JID -> account id
+     */
+    QHash<QString, QString> m_accounts;
+
+    /**
+     * Account id -> stream JID
+     */
+    QHash<QString, Jid>     m_streams;
+};
+
+// ---------------------------------------------------------------------------
+
+#endif
@@ -0,0 +1,187 @@
+/*
+ * otrsessionprewarmer.cpp - Starts sessions before the first message
+ *
+ * Off-the-Record Messaging plugin for Psi+
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "otrsessionprewarmer.h"
+#include "otrmessaging.h"
+
+//-----------------------------------------------------------------------------
+
+/**
+ * Handshakes running at once.
+ */
+static const int MAX_RUNNING = 3;
+
+/**
+ * Requests waiting to be started; more are dropped, e.g. the presences
+ * of a whole roster after login.
+ */
+static const int MAX_QUEUED = 32;
+
+static const int START_INTERVAL_MSECS    = 1000;
+static const int HANDSHAKE_TIMEOUT_MSECS = 30 * 1000;
+static const int RETRY_INTERVAL_MSECS    = 10 * 60 * 1000;
+
+//-----------------------------------------------------------------------------
+
+OtrSessionPrewarmer::OtrSessionPrewarmer(psiotr::OtrMessaging* otr,
+                                         QObject* parent)
+    : QObject(parent),
+      m_otr(otr),
+      m_queue(),
+      m_running(),
+      m_attempts(),
+      m_lastStart(),
+      m_timer()
+{
+    m_timer.setSingleShot(true);
+    connect(&m_timer, SIGNAL(timeout()), SLOT(processQueue()));
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrSessionPrewarmer::request(const QString& account, const QString& contact)
+{
+    SessionKey key(account, contact);
+
+    QHash<SessionKey, QElapsedTimer>::const_iterator attempt = m_attempts.constFind(key);
+    if ((attempt != m_attempts.constEnd() &&
+         !attempt->hasExpired(RETRY_INTERVAL_MSECS)) ||
+        m_running.contains(key) || m_queue.contains(key) ||
+        m_queue.size() >= MAX_QUEUED)
+    {
+        return;
+    }
+
+    m_queue.append(key);
+    schedule();
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrSessionPrewarmer::finished(const QString& account, const QString& contact)
+{
+    if (m_running.remove(SessionKey(account, contact)) > 0)
+    {
+        schedule();
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+bool OtrSessionPrewarmer::isRunning(const QString& account, const QString& contact) const
+{
+    return m_running.contains(SessionKey(account, contact));
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrSessionPrewarmer::clear(const QString& account)
+{
+    QList<SessionKey>::iterator it = m_queue.begin();
+    while (it != m_queue.end())
+    {
+        it = it->first == account? m_queue.erase(it) : it + 1;
+    }
+
+    QHash<SessionKey, QElapsedTimer>::iterator running = m_running.begin();
+    while (running != m_running.end())
+    {
+        running = running.key().first == account? m_running.erase(running)
+                                                 : running + 1;
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrSessionPrewarmer::processQueue()
+{
+    QHash<SessionKey, QElapsedTimer>::iterator running = m_running.begin();
+    while (running != m_running.end())
+    {
+        running = running->hasExpired(HANDSHAKE_TIMEOUT_MSECS)? m_running.erase(running)
+                                                              : running + 1;
+    }
+
+    if (m_lastStart.isValid() && !m_lastStart.hasExpired(START_INTERVAL_MSECS))
+    {
+        schedule();
+        return;
+    }
+
+    // One start per call, the next one follows after the interval
+    while (!m_queue.isEmpty() && m_running.size() < MAX_RUNNING)
+    {
+        SessionKey key = m_queue.takeFirst();
+        const QString& account = key.first;
+        const QString& contact = key.second;
+
+        // The conversation may have started meanwhile
+        if (m_otr->getMessageState(account, contact) != psiotr::OTR_MESSAGESTATE_PLAINTEXT ||
+            !m_otr->hasPrivateKey(account))
+        {
+            continue;
+        }
+
+        // Marked first, so the start is known not to come from the user
+        m_running[key].start();
+        m_attempts[key].start();
+
+        m_otr->startSession(account, contact);
+
+        m_lastStart.start();
+        break;
+    }
+
+    if (m_attempts.size() > 4 * MAX_QUEUED)
+    {
+        QHash<SessionKey, QElapsedTimer>::iterator attempt = m_attempts.begin();
+        while (attempt != m_attempts.end())
+        {
+            attempt = attempt->hasExpired(RETRY_INTERVAL_MSECS)? m_attempts.erase(attempt)
+                                                                : attempt + 1;
+        }
+    }
+
+    schedule();
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrSessionPrewarmer::schedule()
+{
+    if (m_timer.isActive() || (m_queue.isEmpty() && m_running.isEmpty()))
+    {
+        return;
+    }
+
+    int delay = 0;
+    if (m_queue.isEmpty() || m_running.size() >= MAX_RUNNING)
+    {
+        // Only waiting for running handshakes to time out
+        delay = START_INTERVAL_MSECS;
+    }
+    else if (m_lastStart.isValid() && !m_lastStart.hasExpired(START_INTERVAL_MSECS))
+    {
+        delay = START_INTERVAL_MSECS - static_cast<int>(m_lastStart.elapsed());
+    }
+    m_timer.start(delay);
+}
+
+//-----------------------------------------------------------------------------
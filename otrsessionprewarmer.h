@@ -0,0 +1,101 @@
+/*
+ * otrsessionprewarmer.h - Starts sessions before the first message
+ *
+ * Off-the-Record Messaging plugin for Psi+
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef OTRSESSIONPREWARMER_H_
+#define OTRSESSIONPREWARMER_H_
+
+#include <QObject>
+#include <QHash>
+#include <QList>
+#include <QPair>
+#include <QString>
+#include <QTimer>
+#include <QElapsedTimer>
+
+namespace psiotr
+{
+    class OtrMessaging;
+}
+
+// ---------------------------------------------------------------------------
+
+/**
+ * Starts the AKE with contacts who are likely to be written to, so that
+ * the session is encrypted before the first message is sent.
+ *
+ * Requests are queued and started one at a time with a pause between
+ * them, with at most a few handshakes running at once. A contact is
+ * asked again only after a while, whatever the outcome was.
+ */
+class OtrSessionPrewarmer : public QObject
+{
+    Q_OBJECT
+
+public:
+    OtrSessionPrewarmer(psiotr::OtrMessaging* otr, QObject* parent = 0);
+
+    /**
+     * Queue a session start with contact.
+     */
+    void request(const QString& account, const QString& contact);
+
+    /**
+     * The handshake with contact ended, successfully or not.
+     */
+    void finished(const QString& account, const QString& contact);
+
+    /**
+     * True while a handshake started in advance with contact runs.
+     */
+    bool isRunning(const QString& account, const QString& contact) const;
+
+    /**
+     * Forget the requests of an account, e.g. when its stream closed.
+     */
+    void clear(const QString& account);
+
+private slots:
+    void processQueue();
+
+private:
+    typedef QPair<QString, QString> SessionKey; // account, contact
+
+    void schedule();
+
+    psiotr::OtrMessaging*             m_otr;
+    QList<SessionKey>                 m_queue;
+
+    /**
+     * Started handshakes, freed when they finish or time out.
+     */
+    QHash<SessionKey, QElapsedTimer>  m_running;
+
+    /**
+     * Last start per contact, for the retry interval.
+     */
+    QHash<SessionKey, QElapsedTimer>  m_attempts;
+
+    QElapsedTimer                     m_lastStart;
+    QTimer                            m_timer;
+};
+
+// ---------------------------------------------------------------------------
+
+#endif
@@ -0,0 +1,159 @@
+/*
+ * otrsessiontable.cpp - Presence and authentication state of contacts
+ *
+ * Off-the-Record Messaging plugin for Psi+
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "otrsessiontable.h"
+
+//-----------------------------------------------------------------------------
+
+OtrSessionTable::Session::Session()
+    : loggedIn(false),
+      closure(NULL)
+{
+}
+
+//-----------------------------------------------------------------------------
+
+OtrSessionTable::PresenceUpdate::PresenceUpdate()
+    : streamJid(),
+      available(false),
+      tracked(false)
+{
+}
+
+//-----------------------------------------------------------------------------
+
+OtrSessionTable::OtrSessionTable()
+    : m_sessions(),
+      m_presenceUpdates()
+{
+}
+
+//-----------------------------------------------------------------------------
+
+int OtrSessionTable::size() const
+{
+    return m_sessions.size();
+}
+
+//-----------------------------------------------------------------------------
+
+bool OtrSessionTable::contains(const QString& account, const QString& contact) const
+{
+    return m_sessions.contains(Key(account, contact));
+}
+
+//-----------------------------------------------------------------------------
+
+OtrSessionTable::Session* OtrSessionTable::find(const QString& account,
+                                                const QString& contact)
+{
+    QHash<Key, Session>::iterator it = m_sessions.find(Key(account, contact));
+    return it != m_sessions.end()? &it.value() : NULL;
+}
+
+//-----------------------------------------------------------------------------
+
+const OtrSessionTable::Session* OtrSessionTable::find(const QString& account,
+                                                      const QString& contact) const
+{
+    QHash<Key, Session>::const_iterator it = m_sessions.constFind(Key(account, contact));
+    return it != m_sessions.constEnd()? &it.value() : NULL;
+}
+
+//-----------------------------------------------------------------------------
+
+OtrSessionTable::Session& OtrSessionTable::insert(const QString& account,
+                                                  const QString& contact)
+{
+    return m_sessions[Key(account, contact)];
+}
+
+//-----------------------------------------------------------------------------
+
+void OtrSessionTable::remove(const QString& account, const QString& contact)
+{
+    m_sessions.remove(Key(account, contact));
+}
+
+//-----------------------------------------------------------------------------
+
+QStringList OtrSessionTable::contacts(const QString& account) const
+{
+    QStringList contacts;
+    for (QHash<Key, Session>::const_iterator it = m_sessions.constBegin();
+         it != m_sessions.constEnd(); ++it)
+    {
+        if (it.key().first == account)
+        {
+            contacts.append(it.key().second);
+        }
+    }
+    return contacts;
+}
+
+//-----------------------------------------------------------------------------
+
+QList<psiotr::PsiOtrClosure*> OtrSessionTable::closures() const
+{
+    QList<psiotr::PsiOtrClosure*> closures;
+    foreach (const Session& session, m_sessions)
+    {
+        if (session.closure)
+        {
+            closures.append(session.closure);
+        }
+    }
+    return closures;
+}
+
+//-----------------------------------------------------------------------------
+
+const OtrSessionTable::PresenceUpdate* OtrSessionTable::findPresenceUpdate(
+    const QString& account, const QString& contact) const
+{
+    PresenceUpdates::const_iterator it = m_presenceUpdates.constFind(Key(account, contact));
+    return it != m_presenceUpdates.constEnd()? &it.value() : NULL;
+}
+
+//-----------------------------------------------------------------------------
+
+bool OtrSessionTable::addPresenceUpdate(const Jid& streamJid, const QString& account,
+                                        const QString& contact, bool available,
+                                        bool tracked)
+{
+    bool first = m_presenceUpdates.isEmpty();
+
+    PresenceUpdate& update = m_presenceUpdates[Key(account, contact)];
+    update.streamJid = streamJid;
+    update.available = available;
+    update.tracked   = tracked;
+    return first;
+}
+
+//-----------------------------------------------------------------------------
+
+OtrSessionTable::PresenceUpdates OtrSessionTable::takePresenceUpdates()
+{
+    PresenceUpdates updates;
+    updates.swap(m_presenceUpdates);
+    return updates;
+}
+
+//-----------------------------------------------------------------------------
@@ -0,0 +1,131 @@
+/*
+ * otrsessiontable.h - Presence and authentication state of contacts
+ *
+ * Off-the-Record Messaging plugin for Psi+
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef OTRSESSIONTABLE_H_
+#define OTRSESSIONTABLE_H_
+
+#include <QHash>
+#include <QList>
+#include <QPair>
+#include <QString>
+#include <QStringList>
+
+#include <utils/jid.h>
+
+namespace psiotr
+{
+    class PsiOtrClosure;
+}
+
+// ---------------------------------------------------------------------------
+
+/**
+ * One flat table of the contact resources which are online or being
+ * authenticated, keyed by account and full JID, and of the presences
+ * received during the current event loop iteration.
+ *
+ * The table does not own the closures; whoever creates one deletes it
+ * before removing its session.
+ */
+class OtrSessionTable
+{
+public:
+    typedef QPair<QString, QString> Key; // account, contact
+
+    struct Session
+    {
+        Session();
+
+        bool                   loggedIn;
+
+        /**
+         * Created when authentication needs it, otherwise NULL.
+         */
+        psiotr::PsiOtrClosure* closure;
+    };
+
+    /**
+     * Last presence of a contact received during this iteration.
+     */
+    struct PresenceUpdate
+    {
+        PresenceUpdate();
+
+        Jid  streamJid;
+        bool available;
+
+        /**
+         * False if only passed on to start a session in advance.
+         */
+        bool tracked;
+    };
+
+    typedef QHash<Key, PresenceUpdate> PresenceUpdates;
+
+    OtrSessionTable();
+
+    int size() const;
+
+    bool contains(const QString& account, const QString& contact) const;
+
+    /**
+     * Session of contact or NULL.
+     */
+    Session* find(const QString& account, const QString& contact);
+    const Session* find(const QString& account, const QString& contact) const;
+
+    /**
+     * Session of contact, created if there is none.
+     */
+    Session& insert(const QString& account, const QString& contact);
+
+    void remove(const QString& account, const QString& contact);
+
+    /**
+     * Contacts of account which have a session.
+     */
+    QStringList contacts(const QString& account) const;
+
+    QList<psiotr::PsiOtrClosure*> closures() const;
+
+    /**
+     * Pending presence of contact or NULL.
+     */
+    const PresenceUpdate* findPresenceUpdate(const QString& account,
+                                             const QString& contact) const;
+
+    /**
+     * Record a presence of contact, replacing a pending one. Returns
+     * true if it is the first one pending, so that processing has to be
+     * scheduled.
+     */
+    bool addPresenceUpdate(const Jid& streamJid, const QString& account,
+                           const QString& contact, bool available, bool tracked);
+
+    PresenceUpdates takePresenceUpdates();
+
+private:
+    QHash<Key, Session> m_sessions;
+    PresenceUpdates     m_presenceUpdates;
+};
+
+// ---------------------------------------------------------------------------
+
+#endif
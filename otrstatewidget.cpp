@@ -1,5 +1,7 @@
 #include "otrstatewidget.h"
 
+#include <QTimer>
+
 #include "definitions/menuicons.h"
 #include <definitions/resources.h>
 #include <utils/iconstorage.h>
@@ -14,7 +16,11 @@ OtrStateWidget::OtrStateWidget(OtrCallback* callback, OtrMessaging* otrc, IMessa
       m_callback(callback),
       m_otr(otrc),
       m_account(account),
-      m_contact(contact)
+      m_contact(contact),
+      m_shownState(),
+      m_shownPolicy(OTR_POLICY_OFF),
+      m_stateShown(false),
+      m_refreshQueued(false)
 {
 	FWindow = AWindow;
 
@@ -61,9 +67,8 @@ OtrStateWidget::OtrStateWidget(OtrCallback* callback, OtrMessaging* otrc, IMessa
     setToolTip(tr("OTR Messaging"));
 
 	connect(FWindow->address()->instance(),SIGNAL(addressChanged(const Jid &, const Jid &)),SLOT(onWindowAddressChanged(const Jid &, const Jid &)));
-    connect(m_callback->instance(),SIGNAL(otrStateChanged(const Jid &, const Jid &)),SLOT(onUpdateMessageState(const Jid &, const Jid &)));
 
-	onUpdateMessageState(FWindow->streamJid(),FWindow->contactJid());
+	updateState(m_otr->getSessionSnapshot(m_account, m_contact));
 }
 
 OtrStateWidget::~OtrStateWidget()
@@ -71,74 +76,117 @@ OtrStateWidget::~OtrStateWidget()
 
 }
 
+const QString &OtrStateWidget::account() const
+{
+	return m_account;
+}
+
+const QString &OtrStateWidget::contact() const
+{
+	return m_contact;
+}
+
+IMessageWindow *OtrStateWidget::messageWindow() const
+{
+	return FWindow;
+}
+
+void OtrStateWidget::setSession(const QString &account, const QString &contact)
+{
+	m_account = account;
+	m_contact = contact;
+	refreshState();
+}
+
 void OtrStateWidget::onWindowAddressChanged(const Jid &AStreamBefore, const Jid &AContactBefore)
 {
 	Q_UNUSED(AStreamBefore); Q_UNUSED(AContactBefore);
-	onUpdateMessageState(FWindow->streamJid(),FWindow->contactJid());
+	// The plugin knows the account of the stream and calls setSession()
+	emit addressChanged();
 }
 
-void OtrStateWidget::onUpdateMessageState(const Jid &AStreamJid, const Jid &AContactJid)
+void OtrStateWidget::refreshState()
 {
-    if (FWindow->streamJid()==AStreamJid && FWindow->contactJid()==AContactJid.full())
-    {
-        QString iconKey;
-        OtrMessageState state = m_otr->getMessageState(m_account, m_contact);
+	if (!m_refreshQueued)
+	{
+		m_refreshQueued = true;
+		QTimer::singleShot(0, this, SLOT(onRefreshTimeout()));
+	}
+}
+
+void OtrStateWidget::onRefreshTimeout()
+{
+	m_refreshQueued = false;
+	updateState(m_otr->getSessionSnapshot(m_account, m_contact));
+}
+
+void OtrStateWidget::updateState(const SessionSnapshot &ASnapshot)
+{
+	// The text, icon and actions are derived from the state and the
+	// policy alone, so an unchanged state would only relayout the toolbar
+	OtrPolicy policy = m_otr->getPolicy();
+	if (m_stateShown && ASnapshot == m_shownState && policy == m_shownPolicy)
+		return;
+	m_shownState = ASnapshot;
+	m_shownPolicy = policy;
+	m_stateShown = true;
 
-        QString stateString(m_otr->getMessageStateString(m_account,
-                                                         m_contact));
+    QString iconKey;
+    OtrMessageState state = ASnapshot.messageState();
 
-        if (state == OTR_MESSAGESTATE_ENCRYPTED)
+    QString stateString(ASnapshot.messageStateString());
+
+    if (state == OTR_MESSAGESTATE_ENCRYPTED)
+    {
+        if (ASnapshot.isVerified())
         {
-            if (m_otr->isVerified(m_account, m_contact))
-            {
-            //    m_chatDlgAction->setIcon(QIcon(":/otrplugin/otr_yes.png"));
-                iconKey = MNI_OTR_ENCRYPTED;
-            }
-            else
-            {
-            //    m_chatDlgAction->setIcon(QIcon(":/otrplugin/otr_unverified.png"));
-                iconKey = MNI_OTR_UNVERFIFIED;
-                stateString += ", " + tr("unverified");
-            }
+        //    m_chatDlgAction->setIcon(QIcon(":/otrplugin/otr_yes.png"));
+            iconKey = MNI_OTR_ENCRYPTED;
         }
         else
         {
-            iconKey = MNI_OTR_NO;
-        //    m_chatDlgAction->setIcon(QIcon(":/otrplugin/otr_no.png"));
+        //    m_chatDlgAction->setIcon(QIcon(":/otrplugin/otr_unverified.png"));
+            iconKey = MNI_OTR_UNVERFIFIED;
+            stateString += ", " + tr("unverified");
         }
+    }
+    else
+    {
+        iconKey = MNI_OTR_NO;
+    //    m_chatDlgAction->setIcon(QIcon(":/otrplugin/otr_no.png"));
+    }
 
-        setText(tr("OTR Messaging [%1]").arg(stateString));
-        IconStorage::staticStorage(RSR_STORAGE_MENUICONS)->insertAutoIcon(this,iconKey);
+    setText(tr("OTR Messaging [%1]").arg(stateString));
+    IconStorage::staticStorage(RSR_STORAGE_MENUICONS)->insertAutoIcon(this,iconKey);
 
-        if (state == OTR_MESSAGESTATE_ENCRYPTED)
+    if (state == OTR_MESSAGESTATE_ENCRYPTED)
+    {
+        m_startSessionAction->setText(tr("Refre&sh private conversation"));
+        m_authenticateAction->setEnabled(true);
+        m_sessionIdAction->setEnabled(true);
+        m_endSessionAction->setEnabled(true);
+    }
+    else
+    {
+        m_startSessionAction->setText(tr("&Start private conversation"));
+        if (state == OTR_MESSAGESTATE_PLAINTEXT)
         {
-            m_startSessionAction->setText(tr("Refre&sh private conversation"));
-            m_authenticateAction->setEnabled(true);
-            m_sessionIdAction->setEnabled(true);
-            m_endSessionAction->setEnabled(true);
+            m_authenticateAction->setEnabled(false);
+            m_sessionIdAction->setEnabled(false);
+            m_endSessionAction->setEnabled(false);
         }
-        else
+        else // finished, unknown
         {
-            m_startSessionAction->setText(tr("&Start private conversation"));
-            if (state == OTR_MESSAGESTATE_PLAINTEXT)
-            {
-                m_authenticateAction->setEnabled(false);
-                m_sessionIdAction->setEnabled(false);
-                m_endSessionAction->setEnabled(false);
-            }
-            else // finished, unknown
-            {
-                m_endSessionAction->setEnabled(true);
-                m_authenticateAction->setEnabled(false);
-                m_sessionIdAction->setEnabled(false);
-            }
+            m_endSessionAction->setEnabled(true);
+            m_authenticateAction->setEnabled(false);
+            m_sessionIdAction->setEnabled(false);
         }
+    }
 
-        if (m_otr->getPolicy() < OTR_POLICY_ENABLED)
-        {
-            m_startSessionAction->setEnabled(false);
-            m_endSessionAction->setEnabled(false);
-        }
+    if (policy < OTR_POLICY_ENABLED)
+    {
+        m_startSessionAction->setEnabled(false);
+        m_endSessionAction->setEnabled(false);
     }
 }
 
@@ -161,7 +209,7 @@ void OtrStateWidget::authenticateContact(bool)
 
 void OtrStateWidget::sessionID(bool)
 {
-    QString sId = m_otr->getSessionId(m_account, m_contact);
+    QString sId = m_otr->getSessionSnapshot(m_account, m_contact).sessionId();
     QString msg;
 
     if (sId.isEmpty())
@@ -185,7 +233,7 @@ void OtrStateWidget::endSession(bool b)
 {
     Q_UNUSED(b);
     m_otr->endSession(m_account, m_contact);
-    onUpdateMessageState(FWindow->streamJid(),FWindow->contactJid());
+    refreshState();
 }
 
 //-----------------------------------------------------------------------------
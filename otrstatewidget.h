@@ -18,9 +18,20 @@ public:
 	OtrStateWidget(OtrCallback* callback, OtrMessaging* otrc, IMessageWindow *AWindow,
 		         const QString &account, const QString &contact, QWidget *AParent);
 	~OtrStateWidget();
+	const QString &account() const;
+	const QString &contact() const;
+	IMessageWindow *messageWindow() const;
+	// Changes the conversation shown, e.g. after the window address changed
+	void setSession(const QString &account, const QString &contact);
+	// Shows ASnapshot, which the caller has read for account() and contact()
+	void updateState(const SessionSnapshot &ASnapshot);
+	// Rereads the state on the next event loop iteration, once per burst
+	void refreshState();
+signals:
+	void addressChanged();
 protected slots:
 	void onWindowAddressChanged(const Jid &AStreamBefore, const Jid &AContactBefore);
-	void onUpdateMessageState(const Jid &AStreamJid, const Jid &AContactJid);
+	void onRefreshTimeout();
 protected slots:
     void initiateSession(bool b);
     void endSession(bool b);
@@ -33,6 +44,10 @@ private:
     QString       m_account;
     QString       m_contact;
 	IMessageWindow *FWindow;
+	SessionSnapshot m_shownState;
+	OtrPolicy      m_shownPolicy;
+	bool           m_stateShown;
+	bool           m_refreshQueued;
 private:
 	Menu *FMenu;
     Action*       m_authenticateAction;
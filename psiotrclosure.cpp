@@ -147,7 +147,8 @@ AuthenticationDialog::AuthenticationDialog(OtrMessaging* otrc,
     QLabel* authenticatedLabel = NULL;
     if (m_isSender)
     {
-        if (m_otr->isVerified(m_account, m_contact))
+        SessionSnapshot snapshot = m_otr->getSessionSnapshot(m_account, m_contact);
+        if (snapshot.isVerified())
         {
             authenticatedLabel = new QLabel(QString("<b>%1</b>")
                                              .arg(tr("This contact is already "
@@ -159,7 +160,7 @@ AuthenticationDialog::AuthenticationDialog(OtrMessaging* otrc,
                             tr("No private key for account \"%1\"")
                               .arg(m_otr->humanAccount(m_account)));
 
-        m_fpr = m_otr->getActiveFingerprint(m_account, m_contact);
+        m_fpr = snapshot.activeFingerprint();
 
         QLabel* fprExplanationLabel = new QLabel(fprExplanation, this);
         fprExplanationLabel->setWordWrap(true);
@@ -421,10 +422,11 @@ void AuthenticationDialog::updateSMP(int progress)
             m_otr->stateChange(m_account, m_contact,
                                psiotr::OTR_STATECHANGE_TRUST);
         }
-        if (m_otr->smpSucceeded(m_account, m_contact))
+        SessionSnapshot snapshot = m_otr->getSessionSnapshot(m_account, m_contact);
+        if (snapshot.smpSucceeded())
         {
             m_state = AUTH_FINISHED;
-            if (m_otr->isVerified(m_account, m_contact))
+            if (snapshot.isVerified())
             {
                 notify(QMessageBox::Information,
                        tr("Authentication successful."));
@@ -470,7 +472,6 @@ PsiOtrClosure::PsiOtrClosure(const QString& account, const QString& contact,
     : m_otr(otrc),
       m_account(account),
       m_contact(contact),
-      m_isLoggedIn(false),
       m_authDialog(0)
 {
 }
@@ -546,16 +547,9 @@ void PsiOtrClosure::finishAuth()
 
 //-----------------------------------------------------------------------------
 
-void PsiOtrClosure::setIsLoggedIn(bool isLoggedIn)
+bool PsiOtrClosure::authenticating() const
 {
-    m_isLoggedIn = isLoggedIn;
-}
-
-//-----------------------------------------------------------------------------
-
-bool PsiOtrClosure::isLoggedIn() const
-{
-    return m_isLoggedIn;
+    return m_authDialog != 0;
 }
 
 //-----------------------------------------------------------------------------
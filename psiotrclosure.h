@@ -103,9 +103,8 @@ public:
     PsiOtrClosure(const QString& account, const QString& contact,
                   OtrMessaging* otrc);
     ~PsiOtrClosure();
-    void setIsLoggedIn(bool isLoggedIn);
-    bool isLoggedIn() const;
     bool encrypted() const;
+    bool authenticating() const;
     void receivedSMP(const QString& question);
     void updateSMP(int progress);
     void authenticateContact();
@@ -114,7 +113,6 @@ private:
     OtrMessaging* m_otr;
     QString       m_account;
     QString       m_contact;
-    bool          m_isLoggedIn;
     AuthenticationDialog* m_authDialog;
 
 public slots:
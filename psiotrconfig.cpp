@@ -21,6 +21,7 @@
  */
 
 #include "psiotrconfig.h"
+#include "otrmetrics.h"
 //#include "optionaccessinghost.h"
 //#include "accountinfoaccessinghost.h"
 #include <utils/pluginhelper.h> // xnamed!
@@ -41,11 +42,21 @@
 #include <QPushButton>
 #include <QComboBox>
 #include <QCheckBox>
+#include <QSpinBox>
 #include <QRadioButton>
 #include <QMenu>
 #include <QClipboard>
 #include <QApplication>
 #include <QPoint>
+#include <QPair>
+#include <QDialog>
+#include <QDialogButtonBox>
+#include <QPlainTextEdit>
+#include <QFileDialog>
+#include <QFile>
+#include <QVector>
+
+#include <algorithm>
 
 //-----------------------------------------------------------------------------
 
@@ -65,18 +76,17 @@ ConfigDialog::ConfigDialog(OtrMessaging* otr, OtrCallback* optionHost,
                            QWidget* parent)
     : QWidget(parent),
       m_otr(otr),
+      m_metricsView(NULL),
       FOptionsManager(PluginHelper::pluginInstance<IOptionsManager>()),
       FAccountManager(PluginHelper::pluginInstance<IAccountManager>())
 {
-    Q_UNUSED(optionHost);
-
     QVBoxLayout* mainLayout = new QVBoxLayout(this);
     QTabWidget* tabWidget = new QTabWidget(this);
 
-    tabWidget->addTab(new FingerprintWidget(m_otr, tabWidget),
+    tabWidget->addTab(new FingerprintWidget(m_otr, optionHost, tabWidget),
                       tr("Known fingerprints"));
 
-    tabWidget->addTab(new PrivKeyWidget(m_otr, tabWidget),
+    tabWidget->addTab(new PrivKeyWidget(m_otr, optionHost, tabWidget),
                       tr("My private keys"));
 
     //tabWidget->addTab(new ConfigOtrWidget(m_optionHost, m_otr, tabWidget),
@@ -127,6 +137,28 @@ ConfigOtrWidget::ConfigOtrWidget(
 
     m_endWhenOffline = new QCheckBox(tr("End session when contact goes offline"), this);
 
+    m_generateKeys = new QCheckBox(tr("Generate missing private keys in the background"), this);
+
+    m_prewarmSessions = new QCheckBox(tr("Start private conversations with known OTR contacts in advance"), this);
+
+    QHBoxLayout* fragmentLayout = new QHBoxLayout();
+    fragmentLayout->addWidget(new QLabel(tr("Split encrypted messages longer than"), this));
+    m_maxMessageSize = new QSpinBox(this);
+    m_maxMessageSize->setRange(0, 1024 * 1024);
+    m_maxMessageSize->setSingleStep(1024);
+    m_maxMessageSize->setSuffix(tr(" bytes"));
+    m_maxMessageSize->setSpecialValueText(tr("never"));
+    fragmentLayout->addWidget(m_maxMessageSize);
+    fragmentLayout->addStretch();
+
+    m_collectMetrics = new QCheckBox(tr("Collect performance metrics"), this);
+    QPushButton* metricsButton = new QPushButton(tr("Show metrics..."), this);
+    connect(metricsButton, SIGNAL(clicked()), SLOT(showMetrics()));
+    QHBoxLayout* metricsLayout = new QHBoxLayout();
+    metricsLayout->addWidget(m_collectMetrics);
+    metricsLayout->addStretch();
+    metricsLayout->addWidget(metricsButton);
+
 
     m_policy->addButton(polDisable, OTR_POLICY_OFF);
     m_policy->addButton(polEnable,  OTR_POLICY_ENABLED);
@@ -141,6 +173,10 @@ ConfigOtrWidget::ConfigOtrWidget(
 
     layout->addWidget(policyGroup);
     layout->addWidget(m_endWhenOffline);
+    layout->addWidget(m_generateKeys);
+    layout->addWidget(m_prewarmSessions);
+    layout->addLayout(fragmentLayout);
+    layout->addLayout(metricsLayout);
     layout->addStretch();
 
     setLayout(layout);
@@ -164,6 +200,14 @@ ConfigOtrWidget::ConfigOtrWidget(
 
     m_endWhenOffline->setChecked(endWhenOfflineOption);
 
+    m_generateKeys->setChecked(Options::node(OPTION_GENERATE_KEYS).value().toBool());
+
+    m_prewarmSessions->setChecked(Options::node(OPTION_PREWARM_SESSIONS).value().toBool());
+
+    m_maxMessageSize->setValue(Options::node(OPTION_MAX_MESSAGE_SIZE).value().toInt());
+
+    m_collectMetrics->setChecked(Options::node(OPTION_COLLECT_METRICS).value().toBool());
+
     updateOptions();
 
     connect(m_policy, SIGNAL(buttonClicked(int)),
@@ -171,6 +215,18 @@ ConfigOtrWidget::ConfigOtrWidget(
 
     connect(m_endWhenOffline, SIGNAL(stateChanged(int)),
             SLOT(updateOptions()));
+
+    connect(m_generateKeys, SIGNAL(stateChanged(int)),
+            SLOT(updateOptions()));
+
+    connect(m_prewarmSessions, SIGNAL(stateChanged(int)),
+            SLOT(updateOptions()));
+
+    connect(m_maxMessageSize, SIGNAL(valueChanged(int)),
+            SLOT(updateOptions()));
+
+    connect(m_collectMetrics, SIGNAL(stateChanged(int)),
+            SLOT(updateOptions()));
 }
 
 // ---------------------------------------------------------------------------
@@ -187,17 +243,414 @@ void ConfigOtrWidget::updateOptions()
     Options::node(OPTION_POLICY).setValue(static_cast<int>(policy));
     Options::node(OPTION_END_WHEN_OFFLINE).setValue(
                                     m_endWhenOffline->checkState() == Qt::Checked);
+    Options::node(OPTION_GENERATE_KEYS).setValue(
+                                    m_generateKeys->checkState() == Qt::Checked);
+    Options::node(OPTION_PREWARM_SESSIONS).setValue(
+                                    m_prewarmSessions->checkState() == Qt::Checked);
+    Options::node(OPTION_MAX_MESSAGE_SIZE).setValue(m_maxMessageSize->value());
+    Options::node(OPTION_COLLECT_METRICS).setValue(
+                                    m_collectMetrics->checkState() == Qt::Checked);
     m_otr->setPolicy(policy);
+    m_otr->metrics()->setEnabled(m_collectMetrics->checkState() == Qt::Checked);
+}
+
+// ---------------------------------------------------------------------------
+
+void ConfigOtrWidget::showMetrics()
+{
+    QDialog dialog(this);
+    dialog.setWindowTitle(tr("OTR Metrics"));
+
+    QPlainTextEdit* text = new QPlainTextEdit(m_otr->metrics()->report(), &dialog);
+    text->setReadOnly(true);
+    text->setFont(QFont("Monospace"));
+    text->setLineWrapMode(QPlainTextEdit::NoWrap);
+
+    QDialogButtonBox* buttons = new QDialogButtonBox(QDialogButtonBox::Save |
+                                                     QDialogButtonBox::Reset |
+                                                     QDialogButtonBox::Close,
+                                                     Qt::Horizontal, &dialog);
+    connect(buttons, SIGNAL(rejected()), &dialog, SLOT(reject()));
+    connect(buttons->button(QDialogButtonBox::Save), SIGNAL(clicked()),
+            SLOT(saveMetrics()));
+    connect(buttons->button(QDialogButtonBox::Reset), SIGNAL(clicked()),
+            SLOT(resetMetrics()));
+
+    QVBoxLayout* layout = new QVBoxLayout(&dialog);
+    layout->addWidget(text);
+    layout->addWidget(buttons);
+    dialog.resize(600, 400);
+
+    m_metricsView = text;
+    dialog.exec();
+    m_metricsView = NULL;
+}
+
+// ---------------------------------------------------------------------------
+
+void ConfigOtrWidget::resetMetrics()
+{
+    m_otr->metrics()->reset();
+    if (m_metricsView)
+    {
+        m_metricsView->setPlainText(m_otr->metrics()->report());
+    }
+}
+
+// ---------------------------------------------------------------------------
+
+void ConfigOtrWidget::saveMetrics()
+{
+    QWidget* parent = qobject_cast<QWidget*>(sender());
+    QString fileName = QFileDialog::getSaveFileName(parent? parent->window() : this,
+                                                    tr("Save OTR Metrics"),
+                                                    "otr-metrics.json",
+                                                    tr("JSON files (*.json)"));
+    if (fileName.isEmpty())
+    {
+        return;
+    }
+
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) ||
+        file.write(m_otr->metrics()->toJson()) < 0)
+    {
+        QMessageBox::warning(this, tr("Psi OTR"),
+                             tr("Could not write %1.").arg(fileName));
+    }
+}
+
+//=============================================================================
+
+namespace {
+
+// Rows handed to the view per fetchMore() call
+const int FINGERPRINT_FETCH_BATCH = 256;
+
+}
+
+//-----------------------------------------------------------------------------
+
+FingerprintModel::FingerprintModel(OtrMessaging* otr, QObject* parent)
+    : QAbstractTableModel(parent),
+      m_otr(otr),
+      m_fingerprints(),
+      m_pendingAccounts(),
+      m_fetched(0),
+      m_sortColumn(-1),
+      m_sortOrder(Qt::AscendingOrder)
+{
+}
+
+//-----------------------------------------------------------------------------
+
+void FingerprintModel::reload()
+{
+    beginResetModel();
+    m_humanAccounts.clear();
+    m_fingerprints.clear();
+    m_pendingAccounts = m_otr->getFingerprintAccounts();
+    m_fetched = 0;
+    endResetModel();
+
+    if (m_sortColumn >= 0)
+    {
+        sort(m_sortColumn, m_sortOrder);
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+const Fingerprint& FingerprintModel::fingerprint(int row) const
+{
+    return m_fingerprints.at(row);
+}
+
+//-----------------------------------------------------------------------------
+
+int FingerprintModel::rowCount(const QModelIndex& parent) const
+{
+    return parent.isValid()? 0 : m_fetched;
+}
+
+//-----------------------------------------------------------------------------
+
+int FingerprintModel::columnCount(const QModelIndex& parent) const
+{
+    return parent.isValid()? 0 : ColumnCount;
+}
+
+//-----------------------------------------------------------------------------
+
+QVariant FingerprintModel::data(const QModelIndex& index, int role) const
+{
+    if (role != Qt::DisplayRole || !index.isValid() || index.row() >= m_fetched)
+    {
+        return QVariant();
+    }
+    // The status is read here, so only rows that are shown cost a lookup
+    return text(m_fingerprints.at(index.row()), index.column());
+}
+
+//-----------------------------------------------------------------------------
+
+QVariant FingerprintModel::headerData(int section, Qt::Orientation orientation,
+                                      int role) const
+{
+    if (orientation == Qt::Horizontal && role == Qt::DisplayRole)
+    {
+        switch (section)
+        {
+            case AccountColumn:
+                return tr("Account");
+            case UserColumn:
+                return tr("User");
+            case FingerprintColumn:
+                return tr("Fingerprint");
+            case VerifiedColumn:
+                return tr("Verified");
+            case StatusColumn:
+                return tr("Status");
+        }
+    }
+    return QAbstractTableModel::headerData(section, orientation, role);
+}
+
+//-----------------------------------------------------------------------------
+
+bool FingerprintModel::canFetchMore(const QModelIndex& parent) const
+{
+    return !parent.isValid() &&
+           (m_fetched < m_fingerprints.size() || !m_pendingAccounts.isEmpty());
+}
+
+//-----------------------------------------------------------------------------
+
+void FingerprintModel::fetchMore(const QModelIndex& parent)
+{
+    if (!canFetchMore(parent))
+    {
+        return;
+    }
+    while (m_fetched == m_fingerprints.size() && !m_pendingAccounts.isEmpty())
+    {
+        loadAccount();
+    }
+    int count = qMin(m_fingerprints.size() - m_fetched, FINGERPRINT_FETCH_BATCH);
+    if (count == 0)
+    {
+        return;
+    }
+    beginInsertRows(QModelIndex(), m_fetched, m_fetched + count - 1);
+    m_fetched += count;
+    endInsertRows();
+}
+
+//-----------------------------------------------------------------------------
+
+void FingerprintModel::sort(int column, Qt::SortOrder order)
+{
+    m_sortColumn = column;
+    m_sortOrder  = order;
+    if (column < 0 || column >= ColumnCount)
+    {
+        return;
+    }
+
+    // An order over all rows needs all of them
+    loadAllAccounts();
+
+    emit layoutAboutToBeChanged();
+
+    // Every key is computed once, then the snapshot is permuted. The
+    // status is looked up as a state and translated once per state.
+    QHash<int, QString> stateNames;
+    QVector< QPair<QString, int> > keys;
+    keys.reserve(m_fingerprints.size());
+    for (int i = 0; i < m_fingerprints.size(); i++)
+    {
+        const Fingerprint& fp = m_fingerprints.at(i);
+        if (column == StatusColumn)
+        {
+            int state = m_otr->getMessageState(fp.account, fp.username);
+            QHash<int, QString>::const_iterator it = stateNames.constFind(state);
+            if (it == stateNames.constEnd())
+            {
+                it = stateNames.insert(state, text(fp, column));
+            }
+            keys.append(qMakePair(it.value(), i));
+        }
+        else
+        {
+            keys.append(qMakePair(text(fp, column), i));
+        }
+    }
+    std::sort(keys.begin(), keys.end());
+
+    int size = keys.size();
+    QVector<int> newRows(size);
+    QList<Fingerprint> sorted;
+    sorted.reserve(size);
+    for (int i = 0; i < size; i++)
+    {
+        int oldRow = keys.at(order == Qt::AscendingOrder? i : size - 1 - i).second;
+        newRows[oldRow] = i;
+        sorted.append(m_fingerprints.at(oldRow));
+    }
+    m_fingerprints = sorted;
+
+    QModelIndexList oldIndexes = persistentIndexList();
+    QModelIndexList newIndexes;
+    foreach (const QModelIndex& oldIndex, oldIndexes)
+    {
+        newIndexes.append(index(newRows.at(oldIndex.row()), oldIndex.column()));
+    }
+    changePersistentIndexList(oldIndexes, newIndexes);
+
+    emit layoutChanged();
+}
+
+//-----------------------------------------------------------------------------
+
+void FingerprintModel::updateContact(const QString& account, const QString& contact)
+{
+    // A pending account is read with its current fingerprints later
+    if (m_pendingAccounts.contains(account))
+    {
+        return;
+    }
+
+    QList<Fingerprint> current = m_otr->getFingerprints(account, contact);
+
+    // Backwards, so a removal does not move the rows still to be visited
+    for (int row = m_fingerprints.size() - 1; row >= 0; row--)
+    {
+        const Fingerprint& fp = m_fingerprints.at(row);
+        if (fp.account != account || fp.username != contact)
+        {
+            continue;
+        }
+
+        int i = 0;
+        while (i < current.size() &&
+               current.at(i).fingerprintHuman != fp.fingerprintHuman)
+        {
+            i++;
+        }
+
+        if (i == current.size())
+        {
+            removeFingerprint(row);
+        }
+        else
+        {
+            m_fingerprints[row] = current.takeAt(i);
+            if (row < m_fetched)
+            {
+                emit dataChanged(index(row, 0), index(row, ColumnCount - 1));
+            }
+        }
+    }
+
+    foreach (const Fingerprint& fp, current)
+    {
+        appendFingerprint(fp);
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+QString FingerprintModel::text(const Fingerprint& fp, int column) const
+{
+    switch (column)
+    {
+        case AccountColumn:
+            return humanAccount(fp.account);
+        case UserColumn:
+            return fp.username;
+        case FingerprintColumn:
+            return fp.fingerprintHuman;
+        case VerifiedColumn:
+            return fp.trust;
+        case StatusColumn:
+            return m_otr->getMessageStateString(fp.account, fp.username);
+    }
+    return QString();
+}
+
+//-----------------------------------------------------------------------------
+
+QString FingerprintModel::humanAccount(const QString& account) const
+{
+    QHash<QString, QString>::const_iterator it = m_humanAccounts.constFind(account);
+    if (it == m_humanAccounts.constEnd())
+    {
+        it = m_humanAccounts.insert(account, m_otr->humanAccount(account));
+    }
+    return it.value();
+}
+
+//-----------------------------------------------------------------------------
+
+void FingerprintModel::loadAccount()
+{
+    // Appended beyond the fetched rows, fetchMore() hands them out
+    m_fingerprints += m_otr->getFingerprints(m_pendingAccounts.takeFirst());
+}
+
+//-----------------------------------------------------------------------------
+
+void FingerprintModel::loadAllAccounts()
+{
+    while (!m_pendingAccounts.isEmpty())
+    {
+        loadAccount();
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+void FingerprintModel::appendFingerprint(const Fingerprint& fp)
+{
+    // Rows beyond the fetched ones are handed out by fetchMore()
+    if (m_fetched == m_fingerprints.size())
+    {
+        beginInsertRows(QModelIndex(), m_fetched, m_fetched);
+        m_fingerprints.append(fp);
+        m_fetched++;
+        endInsertRows();
+    }
+    else
+    {
+        m_fingerprints.append(fp);
+    }
+}
+
+//-----------------------------------------------------------------------------
+
+void FingerprintModel::removeFingerprint(int row)
+{
+    if (row < m_fetched)
+    {
+        beginRemoveRows(QModelIndex(), row, row);
+        m_fingerprints.removeAt(row);
+        m_fetched--;
+        endRemoveRows();
+    }
+    else
+    {
+        m_fingerprints.removeAt(row);
+    }
 }
 
 //=============================================================================
 
-FingerprintWidget::FingerprintWidget(OtrMessaging* otr, QWidget* parent)
+FingerprintWidget::FingerprintWidget(OtrMessaging* otr, OtrCallback* callback,
+                                     QWidget* parent)
     : QWidget(parent),
       m_otr(otr),
       m_table(new QTableView(this)),
-      m_tableModel(new QStandardItemModel(this)),
-      m_fingerprints()
+      m_model(new FingerprintModel(otr, this))
 {
     QVBoxLayout* mainLayout = new QVBoxLayout(this);
 
@@ -205,6 +658,10 @@ FingerprintWidget::FingerprintWidget(OtrMessaging* otr, QWidget* parent)
     m_table->setEditTriggers(0);
     m_table->setSelectionBehavior(QAbstractItemView::SelectRows);
     m_table->setContextMenuPolicy(Qt::CustomContextMenu);
+    m_table->setModel(m_model);
+    // Unsorted until a header is clicked, so opening the table does not
+    // load the fingerprints of every account
+    m_table->horizontalHeader()->setSortIndicator(-1, Qt::AscendingOrder);
     m_table->setSortingEnabled(true);
 
     connect(m_table, SIGNAL(customContextMenuRequested(const QPoint&)), SLOT(contextMenu(const QPoint&)));
@@ -223,6 +680,12 @@ FingerprintWidget::FingerprintWidget(OtrMessaging* otr, QWidget* parent)
 
     setLayout(mainLayout);
 
+    if (callback)
+    {
+        connect(callback->instance(), SIGNAL(contactFingerprintsChanged(const QString&, const QString&)),
+                m_model, SLOT(updateContact(const QString&, const QString&)));
+    }
+
     updateData();
 }
 
@@ -230,42 +693,21 @@ FingerprintWidget::FingerprintWidget(OtrMessaging* otr, QWidget* parent)
 
 void FingerprintWidget::updateData()
 {
-    int sortSection         = m_table->horizontalHeader()->sortIndicatorSection();
-    Qt::SortOrder sortOrder = m_table->horizontalHeader()->sortIndicatorOrder();
+    m_model->reload();
+    m_table->resizeColumnsToContents();
+}
 
-    m_tableModel->clear();
-    m_tableModel->setColumnCount(5);
-    m_tableModel->setHorizontalHeaderLabels(QStringList() << tr("Account")
-                                            << tr("User") << tr("Fingerprint")
-                                            << tr("Verified") << tr("Status"));
+//-----------------------------------------------------------------------------
 
-    m_fingerprints = m_otr->getFingerprints();
-    QListIterator<Fingerprint> fingerprintIt(m_fingerprints);
-    int fpIndex = 0;
-    while(fingerprintIt.hasNext())
+QList<Fingerprint> FingerprintWidget::selectedFingerprints() const
+{
+    // Copied, as verifying or deleting one changes the rows of the model
+    QList<Fingerprint> fingerprints;
+    foreach(QModelIndex selectIndex, m_table->selectionModel()->selectedRows())
     {
-        QList<QStandardItem*> row;
-        Fingerprint fp = fingerprintIt.next();
-
-        QStandardItem* item = new QStandardItem(m_otr->humanAccount(fp.account));
-        item->setData(QVariant(fpIndex));
-
-        row.append(item);
-        row.append(new QStandardItem(fp.username));
-        row.append(new QStandardItem(fp.fingerprintHuman));
-        row.append(new QStandardItem(fp.trust));
-        row.append(new QStandardItem(m_otr->getMessageStateString(fp.account,
-                                                                  fp.username)));
-
-        m_tableModel->appendRow(row);
-
-        fpIndex++;
+        fingerprints.append(m_model->fingerprint(selectIndex.row()));
     }
-
-    m_table->setModel(m_tableModel);
-
-    m_table->sortByColumn(sortSection, sortOrder);
-    m_table->resizeColumnsToContents();
+    return fingerprints;
 }
 
 //-----------------------------------------------------------------------------
@@ -277,14 +719,12 @@ void FingerprintWidget::deleteFingerprint()
     {
         return;
     }
-    foreach(QModelIndex selectIndex, m_table->selectionModel()->selectedRows())
+    foreach(const Fingerprint& fp, selectedFingerprints())
     {
-        int fpIndex = m_tableModel->item(selectIndex.row(), 0)->data().toInt();
-
         QString msg(tr("Are you sure you want to delete the following fingerprint?") + "\n\n" +
-                    tr("Account: ") + m_otr->humanAccount(m_fingerprints[fpIndex].account) + "\n" +
-                    tr("User: ") + m_fingerprints[fpIndex].username + "\n" +
-                    tr("Fingerprint: ") + m_fingerprints[fpIndex].fingerprintHuman);
+                    tr("Account: ") + m_otr->humanAccount(fp.account) + "\n" +
+                    tr("User: ") + fp.username + "\n" +
+                    tr("Fingerprint: ") + fp.fingerprintHuman);
 
         QMessageBox mb(QMessageBox::Question, tr("Psi OTR"), msg,
                        QMessageBox::Yes | QMessageBox::No, this,
@@ -292,10 +732,9 @@ void FingerprintWidget::deleteFingerprint()
 
         if (mb.exec() == QMessageBox::Yes)
         {
-            m_otr->deleteFingerprint(m_fingerprints[fpIndex]);
+            m_otr->deleteFingerprint(fp);
         }
     }
-    updateData();
 }
 
 //-----------------------------------------------------------------------------
@@ -306,23 +745,19 @@ void FingerprintWidget::verifyFingerprint()
     {
         return;
     }
-    foreach(QModelIndex selectIndex, m_table->selectionModel()->selectedRows())
+    foreach(const Fingerprint& fp, selectedFingerprints())
     {
-        int fpIndex = m_tableModel->item(selectIndex.row(), 0)->data().toInt();
-
         QString msg(tr("Have you verified that this is in fact the correct fingerprint?") + "\n\n" +
-                    tr("Account: ") + m_otr->humanAccount(m_fingerprints[fpIndex].account) + "\n" +
-                    tr("User: ") + m_fingerprints[fpIndex].username + "\n" +
-                    tr("Fingerprint: ") + m_fingerprints[fpIndex].fingerprintHuman);
+                    tr("Account: ") + m_otr->humanAccount(fp.account) + "\n" +
+                    tr("User: ") + fp.username + "\n" +
+                    tr("Fingerprint: ") + fp.fingerprintHuman);
 
         QMessageBox mb(QMessageBox::Question, tr("Psi OTR"), msg,
                        QMessageBox::Yes | QMessageBox::No, this,
                        Qt::Dialog | Qt::MSWindowsFixedSizeDialogHint);
 
-        m_otr->verifyFingerprint(m_fingerprints[fpIndex],
-                                 (mb.exec() == QMessageBox::Yes));
+        m_otr->verifyFingerprint(fp, (mb.exec() == QMessageBox::Yes));
     }
-    updateData();
 }
 
 //-----------------------------------------------------------------------------
@@ -334,15 +769,13 @@ void FingerprintWidget::copyFingerprint()
         return;
     }
     QString text;
-    foreach(QModelIndex selectIndex, m_table->selectionModel()->selectedRows(1))
+    foreach(const Fingerprint& fp, selectedFingerprints())
     {
-        int fpIndex = m_tableModel->item(selectIndex.row(), 0)->data().toInt();
-
         if (!text.isEmpty())
         {
             text += "\n";
         }
-        text += m_fingerprints[fpIndex].fingerprintHuman;
+        text += fp.fingerprintHuman;
     }
     QClipboard* clipboard = QApplication::clipboard();
     clipboard->setText(text);
@@ -371,7 +804,8 @@ void FingerprintWidget::contextMenu(const QPoint& pos)
 
 //PrivKeyWidget::PrivKeyWidget(AccountInfoAccessingHost* accountInfo,
 //                             OtrMessaging* otr, QWidget* parent)
-PrivKeyWidget::PrivKeyWidget(OtrMessaging* otr, QWidget* parent)
+PrivKeyWidget::PrivKeyWidget(OtrMessaging* otr, OtrCallback* callback,
+                             QWidget* parent)
     : QWidget(parent),
       //m_accountInfo(accountInfo),
       m_otr(otr),
@@ -431,6 +865,12 @@ PrivKeyWidget::PrivKeyWidget(OtrMessaging* otr, QWidget* parent)
     m_table->setContextMenuPolicy(Qt::CustomContextMenu);
     connect(m_table, SIGNAL(customContextMenuRequested(const QPoint&)), SLOT(contextMenu(const QPoint&)));
 
+    if (callback)
+    {
+        connect(callback->instance(), SIGNAL(privateKeysChanged(const QString&)),
+                SLOT(onPrivateKeysChanged(const QString&)));
+    }
+
     updateData();
 }
 
@@ -475,10 +915,17 @@ void PrivKeyWidget::deleteKey()
     {
         return;
     }
+    // Deleting a key rebuilds the table through onPrivateKeysChanged()
+    QList< QPair<QString, QString> > keys;
     foreach(QModelIndex selectIndex, m_table->selectionModel()->selectedRows(1))
     {
-        QString fpr(m_tableModel->item(selectIndex.row(), 1)->text());
-        QString account(m_tableModel->item(selectIndex.row(), 0)->data().toString());
+        keys.append(qMakePair(m_tableModel->item(selectIndex.row(), 0)->data().toString(),
+                              m_tableModel->item(selectIndex.row(), 1)->text()));
+    }
+    for (int i = 0; i < keys.size(); i++)
+    {
+        QString account(keys.at(i).first);
+        QString fpr(keys.at(i).second);
 
         QString msg(tr("Are you sure you want to delete the following key?") + "\n\n" +
                     tr("Account: ") + m_otr->humanAccount(account) + "\n" +
@@ -493,7 +940,6 @@ void PrivKeyWidget::deleteKey()
             m_otr->deleteKey(account);
         }
     }
-    updateData();
 }
 
 //-----------------------------------------------------------------------------
@@ -526,9 +972,9 @@ void PrivKeyWidget::generateKey()
         }
     }
 
+    // Generating runs in the background, the table is refreshed
+    // by onPrivateKeysChanged() once the key is stored.
     m_otr->generateKey(accountId);
-
-    updateData();
 }
 
 //-----------------------------------------------------------------------------
@@ -572,4 +1018,12 @@ void PrivKeyWidget::contextMenu(const QPoint& pos)
 
 //-----------------------------------------------------------------------------
 
+void PrivKeyWidget::onPrivateKeysChanged(const QString& account)
+{
+    Q_UNUSED(account);
+    updateData();
+}
+
+//-----------------------------------------------------------------------------
+
 } // namespace psiotr
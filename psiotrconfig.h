@@ -33,6 +33,7 @@
 
 #include <QWidget>
 #include <QVariant>
+#include <QAbstractTableModel>
 
 //class OptionAccessingHost;
 class OtrCallback;
@@ -42,6 +43,8 @@ class OtrCallback;
 class QButtonGroup;
 class QComboBox;
 class QCheckBox;
+class QSpinBox;
+class QPlainTextEdit;
 class QStandardItemModel;
 class QTableView;
 class QPoint;
@@ -57,6 +60,14 @@ const QString  OPTION_POLICY            = "otr-policy";
 const QVariant DEFAULT_POLICY           = QVariant(OTR_POLICY_ENABLED);
 const QString  OPTION_END_WHEN_OFFLINE  = "end-session-when-offline";
 const QVariant DEFAULT_END_WHEN_OFFLINE = QVariant(false);
+const QString  OPTION_GENERATE_KEYS     = "generate-missing-keys";
+const QVariant DEFAULT_GENERATE_KEYS    = QVariant(false);
+const QString  OPTION_COLLECT_METRICS   = "collect-metrics";
+const QVariant DEFAULT_COLLECT_METRICS  = QVariant(false);
+const QString  OPTION_MAX_MESSAGE_SIZE  = "max-message-size";
+const QVariant DEFAULT_MAX_MESSAGE_SIZE = QVariant(0);
+const QString  OPTION_PREWARM_SESSIONS  = "prewarm-sessions";
+const QVariant DEFAULT_PREWARM_SESSIONS = QVariant(false);
 
 // ---------------------------------------------------------------------------
 
@@ -113,10 +124,90 @@ private:
 
     QCheckBox*           m_endWhenOffline;
 
+    QCheckBox*           m_generateKeys;
+
+    QCheckBox*           m_prewarmSessions;
+
+    QCheckBox*           m_collectMetrics;
+
+    QSpinBox*            m_maxMessageSize;
+
+    /**
+     * Report in the metrics dialog while it is shown, otherwise NULL.
+     */
+    QPlainTextEdit*      m_metricsView;
+
     IOptionsManager *FOptionsManager;
 
 private slots:
     void updateOptions();
+    void showMetrics();
+    void saveMetrics();
+    void resetMetrics();
+};
+
+// ---------------------------------------------------------------------------
+
+/**
+ * Table of known fingerprints, backed by a snapshot of the fingerprint list.
+ * Accounts are loaded and rows are handed to the view in batches as it
+ * scrolls, and updated one contact at a time. Sorting loads all accounts.
+ */
+class FingerprintModel : public QAbstractTableModel
+{
+Q_OBJECT
+
+public:
+    enum Column
+    {
+        AccountColumn,
+        UserColumn,
+        FingerprintColumn,
+        VerifiedColumn,
+        StatusColumn,
+        ColumnCount
+    };
+
+    FingerprintModel(OtrMessaging* otr, QObject* parent = 0);
+
+    /**
+     * Replaces the snapshot with the current fingerprint list.
+     */
+    void reload();
+
+    const Fingerprint& fingerprint(int row) const;
+
+    virtual int rowCount(const QModelIndex& parent = QModelIndex()) const;
+    virtual int columnCount(const QModelIndex& parent = QModelIndex()) const;
+    virtual QVariant data(const QModelIndex& index, int role = Qt::DisplayRole) const;
+    virtual QVariant headerData(int section, Qt::Orientation orientation,
+                                int role = Qt::DisplayRole) const;
+    virtual bool canFetchMore(const QModelIndex& parent) const;
+    virtual void fetchMore(const QModelIndex& parent);
+    virtual void sort(int column, Qt::SortOrder order = Qt::AscendingOrder);
+
+public slots:
+    /**
+     * Rereads the fingerprints of a single contact.
+     */
+    void updateContact(const QString& account, const QString& contact);
+
+protected:
+    QString text(const Fingerprint& fp, int column) const;
+    QString humanAccount(const QString& account) const;
+    void loadAccount();
+    void loadAllAccounts();
+    void appendFingerprint(const Fingerprint& fp);
+    void removeFingerprint(int row);
+
+private:
+    OtrMessaging*                   m_otr;
+    QList<Fingerprint>              m_fingerprints;
+    QStringList                     m_pendingAccounts;
+    int                             m_fetched;
+    int                             m_sortColumn;
+    Qt::SortOrder                   m_sortOrder;
+    mutable QHash<QString, QString> m_humanAccounts;
 };
 
 // ---------------------------------------------------------------------------
@@ -129,16 +220,16 @@ class FingerprintWidget : public QWidget
 Q_OBJECT
 
 public:
-    FingerprintWidget(OtrMessaging* otr, QWidget* parent = 0);
+    FingerprintWidget(OtrMessaging* otr, OtrCallback* callback, QWidget* parent = 0);
 
 protected:
     void updateData();
+    QList<Fingerprint> selectedFingerprints() const;
 
 private:
     OtrMessaging*       m_otr;
     QTableView*         m_table;
-    QStandardItemModel* m_tableModel;
-    QList<Fingerprint>  m_fingerprints;
+    FingerprintModel*   m_model;
 
 private slots:
     void deleteFingerprint();
@@ -159,7 +250,7 @@ Q_OBJECT
 public:
 //    PrivKeyWidget(AccountInfoAccessingHost* accountInfo,
 //                  OtrMessaging* otr, QWidget* parent);
-    PrivKeyWidget(OtrMessaging* otr, QWidget* parent);
+    PrivKeyWidget(OtrMessaging* otr, OtrCallback* callback, QWidget* parent);
 
 protected:
     void updateData();
@@ -181,6 +272,7 @@ private slots:
     void generateKey();
     void copyFingerprint();
     void contextMenu(const QPoint& pos);
+    void onPrivateKeysChanged(const QString& account);
 };
 
 //-----------------------------------------------------------------------------
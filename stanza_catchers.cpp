@@ -3,10 +3,45 @@
 #include "stanza_catchers.h"
 #include <utils/logger.h>
 
-StanzaCatcher::StanzaCatcher(psiotr::OtrMessaging* otr, IAccountManager* AAccountJid, QObject *AParent):
+#include <QTimer>
+#include <QElapsedTimer>
+
+// Time after which processQueue() yields to the event loop
+static const int QUEUE_SLICE_MSECS = 20;
+// Stanzas decrypted between two looks at the clock
+static const int QUEUE_BATCH_SIZE = 16;
+// Messages held per conversation while its session is being started
+static const int HELD_MAX_PER_CONVERSATION = 32;
+// Time after which a held message is given up, long enough for a key
+// to be generated first
+static const int HELD_TIMEOUT_MSECS = 60 * 1000;
+
+// The body is read and replaced in the DOM of the stanza itself; wrapping
+// the stanza into a Message and assigning it back copies the document.
+static QDomElement bodyElement(Stanza &AStanza)
+{
+	return AStanza.firstElement("body");
+}
+
+static void setBodyText(QDomElement ABody, const QString &AText)
+{
+	QDomNode child = ABody.firstChild();
+	if (child.isText() && child.nextSibling().isNull())
+	{
+		child.toText().setData(AText);
+	}
+	else
+	{
+		while (!ABody.firstChild().isNull())
+			ABody.removeChild(ABody.firstChild());
+		ABody.appendChild(ABody.ownerDocument().createTextNode(AText));
+	}
+}
+
+StanzaCatcher::StanzaCatcher(psiotr::OtrMessaging* otr, OtrRoutingTable* ARoutes, QObject *AParent):
 	QObject(AParent),
 	m_otrConnection(otr),
-	m_accountJid(AAccountJid)
+	m_routes(ARoutes)
 {
 
 }
@@ -21,35 +56,35 @@ psiotr::OtrMessaging* StanzaCatcher::otr()
 	return m_otrConnection;
 }
 
-IAccountManager* StanzaCatcher::accountManager()
+OtrRoutingTable* StanzaCatcher::routes()
 {
-	return m_accountJid;
+	return m_routes;
 }
 
 bool StanzaCatcher::stanzaReadWrite(int AHandleId, const Jid &AStreamJid, Stanza &AStanza, bool &AAccept)
 {
-	Message message(AStanza);
-	if (message.type() != Message::Chat)
+	if (AStanza.type() != MESSAGE_TYPE_CHAT)
 		return false;
 
-	if (message.body().isEmpty())
+	if (bodyElement(AStanza).text().isEmpty())
 		return false;
 
-	if (message.stanza().attribute(SkipOtrCatcherFlag()) != "true")
+	if (AStanza.attribute(SkipOtrCatcherFlag()) != "true")
 	{
 		return stanzaEditImpl(AHandleId, AStreamJid, AStanza, AAccept);
 	}
 	else
 	{
-		message.stanza().element().removeAttribute("skip_otr_processing");
+		AStanza.element().removeAttribute(SkipOtrCatcherFlag());
 	}
 	return false;
 }
 
 //------------------------------------------------
 
-InboundStanzaCatcher::InboundStanzaCatcher(psiotr::OtrMessaging* otr, IAccountManager* AAccountJid, QObject* Aparent)
-	: StanzaCatcher(otr, AAccountJid, Aparent)
+InboundStanzaCatcher::InboundStanzaCatcher(psiotr::OtrMessaging* otr, OtrRoutingTable* ARoutes, QObject* Aparent)
+	: StanzaCatcher(otr, ARoutes, Aparent),
+	m_stanzaProcessor(PluginHelper::pluginInstance<IStanzaProcessor>())
 {
 
 }
@@ -59,12 +94,33 @@ bool InboundStanzaCatcher::stanzaEditImpl(int AHandleId, const Jid &AStreamJid,
 	Q_UNUSED(AHandleId);
 	Q_UNUSED(AAccept);
 
+	// Plain text which libotr would pass through unchanged, unless it
+	// would overtake stanzas of the same contact waiting in the queue
+	if (!otr()->needsDecryption(routes()->account(AStreamJid), AStanza.from(), bodyElement(AStanza).text()) &&
+	    !isQueued(AStreamJid, AStanza.from()))
+		return false;
+
+	if (m_stanzaProcessor)
+	{
+		// Hold the stanza until the end of this event loop iteration, so
+		// that a burst of messages (e.g. offline messages replayed after
+		// connecting) is decrypted as one batch.
+		if (m_queue.isEmpty())
+			QTimer::singleShot(0, this, SLOT(processQueue()));
+
+		QueuedStanza queued;
+		queued.streamJid = AStreamJid;
+		queued.stanza = AStanza;
+		m_queue.append(queued);
+		return true;
+	}
+
 	bool ignore = false;
-	Message message(AStanza);
+	QDomElement body = bodyElement(AStanza);
 
-	QString contact = message.from();
-	QString account = accountManager()->findAccountByStream(AStreamJid)->accountId();
-	QString plainBody = message.body();
+	QString contact = AStanza.from();
+	QString account = routes()->account(AStreamJid);
+	QString plainBody = body.text();
 
     QString decrypted;
     psiotr::OtrMessageType messageType = otr()->decryptMessage(
@@ -82,20 +138,100 @@ bool InboundStanzaCatcher::stanzaEditImpl(int AHandleId, const Jid &AStreamJid,
 
             bodyText = decrypted;
 
-			message.setBody(bodyText);
-			AStanza = message.stanza();
+			setBodyText(body, bodyText);
 			break;
 	}
 	return ignore;
 
 }
 
+bool InboundStanzaCatcher::isQueued(const Jid &AStreamJid, const QString &AContact) const
+{
+	foreach (const QueuedStanza &queued, m_queue)
+	{
+		if (queued.streamJid == AStreamJid && queued.stanza.from() == AContact)
+			return true;
+	}
+	return false;
+}
+
+void InboundStanzaCatcher::processQueue()
+{
+	// libotr runs on this thread, so a long backlog is handled in slices
+	// which leave the event loop time to repaint and read the socket.
+	QElapsedTimer slice;
+	slice.start();
+
+	while (!m_queue.isEmpty() && slice.elapsed() < QUEUE_SLICE_MSECS)
+	{
+		// The leading stanzas of one stream form a batch, so the order
+		// of arrival is kept across streams as well
+		Jid streamJid = m_queue.first().streamJid;
+		int count = 1;
+		while (count < m_queue.size() && count < QUEUE_BATCH_SIZE &&
+		       m_queue.at(count).streamJid == streamJid)
+			++count;
+
+		QList<QueuedStanza> queued = m_queue.mid(0, count);
+		m_queue.erase(m_queue.begin(), m_queue.begin() + count);
+
+		QList<psiotr::IncomingMessage> batch;
+		for (int i = 0; i < queued.size(); ++i)
+		{
+			Stanza &stanza = queued[i].stanza;
+			batch.append(psiotr::IncomingMessage(stanza.from(), bodyElement(stanza).text()));
+		}
+
+		// The stream closed while its stanzas were queued. Re-injected
+		// without the flag they would be queued again, with it they would
+		// pass undecrypted; they are dropped along with the stream.
+		QString account = routes()->account(streamJid);
+		if (account.isEmpty())
+		{
+			LOG_STRM_WARNING(streamJid,QString("OTR dropped queued stanzas of a closed stream, count=%1").arg(queued.size()));
+			continue;
+		}
+		otr()->decryptMessages(account, batch);
+
+		for (int i = 0; i < queued.size(); ++i)
+		{
+			Stanza &stanza = queued[i].stanza;
+			const psiotr::IncomingMessage &result = batch.at(i);
+
+			if (result.type == psiotr::OTR_MESSAGETYPE_IGNORE)
+				continue;
+
+			if (result.type == psiotr::OTR_MESSAGETYPE_OTR)
+				setBodyText(bodyElement(stanza), result.decrypted);
+
+			stanza.setAttribute(SkipOtrCatcherFlag(), "true");
+			m_stanzaProcessor->sendStanzaIn(streamJid, stanza);
+		}
+	}
+
+	if (!m_queue.isEmpty())
+		QTimer::singleShot(0, this, SLOT(processQueue()));
+}
+
 //------------------------------------------------
 
-OutboundStanzaCatcher::OutboundStanzaCatcher(psiotr::OtrMessaging* otr,IAccountManager* AAccountJid, QObject* Aparent)
-    : StanzaCatcher(otr, AAccountJid, Aparent)
+OutboundStanzaCatcher::OutboundStanzaCatcher(psiotr::OtrMessaging* otr, OtrRoutingTable* ARoutes, QObject* Aparent)
+    : StanzaCatcher(otr, ARoutes, Aparent),
+	m_stanzaProcessor(PluginHelper::pluginInstance<IStanzaProcessor>())
 {
+	// Prototypes of the hints added to encrypted messages
+	m_noCopy = m_hints.createElementNS("urn:xmpp:hints", "no-copy");
+	m_noStore = m_hints.createElementNS("urn:xmpp:hints", "no-permanent-store");
+	m_private = m_hints.createElementNS("urn:xmpp:carbons:2", "private");
+
+	m_heldTimer.setSingleShot(true);
+	connect(&m_heldTimer, SIGNAL(timeout()), SLOT(processHeld()));
+}
 
+void OutboundStanzaCatcher::appendHint(Stanza &AStanza, const QDomElement &AHint)
+{
+	if (AStanza.firstElement(AHint.tagName(), AHint.namespaceURI()).isNull())
+		AStanza.element().appendChild(AStanza.document().importNode(AHint, false));
 }
 
 bool OutboundStanzaCatcher::stanzaEditImpl(int AHandleId, const Jid &AStreamJid, Stanza &AStanza, bool &AAccept)
@@ -103,24 +239,55 @@ bool OutboundStanzaCatcher::stanzaEditImpl(int AHandleId, const Jid &AStreamJid,
 	Q_UNUSED(AHandleId);
 	Q_UNUSED(AAccept);
 
-	Message message(AStanza);
+	QString contact = AStanza.to();
+	QString account = routes()->account(AStreamJid);
 
-	QString contact = message.to();
-	QString account = accountManager()->findAccountByStream(AStreamJid)->accountId();
+	if (m_stanzaProcessor)
+	{
+		// libotr would refuse the message or keep only the last one until the
+		// session is encrypted, and a message sent during the AKE would leave
+		// in plain text; hold them all and send them at once from releaseHeld().
+		// Later messages queue up behind held ones to keep the order. Only a
+		// recently started AKE is waited for unless encryption is required.
+		psiotr::OtrMessageState state = otr()->getMessageState(account, contact);
+		bool insecure = state != psiotr::OTR_MESSAGESTATE_ENCRYPTED &&
+		                state != psiotr::OTR_MESSAGESTATE_FINISHED;
+		bool waiting = isHolding(account, contact);
+		bool negotiating = insecure && otr()->isNegotiating(account, contact);
+		bool required = insecure && otr()->getPolicy() == psiotr::OTR_POLICY_REQUIRE;
+
+		if (waiting || negotiating || required)
+		{
+			if (holdStanza(AStreamJid, account, contact, AStanza))
+			{
+				if (state == psiotr::OTR_MESSAGESTATE_ENCRYPTED)
+					releaseHeld(account, contact);
+				else if (required && !negotiating && !waiting)
+					otr()->startSession(account, contact);
+			}
+			return true;
+		}
+	}
+
+	return !encryptStanza(account, contact, AStanza);
+}
+
+bool OutboundStanzaCatcher::encryptStanza(const QString &AAccount, const QString &AContact, Stanza &AStanza)
+{
+	QDomElement body = bodyElement(AStanza);
 
 	QString encrypted = otr()->encryptMessage(
-		account,
-		contact,
-		message.body());
-	message.setBody(encrypted);
+		AAccount,
+		AContact,
+		body.text());
 
     //if there has been an error, drop the message
     if (encrypted.isEmpty())
     {
-        return true;
+        return false;
     }
 
-	AStanza = message.stanza();
+	setBodyText(body, encrypted);
 
 
 	/*if (!m_onlineUsers.value(account).contains(contact))
@@ -129,15 +296,116 @@ bool OutboundStanzaCatcher::stanzaEditImpl(int AHandleId, const Jid &AStreamJid,
 	                                                        m_otrConnection);
 	}*/
 	//if (m_onlineUsers[account][contact]->encrypted()) {
-	if (otr()->getMessageState(account, contact) == psiotr::OTR_MESSAGESTATE_ENCRYPTED) {
-	    if (AStanza.to().contains("/")) {
+	if (otr()->getMessageState(AAccount, AContact) == psiotr::OTR_MESSAGESTATE_ENCRYPTED) {
+	    if (AContact.contains("/")) {
 	        // if not a bare jid
-	        AStanza.document().appendChild(AStanza.document().createElementNS("urn:xmpp:hints" ,"no-copy")).toElement();
+	        appendHint(AStanza, m_noCopy);
 	    }
 
-	    AStanza.document().appendChild(AStanza.document().createElementNS("urn:xmpp:hints", "no-permanent-store")).toElement();
-	    AStanza.document().appendChild(AStanza.document().createElementNS("urn:xmpp:carbons:2", "private")).toElement();
+	    appendHint(AStanza, m_noStore);
+	    appendHint(AStanza, m_private);
 	}
 
+	return true;
+}
+
+bool OutboundStanzaCatcher::isHolding(const QString &AAccount, const QString &AContact) const
+{
+	QString bareContact = AContact.section('/', 0, 0);
+	foreach (const HeldStanza &held, m_held)
+	{
+		if (held.account == AAccount && held.contact.section('/', 0, 0) == bareContact)
+			return true;
+	}
 	return false;
 }
+
+bool OutboundStanzaCatcher::holdStanza(const Jid &AStreamJid, const QString &AAccount, const QString &AContact, const Stanza &AStanza)
+{
+	QString bareContact = AContact.section('/', 0, 0);
+
+	int count = 0;
+	foreach (const HeldStanza &held, m_held)
+	{
+		if (held.account == AAccount && held.contact.section('/', 0, 0) == bareContact)
+			++count;
+	}
+	if (count >= HELD_MAX_PER_CONVERSATION)
+	{
+		otr()->displayOtrMessage(AAccount, AContact,
+		                         tr("Too many messages are waiting for the private conversation "
+		                            "to start. The message was not sent."));
+		return false;
+	}
+
+	HeldStanza held;
+	held.streamJid = AStreamJid;
+	held.account = AAccount;
+	held.contact = AContact;
+	held.stanza = AStanza;
+	held.held.start();
+	held.released = false;
+	m_held.append(held);
+
+	if (!m_heldTimer.isActive())
+		m_heldTimer.start(HELD_TIMEOUT_MSECS);
+	return true;
+}
+
+void OutboundStanzaCatcher::releaseHeld(const QString &AAccount, const QString &AContact)
+{
+	// A message to the bare JID waits for the session with any resource
+	QString bareContact = AContact.section('/', 0, 0);
+
+	bool released = false;
+	for (QList<HeldStanza>::iterator it = m_held.begin(); it != m_held.end(); ++it)
+	{
+		if (it->account == AAccount && it->contact.section('/', 0, 0) == bareContact)
+		{
+			// Encrypted for the resource the session was started with
+			it->contact = AContact;
+			it->stanza.setTo(AContact);
+			it->released = true;
+			released = true;
+		}
+	}
+
+	// Called from within libotr, see OtrInternal::gone_secure()
+	if (released)
+		m_heldTimer.start(0);
+}
+
+void OutboundStanzaCatcher::processHeld()
+{
+	QList<HeldStanza> held = m_held;
+	m_held.clear();
+
+	for (int i = 0; i < held.size(); ++i)
+	{
+		HeldStanza &item = held[i];
+
+		if (!item.released && !item.held.hasExpired(HELD_TIMEOUT_MSECS))
+		{
+			m_held.append(item);
+			continue;
+		}
+
+		if (!item.released && otr()->getPolicy() == psiotr::OTR_POLICY_REQUIRE)
+		{
+			otr()->displayOtrMessage(item.account, item.contact,
+			                         tr("The private conversation could not be started. "
+			                            "The message was not sent:\n%1").arg(bodyElement(item.stanza).text()));
+			continue;
+		}
+
+		// Released, or given up waiting for an AKE which plain text need not wait for
+		if (encryptStanza(item.account, item.contact, item.stanza))
+		{
+			item.stanza.setAttribute(SkipOtrCatcherFlag(), "true");
+			m_stanzaProcessor->sendStanzaOut(item.streamJid, item.stanza);
+		}
+	}
+
+	if (!m_held.isEmpty())
+		m_heldTimer.start(qMax(0, HELD_TIMEOUT_MSECS - static_cast<int>(m_held.first().held.elapsed())));
+}
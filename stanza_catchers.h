@@ -7,9 +7,13 @@
 
 #include <utils/message.h>
 
+#include <QTimer>
+#include <QElapsedTimer>
+
 #include "otrmessaging.h"
+#include "otrroutingtable.h"
 
-class IAccountManager;
+class IStanzaProcessor;
 
 class StanzaCatcher:
     public QObject,
@@ -23,33 +27,92 @@ public:
 	}
 
 	//StanzaCatcher(psiotr::OtrMessaging* otr, IAccountManager* AAccountJid,QObject* Aparent);
-	StanzaCatcher(psiotr::OtrMessaging* otr, IAccountManager* AAccountJid,QObject* Aparent);
+	StanzaCatcher(psiotr::OtrMessaging* otr, OtrRoutingTable* ARoutes, QObject* Aparent);
 	//virtual QObject *instance() { return this; }
 	virtual QObject *instance();
 	virtual bool stanzaReadWrite(int AHandleId, const Jid &AStreamJid, Stanza &AStanza, bool &AAccept);
 
 protected:
 	psiotr::OtrMessaging* otr();
-	IAccountManager* accountManager();
+	OtrRoutingTable* routes();
 	virtual bool stanzaEditImpl(int AHandleId, const Jid &AStreamJid, Stanza &AStanza, bool &AAccept) = 0;
 
 private:
 	psiotr::OtrMessaging* m_otrConnection;
-	IAccountManager* m_accountJid;
+	OtrRoutingTable* m_routes;
 };
 
 class InboundStanzaCatcher: public StanzaCatcher
 {
+	Q_OBJECT
 public:
-	InboundStanzaCatcher(psiotr::OtrMessaging* otr, IAccountManager* AAccountJid, QObject* Aparent);
+	InboundStanzaCatcher(psiotr::OtrMessaging* otr, OtrRoutingTable* ARoutes, QObject* Aparent);
 	virtual bool stanzaEditImpl(int AHandleId, const Jid &AStreamJid, Stanza &AStanza, bool &AAccept);
+
+private slots:
+	// Decrypts the queued stanzas in batches per stream and re-injects them,
+	// yielding to the event loop when a slice of time is used up
+	void processQueue();
+
+private:
+	struct QueuedStanza
+	{
+		Jid streamJid;
+		Stanza stanza;
+	};
+
+	// True if a stanza of the contact waits in the queue
+	bool isQueued(const Jid &AStreamJid, const QString &AContact) const;
+
+	IStanzaProcessor* m_stanzaProcessor;
+	// Chat messages received during the current event loop iteration
+	QList<QueuedStanza> m_queue;
 };
 
 class OutboundStanzaCatcher: public StanzaCatcher
 {
+	Q_OBJECT
 public:
-	OutboundStanzaCatcher(psiotr::OtrMessaging* otr,IAccountManager* AAccountJid, QObject* Aparent);
+	OutboundStanzaCatcher(psiotr::OtrMessaging* otr, OtrRoutingTable* ARoutes, QObject* Aparent);
 	virtual bool stanzaEditImpl(int AHandleId, const Jid &AStreamJid, Stanza &AStanza, bool &AAccept);
+
+	// Sends the messages held for the conversation, once it is encrypted
+	void releaseHeld(const QString &AAccount, const QString &AContact);
+
+private slots:
+	// Sends released messages and gives up on those held too long
+	void processHeld();
+
+private:
+	// A message typed while the session with its recipient is being started
+	struct HeldStanza
+	{
+		Jid streamJid;
+		QString account;
+		QString contact;
+		Stanza stanza;
+		QElapsedTimer held;
+		bool released;
+	};
+
+	// Encrypts the body and adds the hints; false if the stanza must be dropped
+	bool encryptStanza(const QString &AAccount, const QString &AContact, Stanza &AStanza);
+	// True if messages to the conversation are held
+	bool isHolding(const QString &AAccount, const QString &AContact) const;
+	// Holds the stanza until the session is encrypted; false if too many are held
+	bool holdStanza(const Jid &AStreamJid, const QString &AAccount, const QString &AContact, const Stanza &AStanza);
+	// Appends a copy of AHint unless the stanza already carries it
+	static void appendHint(Stanza &AStanza, const QDomElement &AHint);
+
+	IStanzaProcessor* m_stanzaProcessor;
+	// Held messages in the order they were sent
+	QList<HeldStanza> m_held;
+	QTimer m_heldTimer;
+
+	QDomDocument m_hints;
+	QDomElement m_noCopy;
+	QDomElement m_noStore;
+	QDomElement m_private;
 };
 
 